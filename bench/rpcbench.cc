@@ -0,0 +1,270 @@
+// 端到端的RPC吞吐和延迟压测
+// 在同一个进程中启动一个发布EchoService的RpcProvider，再用异步调用保持固定数量的在途请求压测它，
+// 统计QPS和p50/p99/p999延迟。服务地址是固定的，不需要zookeeper，可以直接在CI上运行。
+
+#include "echo.pb.h"
+#include "rpcchannel.h"
+#include "rpcclosure.h"
+#include "rpcconfig.h"
+#include "rpccontroller.h"
+#include "rpcmetrics.h"
+#include "rpcprovider.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <glog/logging.h>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace
+{
+
+struct Options
+{
+    int concurrency = 64; // 在途调用数
+    int payload_size = 128; // 请求和响应的消息长度
+    int connections = 4; // 客户端到服务端的连接数
+    int duration = 10; // 统计的时长，秒
+    int warmup = 2; // 预热的时长，秒，不计入统计
+    int port = 18000;
+    int io_threads = 4; // 服务端IO线程数
+    int worker_threads = 0; // 服务端业务线程数，为0时Echo直接在IO线程中执行
+    int batch_window_us = 0; // 客户端自动批量发送的窗口，为0时不批量发送
+};
+
+void Usage(const char *prog)
+{
+    std::cerr << "usage: " << prog << " [-c concurrency] [-s payload_size] [-n connections] [-d duration_sec]"
+              << " [-w warmup_sec] [-p port] [-t io_threads] [-W worker_threads] [-b batch_window_us]" << std::endl;
+    exit(EXIT_FAILURE);
+}
+
+Options ParseOptions(int argc, char **argv)
+{
+    Options options;
+    int o;
+    while (-1 != (o = getopt(argc, argv, "c:s:n:d:w:p:t:W:b:"))) {
+        switch (o) {
+        case 'c':
+            options.concurrency = std::atoi(optarg);
+            break;
+        case 's':
+            options.payload_size = std::atoi(optarg);
+            break;
+        case 'n':
+            options.connections = std::atoi(optarg);
+            break;
+        case 'd':
+            options.duration = std::atoi(optarg);
+            break;
+        case 'w':
+            options.warmup = std::atoi(optarg);
+            break;
+        case 'p':
+            options.port = std::atoi(optarg);
+            break;
+        case 't':
+            options.io_threads = std::atoi(optarg);
+            break;
+        case 'W':
+            options.worker_threads = std::atoi(optarg);
+            break;
+        case 'b':
+            options.batch_window_us = std::atoi(optarg);
+            break;
+        default:
+            Usage(argv[0]);
+        }
+    }
+    if (options.concurrency <= 0 || options.payload_size < 0 || options.connections <= 0 || options.duration <= 0) {
+        Usage(argv[0]);
+    }
+    return options;
+}
+
+class EchoServiceImpl : public example::EchoService
+{
+public:
+    void Echo(google::protobuf::RpcController *controller, const example::EchoRequest *request,
+              example::EchoResponse *response, google::protobuf::Closure *done) override
+    {
+        response->set_message(request->message());
+        done->Run();
+    }
+};
+
+/**
+ * @brief 闭环压测：每个槽位上的调用结束后立即发起下一次调用，在途调用数始终等于并发数
+ */
+class Driver
+{
+public:
+    Driver(example::EchoService_Stub &stub, const Options &options)
+        : m_stub(stub)
+        , m_slots(options.concurrency)
+    {
+        std::string payload(options.payload_size, 'x');
+        for (auto &slot : m_slots) {
+            slot.request.set_message(payload);
+        }
+    }
+
+    void Start()
+    {
+        m_outstanding = static_cast<int>(m_slots.size());
+        for (auto &slot : m_slots) {
+            Issue(&slot);
+        }
+    }
+
+    // 开始统计，之前的调用只用于预热
+    void BeginMeasure()
+    {
+        m_begin = std::chrono::steady_clock::now();
+        m_measuring = true;
+    }
+
+    // 停止发起新的调用，等待在途调用全部结束
+    void Stop()
+    {
+        m_measuring = false;
+        m_end = std::chrono::steady_clock::now();
+        m_stopping = true;
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cond.wait(lock, [this] { return m_outstanding == 0; });
+    }
+
+    void Report(const Options &options) const
+    {
+        double seconds = std::chrono::duration<double>(m_end - m_begin).count();
+        meha::HistogramSnapshot latency = m_latency.Snapshot();
+        printf("concurrency=%d payload=%dB connections=%d io_threads=%d worker_threads=%d\n", options.concurrency,
+               options.payload_size, options.connections, options.io_threads, options.worker_threads);
+        printf("requests=%lu errors=%lu duration=%.2fs qps=%.0f\n", (unsigned long)m_completed.load(),
+               (unsigned long)m_errors.load(), seconds, m_completed.load() / seconds);
+        printf("latency(us) p50=%lu p99=%lu p999=%lu max=%lu\n", (unsigned long)latency.Percentile(0.5),
+               (unsigned long)latency.Percentile(0.99), (unsigned long)latency.Percentile(0.999), (unsigned long)latency.max);
+    }
+
+private:
+    struct Slot
+    {
+        meha::RpcController controller;
+        example::EchoRequest request;
+        example::EchoResponse response;
+        std::chrono::steady_clock::time_point start;
+    };
+
+    void Issue(Slot *slot)
+    {
+        slot->controller.Reset();
+        slot->response.Clear();
+        slot->start = std::chrono::steady_clock::now();
+        m_stub.Echo(&slot->controller, &slot->request, &slot->response, meha::NewClosure([this, slot] { OnDone(slot); }));
+    }
+
+    // 在客户端IO线程中执行
+    void OnDone(Slot *slot)
+    {
+        bool failed = slot->controller.Failed();
+        if (m_measuring) {
+            if (failed) {
+                m_errors.fetch_add(1, std::memory_order_relaxed);
+            } else {
+                m_completed.fetch_add(1, std::memory_order_relaxed);
+                m_latency.Record(std::chrono::steady_clock::now() - slot->start);
+            }
+        }
+        // 失败的调用可能是在CallMethod中同步结束的，继续发起会无限递归，所以这个槽位不再继续
+        if (m_stopping || failed) {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (--m_outstanding == 0) {
+                m_cond.notify_all();
+            }
+            return;
+        }
+        Issue(slot);
+    }
+
+    example::EchoService_Stub &m_stub;
+    std::vector<Slot> m_slots;
+    meha::Histogram m_latency;
+    std::atomic<uint64_t> m_completed = 0;
+    std::atomic<uint64_t> m_errors = 0;
+    std::atomic<bool> m_measuring = false;
+    std::atomic<bool> m_stopping = false;
+    std::chrono::steady_clock::time_point m_begin;
+    std::chrono::steady_clock::time_point m_end;
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    int m_outstanding = 0;
+};
+
+}
+
+int main(int argc, char **argv)
+{
+    using namespace meha;
+    Options options = ParseOptions(argc, argv);
+
+    google::InitGoogleLogging(argv[0]);
+    FLAGS_logtostderr = true;
+    FLAGS_minloglevel = google::GLOG_WARNING; // 压测时不打印INFO日志
+
+    // 不使用zookeeper，服务端和客户端的配置都在这里设置
+    RpcConfig &config = RpcConfig::Instance();
+    config.Set("rpc_registry", "static");
+    config.Set("rpc_registry_static.EchoService", "127.0.0.1:" + std::to_string(options.port));
+    config.Set("rpcserver_ip", "127.0.0.1");
+    config.Set("rpcserver_port", std::to_string(options.port));
+    config.Set("rpcserver_io_threads", std::to_string(options.io_threads));
+    config.Set("rpcserver_worker_threads", std::to_string(options.worker_threads));
+    config.Set("rpcclient_max_active_conns", std::to_string(options.connections));
+    config.Set("rpcclient_max_idle_conns", std::to_string(options.connections));
+    // 在途调用均匀地分到各个连接上，连接数很快就能增长到上限
+    config.Set("rpcclient_max_pending_per_conn", std::to_string(std::max(1, options.concurrency / options.connections)));
+    config.Set("rpcclient_batch_window_us", std::to_string(options.batch_window_us));
+
+    // RpcProvider的EventLoop需要在运行它的线程中创建
+    std::mutex mutex;
+    std::condition_variable cond;
+    RpcProvider *provider = nullptr;
+    std::thread server([&] {
+        RpcProvider local_provider("meha");
+        local_provider.RegisterService(std::make_unique<EchoServiceImpl>());
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            provider = &local_provider;
+        }
+        cond.notify_all();
+        local_provider.Run();
+    });
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        cond.wait(lock, [&] { return provider != nullptr; });
+    }
+    // 等待服务端开始监听，连接失败时客户端也会在连接超时之内重试
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+    RpcChannel channel;
+    example::EchoService_Stub stub(&channel);
+    Driver driver(stub, options);
+    driver.Start();
+    std::this_thread::sleep_for(std::chrono::seconds(options.warmup));
+    driver.BeginMeasure();
+    std::this_thread::sleep_for(std::chrono::seconds(options.duration));
+    driver.Stop();
+    driver.Report(options);
+
+    provider->Stop();
+    server.join();
+    return 0;
+}
@@ -0,0 +1,479 @@
+// tinyrpc的自检程序
+// 不需要网络和zookeeper，直接检查帧的切分与重组、并发限制对合成耗时序列的调整，以及流式调用的额度计算。
+// 每项检查失败时打印出错的位置，有检查失败时以非0退出，由ctest运行。
+
+#include "concurrencylimiter.h"
+#include "rpccodec.h"
+#include "rpcstream.h"
+#include "tinyrpcheader.pb.h"
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <glog/logging.h>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace
+{
+
+int g_failures = 0;
+
+#define SELFCHECK(cond)                                                                            \
+    do {                                                                                           \
+        if (!(cond)) {                                                                             \
+            ++g_failures;                                                                          \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " << #cond << std::endl; \
+        }                                                                                          \
+    } while (0)
+
+using meha::codec::DecodeStatus;
+
+char BodyByte(uint64_t call_id)
+{
+    return static_cast<char>('a' + call_id % 26);
+}
+
+// 编码一个请求帧，body为body_size个相同的字节
+std::string RequestFrame(uint64_t call_id, size_t body_size)
+{
+    tinyrpc::RpcHeader header;
+    header.set_call_id(call_id);
+    header.set_args_size(static_cast<uint32_t>(body_size));
+    std::string frame;
+    meha::codec::AppendFrame(header, std::string(body_size, BodyByte(call_id)), &frame);
+    return frame;
+}
+
+// 把字节流按chunk字节一段段追加到接收缓冲区，模拟TCP分段到达，每次都切分出所有完整的帧
+std::vector<std::pair<uint64_t, std::string>> Reassemble(const std::string &stream, size_t chunk, bool *ok)
+{
+    std::vector<std::pair<uint64_t, std::string>> frames;
+    std::string buffer;
+    for (size_t offset = 0; offset < stream.size(); offset += chunk) {
+        buffer.append(stream, offset, chunk);
+        size_t consumed = 0;
+        while (consumed < buffer.size()) {
+            tinyrpc::RpcHeader header;
+            size_t body_offset = 0;
+            size_t frame_size = 0;
+            auto status = meha::codec::ParseFrame(buffer.data() + consumed, buffer.size() - consumed, &header, &body_offset, &frame_size);
+            if (status == DecodeStatus::kIncomplete) {
+                break;
+            }
+            if (status == DecodeStatus::kError) {
+                *ok = false;
+                return frames;
+            }
+            frames.emplace_back(header.call_id(), buffer.substr(consumed + body_offset, frame_size - body_offset));
+            consumed += frame_size;
+        }
+        buffer.erase(0, consumed);
+    }
+    *ok = buffer.empty();
+    return frames;
+}
+
+void CheckReassembly()
+{
+    // 包括空body，以及长度的varint跨越一个字节的body
+    const std::vector<size_t> sizes = {0, 1, 127, 128, 4096, 100000};
+    std::string stream;
+    for (size_t i = 0; i < sizes.size(); ++i) {
+        stream += RequestFrame(i + 1, sizes[i]);
+    }
+    for (size_t chunk : {size_t(1), size_t(2), size_t(3), size_t(7), size_t(64), size_t(1500), stream.size()}) {
+        bool ok = false;
+        auto frames = Reassemble(stream, chunk, &ok);
+        SELFCHECK(ok);
+        SELFCHECK(frames.size() == sizes.size());
+        for (size_t i = 0; i < frames.size() && i < sizes.size(); ++i) {
+            SELFCHECK(frames[i].first == i + 1);
+            SELFCHECK(frames[i].second == std::string(sizes[i], BodyByte(i + 1)));
+        }
+    }
+}
+
+void CheckFrameLimits()
+{
+    using meha::codec::kMaxBodySize;
+    using meha::codec::kMaxHeaderSize;
+    tinyrpc::RpcHeader parsed;
+    size_t body_offset = 0;
+    size_t frame_size = 0;
+
+    // 长度恰好是kMaxHeaderSize的header可以解析，截掉最后一个字节时等待更多数据，再长一个字节就是格式错误
+    tinyrpc::RpcHeader header;
+    header.set_service_name(std::string(kMaxHeaderSize - 4, 's')); // 1字节的tag，3字节的长度
+    SELFCHECK(header.ByteSizeLong() == kMaxHeaderSize);
+    std::string frame;
+    meha::codec::AppendFrame(header, std::string(), &frame);
+    SELFCHECK(meha::codec::ParseFrame(frame.data(), frame.size(), &parsed, &body_offset, &frame_size) == DecodeStatus::kOk);
+    SELFCHECK(frame_size == frame.size());
+    SELFCHECK(meha::codec::ParseFrame(frame.data(), frame.size() - 1, &parsed, &body_offset, &frame_size) == DecodeStatus::kIncomplete);
+    header.mutable_service_name()->push_back('s');
+    frame.clear();
+    meha::codec::AppendFrame(header, std::string(), &frame);
+    SELFCHECK(meha::codec::ParseFrame(frame.data(), frame.size(), &parsed, &body_offset, &frame_size) == DecodeStatus::kError);
+
+    // body长度恰好是kMaxBodySize时等待body到达，超过时不再等待，直接是格式错误
+    header.Clear();
+    header.set_args_size(kMaxBodySize);
+    frame.clear();
+    meha::codec::AppendFrame(header, std::string(), &frame);
+    SELFCHECK(meha::codec::ParseFrame(frame.data(), frame.size(), &parsed, &body_offset, &frame_size) == DecodeStatus::kIncomplete);
+    header.set_args_size(kMaxBodySize + 1);
+    frame.clear();
+    meha::codec::AppendFrame(header, std::string(), &frame);
+    SELFCHECK(meha::codec::ParseFrame(frame.data(), frame.size(), &parsed, &body_offset, &frame_size) == DecodeStatus::kError);
+
+    // header_size的varint不足5个字节时可能只是没收全，5个字节还没结束就是格式错误
+    const std::string varint(5, '\x80');
+    SELFCHECK(meha::codec::ParseFrame(varint.data(), 4, &parsed, &body_offset, &frame_size) == DecodeStatus::kIncomplete);
+    SELFCHECK(meha::codec::ParseFrame(varint.data(), 5, &parsed, &body_offset, &frame_size) == DecodeStatus::kError);
+}
+
+void CheckBatchLimit()
+{
+    using meha::codec::kMaxBatchSize;
+    std::string frames;
+    size_t max_batch_len = 0;
+    for (uint32_t i = 0; i <= kMaxBatchSize; ++i) {
+        if (i == kMaxBatchSize) {
+            max_batch_len = frames.size();
+        }
+        frames += RequestFrame(i + 1, i % 8);
+    }
+
+    // 恰好kMaxBatchSize个子帧，按顺序逐个取出
+    uint32_t visited = 0;
+    bool ok = meha::codec::ForEachInBatch<tinyrpc::RpcHeader>(frames.data(), max_batch_len, kMaxBatchSize,
+                                                              [&visited](const tinyrpc::RpcHeader &sub, const char *body, size_t body_size) {
+                                                                  ++visited;
+                                                                  return sub.call_id() == visited && body_size == (visited - 1) % 8 &&
+                                                                         std::string(body, body_size) == std::string(body_size, BodyByte(visited));
+                                                              });
+    SELFCHECK(ok);
+    SELFCHECK(visited == kMaxBatchSize);
+    auto accept = [](const tinyrpc::RpcHeader &, const char *, size_t) { return true; };
+    // 超过上限的批量帧直接拒绝
+    SELFCHECK(!meha::codec::ForEachInBatch<tinyrpc::RpcHeader>(frames.data(), frames.size(), kMaxBatchSize + 1, accept));
+    // batch_size和实际的子帧数不一致
+    SELFCHECK(!meha::codec::ForEachInBatch<tinyrpc::RpcHeader>(frames.data(), max_batch_len, kMaxBatchSize - 1, accept));
+    // 批量帧中不完整的子帧是格式错误
+    SELFCHECK(!meha::codec::ForEachInBatch<tinyrpc::RpcHeader>(frames.data(), max_batch_len - 1, kMaxBatchSize, accept));
+
+    // 整个批量帧作为一帧切分出来
+    tinyrpc::RpcHeader header;
+    header.set_batch_size(kMaxBatchSize);
+    header.set_args_size(static_cast<uint32_t>(max_batch_len));
+    std::string batch;
+    meha::codec::AppendFrame(header, frames.substr(0, max_batch_len), &batch);
+    tinyrpc::RpcHeader parsed;
+    size_t body_offset = 0;
+    size_t frame_size = 0;
+    SELFCHECK(meha::codec::ParseFrame(batch.data(), batch.size(), &parsed, &body_offset, &frame_size) == DecodeStatus::kOk);
+    SELFCHECK(frame_size == batch.size());
+    SELFCHECK(parsed.batch_size() == kMaxBatchSize);
+}
+
+using meha::ConcurrencyLimiter;
+using Latency = std::function<std::chrono::microseconds(size_t)>;
+
+meha::ConcurrencyLimiter::Options LimiterOptions()
+{
+    ConcurrencyLimiter::Options options;
+    options.min_limit = 8;
+    options.max_limit = 1000;
+    options.initial_limit = 64;
+    return options;
+}
+
+/**
+ * @brief 让限制器一直保持满载，按latency给出的耗时逐个结束请求，每结束一个就补满名额
+ * @param keys 第i个样本的类别为keys[i % keys.size()]，模拟多个方法混在一起的流量
+ * @return 最后的名额数
+ */
+size_t Drive(ConcurrencyLimiter &limiter, size_t samples, const Latency &latency, const std::vector<const void *> &keys = {nullptr},
+             ConcurrencyLimiter::Outcome outcome = ConcurrencyLimiter::Outcome::kCompleted)
+{
+    size_t held = 0;
+    for (size_t i = 0; i < samples; ++i) {
+        while (limiter.TryAcquire()) {
+            ++held;
+        }
+        if (held == 0) {
+            continue;
+        }
+        limiter.Release(latency(i), outcome, keys[i % keys.size()]);
+        --held;
+    }
+    for (; held > 0; --held) {
+        limiter.Release(std::chrono::steady_clock::duration::zero(), ConcurrencyLimiter::Outcome::kSkipped);
+    }
+    return limiter.Limit();
+}
+
+Latency Constant(std::chrono::microseconds latency)
+{
+    return [latency](size_t) { return latency; };
+}
+
+// 快慢相差100倍的两个方法交替出现
+Latency Mixed()
+{
+    return [](size_t i) { return i % 2 == 0 ? std::chrono::microseconds(100) : std::chrono::microseconds(10000); };
+}
+
+// 平时1毫秒，偶尔出现一个极快的请求（例如命中缓存）
+Latency WithFastOutliers()
+{
+    return [](size_t i) { return i % 100 == 0 ? std::chrono::microseconds(1) : std::chrono::microseconds(1000); };
+}
+
+void CheckLatencyBaseline()
+{
+    meha::LatencyBaseline baseline;
+    double ratio = 0;
+    for (size_t i = 0; i < meha::LatencyBaseline::kWindowSamples; ++i) {
+        ratio = baseline.Sample(1e6);
+    }
+    SELFCHECK(ratio > 0.99 && ratio < 1.01);
+    // 耗时翻倍，近期耗时很快超过基线
+    for (size_t i = 0; i < 50; ++i) {
+        ratio = baseline.Sample(2e6);
+    }
+    SELFCHECK(ratio > 1.9);
+    // 服务本身变慢之后，最多两个窗口基线就跟上了
+    for (size_t i = 0; i < 2 * meha::LatencyBaseline::kWindowSamples; ++i) {
+        ratio = baseline.Sample(2e6);
+    }
+    SELFCHECK(ratio > 0.99 && ratio < 1.01);
+}
+
+void CheckAimd()
+{
+    const auto options = LimiterOptions();
+    const void *fast = &options.min_limit;
+    const void *slow = &options.max_limit;
+    {
+        // 耗时平稳时名额缓慢增长
+        meha::AimdLimiter limiter(options);
+        size_t steady = Drive(limiter, 20000, Constant(std::chrono::microseconds(1000)));
+        SELFCHECK(steady > 100);
+        // 耗时变为10倍后名额减少，但一轮请求内最多减少一次，不会一下子压到最小
+        size_t slowed = Drive(limiter, 500, Constant(std::chrono::microseconds(10000)));
+        SELFCHECK(slowed < steady);
+        SELFCHECK(slowed > options.min_limit);
+    }
+    {
+        // 快慢不同的方法混在一起，各自的耗时都平稳，名额不能被当作过载而压到最小
+        meha::AimdLimiter limiter(options);
+        SELFCHECK(Drive(limiter, 20000, Mixed(), {fast, slow}) > options.initial_limit);
+    }
+    {
+        meha::AimdLimiter limiter(options);
+        SELFCHECK(Drive(limiter, 20000, WithFastOutliers()) > options.initial_limit);
+    }
+    {
+        // 持续的排队超时把名额压到下限，但不会更低
+        meha::AimdLimiter limiter(options);
+        SELFCHECK(Drive(limiter, 20000, Constant(std::chrono::microseconds(1000)), {nullptr}, ConcurrencyLimiter::Outcome::kDropped) == options.min_limit);
+    }
+    {
+        // 没有执行服务方法的请求不是样本
+        meha::AimdLimiter limiter(options);
+        SELFCHECK(Drive(limiter, 20000, Constant(std::chrono::microseconds(1)), {nullptr}, ConcurrencyLimiter::Outcome::kSkipped) == options.initial_limit);
+    }
+    {
+        // 配置了耗时阈值时，超过阈值就是过载
+        auto threshold_options = options;
+        threshold_options.latency_threshold = std::chrono::milliseconds(5);
+        meha::AimdLimiter limiter(threshold_options);
+        SELFCHECK(Drive(limiter, 20000, Constant(std::chrono::microseconds(10000))) == options.min_limit);
+    }
+}
+
+void CheckGradient()
+{
+    const auto options = LimiterOptions();
+    const void *fast = &options.min_limit;
+    const void *slow = &options.max_limit;
+    {
+        // 耗时平稳时名额增长到上限附近，耗时上升后收缩
+        meha::GradientLimiter limiter(options);
+        size_t steady = Drive(limiter, 20000, Constant(std::chrono::microseconds(1000)));
+        SELFCHECK(steady > 500);
+        size_t slowed = Drive(limiter, 500, Constant(std::chrono::microseconds(5000)));
+        SELFCHECK(slowed < steady / 2);
+        SELFCHECK(slowed >= options.min_limit);
+    }
+    {
+        meha::GradientLimiter limiter(options);
+        SELFCHECK(Drive(limiter, 20000, Mixed(), {fast, slow}) > 500);
+    }
+    {
+        meha::GradientLimiter limiter(options);
+        SELFCHECK(Drive(limiter, 20000, WithFastOutliers()) > 500);
+    }
+    {
+        meha::GradientLimiter limiter(options);
+        SELFCHECK(Drive(limiter, 20000, Constant(std::chrono::microseconds(1000)), {nullptr}, ConcurrencyLimiter::Outcome::kDropped) == options.min_limit);
+    }
+}
+
+}
+
+namespace meha
+{
+
+/// @brief 流式调用服务端的额度计算，直接构造ServerStream，收到的帧由测试代码送入，发出的帧记录下来检查
+class StreamSelfCheck
+{
+public:
+    static void Run()
+    {
+        CheckSendCredit();
+        CheckRecvCredit();
+        CheckHalfClose();
+    }
+
+private:
+    static constexpr uint32_t kWindow = 4;
+
+    // 客户端在流上发送的一条消息，消息类型借用RpcHeader，method_id作为消息的序号
+    static std::string ClientMessage(uint32_t seq, tinyrpc::RpcHeader *header)
+    {
+        tinyrpc::RpcHeader message;
+        message.set_method_id(seq);
+        header->Clear();
+        header->set_call_id(1);
+        header->set_stream_op(tinyrpc::STREAM_MESSAGE);
+        header->set_args_size(static_cast<uint32_t>(message.ByteSizeLong()));
+        return message.SerializeAsString();
+    }
+
+    static void Deliver(ServerStream &stream, uint32_t seq)
+    {
+        tinyrpc::RpcHeader header;
+        std::string body = ClientMessage(seq, &header);
+        stream.OnFrame(header, body.data(), body.size());
+    }
+
+    static void Control(ServerStream &stream, tinyrpc::StreamOp op, uint32_t credit = 0)
+    {
+        tinyrpc::RpcHeader header;
+        header.set_call_id(1);
+        header.set_stream_op(op);
+        header.set_credit(credit);
+        stream.OnFrame(header, nullptr, 0);
+    }
+
+    // 取出服务端发出的帧的header
+    static std::vector<tinyrpc::RpcResponseHeader> Decode(const std::vector<std::string> &frames)
+    {
+        std::vector<tinyrpc::RpcResponseHeader> headers;
+        for (const auto &frame : frames) {
+            tinyrpc::RpcResponseHeader header;
+            size_t body_offset = 0;
+            size_t frame_size = 0;
+            SELFCHECK(codec::ParseFrame(frame.data(), frame.size(), &header, &body_offset, &frame_size) == codec::DecodeStatus::kOk);
+            headers.push_back(header);
+        }
+        return headers;
+    }
+
+    // 初始额度用完之后Write阻塞，收到额度帧之后才能继续
+    static void CheckSendCredit()
+    {
+        std::vector<std::string> sent;
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(100);
+        ServerStream stream(1, &tinyrpc::RpcHeader::default_instance(), kWindow, tinyrpc::COMPRESS_NONE, deadline,
+                            [&sent](std::string frame) { sent.push_back(std::move(frame)); });
+        tinyrpc::RpcHeader message;
+        for (uint32_t i = 0; i < kWindow; ++i) {
+            SELFCHECK(stream.Write(message));
+        }
+        // 没有额度，一直等到截止时间
+        SELFCHECK(!stream.Write(message));
+        Control(stream, tinyrpc::STREAM_CREDIT, 2);
+        SELFCHECK(stream.Write(message));
+        SELFCHECK(stream.Write(message));
+        SELFCHECK(!stream.Write(message));
+        auto headers = Decode(sent);
+        SELFCHECK(headers.size() == kWindow + 2);
+        for (const auto &header : headers) {
+            SELFCHECK(header.stream_op() == tinyrpc::STREAM_MESSAGE);
+        }
+    }
+
+    // 每读完半个窗口归还一次额度；客户端超出额度发送消息是协议错误，流被关闭
+    static void CheckRecvCredit()
+    {
+        std::vector<std::string> sent;
+        ServerStream stream(1, &tinyrpc::RpcHeader::default_instance(), kWindow, tinyrpc::COMPRESS_NONE, std::nullopt,
+                            [&sent](std::string frame) { sent.push_back(std::move(frame)); });
+        uint32_t seq = 0;
+        for (uint32_t i = 0; i < kWindow; ++i) {
+            Deliver(stream, ++seq);
+        }
+        tinyrpc::RpcHeader message;
+        SELFCHECK(stream.Read(&message) && message.method_id() == 1);
+        SELFCHECK(sent.empty());
+        SELFCHECK(stream.Read(&message) && message.method_id() == 2);
+        auto headers = Decode(sent);
+        SELFCHECK(headers.size() == 1);
+        if (headers.size() == 1) {
+            SELFCHECK(headers[0].stream_op() == tinyrpc::STREAM_CREDIT);
+            SELFCHECK(headers[0].credit() == kWindow / 2);
+        }
+        // 归还的额度刚好够再发两条
+        Deliver(stream, ++seq);
+        Deliver(stream, ++seq);
+        SELFCHECK(!stream.IsCanceled());
+        Deliver(stream, ++seq);
+        SELFCHECK(stream.IsCanceled());
+        SELFCHECK(!stream.Read(&message));
+    }
+
+    // 半关闭之后读完剩下的消息，Read返回false，不再归还额度
+    static void CheckHalfClose()
+    {
+        std::vector<std::string> sent;
+        ServerStream stream(1, &tinyrpc::RpcHeader::default_instance(), kWindow, tinyrpc::COMPRESS_NONE, std::nullopt,
+                            [&sent](std::string frame) { sent.push_back(std::move(frame)); });
+        Deliver(stream, 1);
+        Deliver(stream, 2);
+        Control(stream, tinyrpc::STREAM_HALF_CLOSE);
+        tinyrpc::RpcHeader message;
+        SELFCHECK(stream.Read(&message) && message.method_id() == 1);
+        SELFCHECK(stream.Read(&message) && message.method_id() == 2);
+        SELFCHECK(!stream.Read(&message));
+        SELFCHECK(sent.empty());
+        SELFCHECK(!stream.IsCanceled());
+    }
+};
+
+}
+
+int main(int argc, char **argv)
+{
+    google::InitGoogleLogging(argv[0]);
+    FLAGS_logtostderr = true;
+
+    CheckReassembly();
+    CheckFrameLimits();
+    CheckBatchLimit();
+    CheckLatencyBaseline();
+    CheckAimd();
+    CheckGradient();
+    meha::StreamSelfCheck::Run();
+
+    if (g_failures > 0) {
+        std::cerr << g_failures << " checks failed" << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::cout << "all checks passed" << std::endl;
+    return 0;
+}
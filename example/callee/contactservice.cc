@@ -3,6 +3,7 @@
 #include "rpcconfig.h"
 #include "rpccontroller.h"
 #include "rpcprovider.h"
+#include "rpcstream.h"
 #include "user.pb.h"
 #include <glog/logging.h>
 #include <string>
@@ -37,6 +38,23 @@ public:
         done->Run();
     }
 
+    void StreamContactList(::google::protobuf::RpcController *controller,
+                           const ::example::GetContactListRequest *request,
+                           ::example::Contact *response,
+                           ::google::protobuf::Closure *done) override
+    {
+        meha::ServerStream *stream = meha::ServerStream::From(controller);
+        for (std::string &name : GetContactList(request->uid())) {
+            example::Contact contact;
+            contact.set_name(name);
+            // 客户端取消了调用或者已经断开时不必再发送
+            if (!stream->Write(contact)) {
+                break;
+            }
+        }
+        done->Run();
+    }
+
 protected:
     std::vector<std::string> GetContactList(uint32_t uid)
     {
@@ -1,4 +1,6 @@
+#include <csignal>
 #include <string>
+#include <thread>
 #include <glog/logging.h>
 #include <google/protobuf/service.h>
 #include "rpcconfig.h"
@@ -153,12 +155,27 @@ int main(int argc, char **argv)
     // 调用框架的初始化操作
     RpcConfig::ParseCmd(argc, argv);
 
+    // 收到SIGTERM或SIGINT时优雅停止。信号需要在创建其他线程之前屏蔽，由专门的线程同步等待，
+    // Drain会加锁，不能在信号处理函数中调用
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
     // provider是一个rpc网络服务对象。把UserService和EchoService对象都发布到rpc节点127.0.0.1:8000上
     RpcProvider provider("meha");
     provider.RegisterService(std::make_unique<UserService>());
     provider.RegisterService(std::make_unique<EchoService>());
 
-    // 启动一个rpc服务发布节点 Run以后，进程进入阻塞状态，等待远程的rpc调用请求
+    std::thread([&provider, signals] {
+        int sig = 0;
+        sigwait(&signals, &sig);
+        LOG(WARNING) << "receive signal " << sig << ", draining";
+        provider.Drain();
+    }).detach();
+
+    // 启动一个rpc服务发布节点 Run以后，进程进入阻塞状态，等待远程的rpc调用请求，Drain结束后返回
     provider.Run();
     return 0;
 }
\ No newline at end of file
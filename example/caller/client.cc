@@ -3,6 +3,8 @@
 #include "rpcchannel.h"
 #include "rpcconfig.h"
 #include "rpccontroller.h"
+#include "rpcfuture.h"
+#include "rpcstream.h"
 #include "user.pb.h"
 #include <glog/logging.h>
 
@@ -65,10 +67,54 @@ void test_service_call_another_service()
     delete channel;
 }
 
+void test_async_fan_out()
+{
+    LOG(WARNING) << "========= " << __PRETTY_FUNCTION__ << " =========";
+    RpcChannel channel;
+    example::EchoService_Stub echo_stub(&channel);
+
+    // 同时发起多个调用，它们共用连接池中的连接，不需要为每个调用占用一个线程
+    std::vector<example::EchoRequest> reqs(16);
+    std::vector<std::future<RpcResult<example::EchoResponse>>> futures;
+    for (size_t i = 0; i < reqs.size(); ++i) {
+        reqs[i].set_message("async-" + std::to_string(i));
+        futures.push_back(CallAsync(echo_stub, &example::EchoService_Stub::Echo, reqs[i]));
+    }
+    for (auto &future : futures) {
+        auto result = future.get();
+        if (!result.ok) {
+            LOG(ERROR) << result.error_text;
+            exit(EXIT_FAILURE);
+        }
+        LOG(INFO) << "echo: " << result.response.message();
+    }
+}
+
+void test_stream_contact_list()
+{
+    LOG(WARNING) << "========= " << __PRETTY_FUNCTION__ << " =========";
+    RpcChannel channel;
+    RpcController stream_controller;
+    example::GetContactListRequest req;
+    req.set_uid(1);
+    // 流式方法不能通过Stub调用，联系人逐个到达，不需要等服务端准备好完整的列表
+    ClientStream stream(&channel, example::ContactService::descriptor()->FindMethodByName("StreamContactList"), &stream_controller, req);
+    example::Contact contact;
+    while (stream.Read(&contact)) {
+        LOG(INFO) << "contact :" << contact.name();
+    }
+    if (!stream.Finish()) {
+        LOG(ERROR) << stream_controller.ErrorText();
+        exit(EXIT_FAILURE);
+    }
+}
+
 int main(int argc, char **argv)
 {
     RpcConfig::ParseCmd(argc, argv);
     test_client_call_service();
+    test_async_fan_out();
+    test_stream_contact_list();
     test_service_call_another_service();
     return 0;
 }
\ No newline at end of file
@@ -3,6 +3,7 @@
 generate_proto() {
     local proto_dir=$1
     local output_dir=$2
+    local import_dir=${3:-$proto_dir}
 
     if [ ! -d "$proto_dir" ]; then
         echo "Error: proto directory $proto_dir does not exist."
@@ -14,7 +15,7 @@ generate_proto() {
     fi
 
     for proto_file in $proto_dir/*.proto; do
-        protoc -I $proto_dir --cpp_out=$output_dir $(basename $proto_file)
+        protoc -I $proto_dir -I $import_dir --cpp_out=$output_dir $(basename $proto_file)
     done
 }
 
@@ -32,5 +33,6 @@ if [ "$1" == "clean" ]; then
     clean_generated_files example/gen
 else
     generate_proto src/proto src/gen
-    generate_proto example/proto example/gen
+    # 示例的proto可能引用src/proto中的tinyrpcoptions.proto
+    generate_proto example/proto example/gen src/proto
 fi
@@ -0,0 +1,169 @@
+#include "concurrencylimiter.h"
+#include "rpcconfig.h"
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <glog/logging.h>
+
+using namespace meha;
+
+ConcurrencyLimiter::Options ConcurrencyLimiter::Options::FromConfig()
+{
+    Options options;
+    const Options defaults;
+    auto &config = RpcConfig::Instance();
+    options.min_limit = config.LookupCount("rpcserver_limit_min", defaults.min_limit, 1);
+    options.max_limit = config.LookupCount("rpcserver_limit_max", defaults.max_limit, 1);
+    options.initial_limit = config.LookupCount("rpcserver_limit_initial", defaults.initial_limit, 1);
+    options.latency_threshold = std::chrono::milliseconds(config.LookupCount("rpcserver_limit_latency_ms", 0, 0));
+    if (options.min_limit > options.max_limit) {
+        // 只配置了较小的rpcserver_limit_max时，默认的下限跟着降低，不算配置错误
+        size_t min_limit = std::min(defaults.min_limit, options.max_limit);
+        if (config.Lookup("rpcserver_limit_min")) {
+            LOG(ERROR) << "config rpcserver_limit_min=" << options.min_limit << " is greater than rpcserver_limit_max=" << options.max_limit << ", use "
+                       << min_limit;
+        }
+        options.min_limit = min_limit;
+    }
+    if (options.initial_limit < options.min_limit || options.initial_limit > options.max_limit) {
+        size_t initial_limit = std::clamp(options.initial_limit, options.min_limit, options.max_limit);
+        if (config.Lookup("rpcserver_limit_initial")) {
+            LOG(ERROR) << "config rpcserver_limit_initial=" << options.initial_limit << " is out of [" << options.min_limit << ", " << options.max_limit
+                       << "], use " << initial_limit;
+        }
+        options.initial_limit = initial_limit;
+    }
+    return options;
+}
+
+std::unique_ptr<ConcurrencyLimiter> ConcurrencyLimiter::Create(const std::string &spec, const Options &options)
+{
+    if (spec.empty() || spec == "none") {
+        return nullptr;
+    }
+    if (spec == "aimd") {
+        return std::make_unique<AimdLimiter>(options);
+    }
+    if (spec == "gradient") {
+        return std::make_unique<GradientLimiter>(options);
+    }
+    size_t limit = 0;
+    auto [end, ec] = std::from_chars(spec.data(), spec.data() + spec.size(), limit);
+    if (ec != std::errc() || end != spec.data() + spec.size() || limit == 0) {
+        LOG(ERROR) << "invalid concurrency limit " << spec << ", not limited";
+        return nullptr;
+    }
+    return std::make_unique<StaticLimiter>(limit);
+}
+
+bool ConcurrencyLimiter::TryAcquire()
+{
+    size_t in_flight = m_in_flight.fetch_add(1, std::memory_order_relaxed);
+    if (in_flight >= m_limit.load(std::memory_order_relaxed)) {
+        m_in_flight.fetch_sub(1, std::memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+void ConcurrencyLimiter::Release(std::chrono::steady_clock::duration latency, Outcome outcome, const void *key)
+{
+    size_t in_flight = m_in_flight.fetch_sub(1, std::memory_order_relaxed) - 1;
+    if (outcome != Outcome::kSkipped) {
+        OnSample(latency, outcome == Outcome::kDropped, key, in_flight);
+    }
+}
+
+double LatencyBaseline::Sample(double rtt)
+{
+    if (m_short_rtt == 0) {
+        m_short_rtt = m_window_min = rtt;
+    } else {
+        m_short_rtt += (rtt - m_short_rtt) * kShortAlpha;
+        m_window_min = std::min(m_window_min, m_short_rtt);
+    }
+    double baseline = m_previous_min > 0 ? std::min(m_previous_min, m_window_min) : m_window_min;
+    if (++m_window_samples >= kWindowSamples) {
+        m_previous_min = m_window_min;
+        m_window_min = m_short_rtt;
+        m_window_samples = 0;
+    }
+    return baseline > 0 ? m_short_rtt / baseline : 1.0;
+}
+
+AimdLimiter::AimdLimiter(const Options &options)
+    : ConcurrencyLimiter(options.initial_limit)
+    , m_options(options)
+{
+}
+
+void AimdLimiter::OnSample(std::chrono::steady_clock::duration latency, bool dropped, const void *key, size_t in_flight)
+{
+    std::unique_lock<std::mutex> lock(m_mutex, std::try_to_lock);
+    if (!lock.owns_lock()) {
+        return;
+    }
+    size_t limit = m_limit.load(std::memory_order_relaxed);
+    // 被丢弃的请求没有执行，它的耗时只是排队的时间，不计入基线
+    bool overloaded = dropped || Overloaded(latency, key);
+    if (m_cooldown > 0) {
+        --m_cooldown;
+        if (overloaded) {
+            return;
+        }
+    }
+    if (overloaded) {
+        m_successes = 0;
+        size_t new_limit = std::max(m_options.min_limit, static_cast<size_t>(limit * kBackoffRatio));
+        m_cooldown = new_limit;
+        m_limit.store(new_limit, std::memory_order_relaxed);
+        return;
+    }
+    // 名额远没有用完时请求成功不能说明能承受更多的并发，不增加名额
+    if (in_flight * 2 < limit) {
+        return;
+    }
+    if (++m_successes >= limit) {
+        m_successes = 0;
+        m_limit.store(std::min(m_options.max_limit, limit + 1), std::memory_order_relaxed);
+    }
+}
+
+bool AimdLimiter::Overloaded(std::chrono::steady_clock::duration latency, const void *key)
+{
+    if (m_options.latency_threshold.count() > 0) {
+        return latency > m_options.latency_threshold;
+    }
+    // 和GradientLimiter一样比较近期耗时和基线，近期耗时明显变长说明开始排队了
+    double rtt = static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(latency).count());
+    return m_baselines.Sample(key, rtt) > kTolerance;
+}
+
+GradientLimiter::GradientLimiter(const Options &options)
+    : ConcurrencyLimiter(options.initial_limit)
+    , m_options(options)
+    , m_limit_value(static_cast<double>(options.initial_limit))
+{
+}
+
+void GradientLimiter::OnSample(std::chrono::steady_clock::duration latency, bool dropped, const void *key, size_t in_flight)
+{
+    std::unique_lock<std::mutex> lock(m_mutex, std::try_to_lock);
+    if (!lock.owns_lock()) {
+        return;
+    }
+    double gradient = 0.5;
+    if (!dropped) {
+        // 被丢弃的请求没有执行，它的耗时只是排队的时间，不计入基线
+        double rtt = static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(latency).count());
+        gradient = std::clamp(kTolerance / m_baselines.Sample(key, rtt), 0.5, 1.0);
+    }
+    // 名额远没有用完时不放大，否则空闲期间名额会无限增长，负载上来时来不及收缩
+    double target = m_limit_value * gradient;
+    if (gradient >= 1.0 && in_flight * 2 >= m_limit_value) {
+        target += std::sqrt(m_limit_value);
+    }
+    m_limit_value += (target - m_limit_value) * kSmoothing;
+    m_limit_value = std::clamp(m_limit_value, static_cast<double>(m_options.min_limit), static_cast<double>(m_options.max_limit));
+    m_limit.store(static_cast<size_t>(m_limit_value), std::memory_order_relaxed);
+}
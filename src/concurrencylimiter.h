@@ -0,0 +1,172 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace meha
+{
+
+/**
+ * @brief 服务端的并发限制
+ * @details 请求开始处理前通过TryAcquire占用一个名额，名额用完时请求被直接拒绝（RPC_OVERLOADED），
+ * 客户端可以换一个实例重试，而不是让请求在队列中越积越多、所有请求一起超时。
+ * 名额数可以是固定的，也可以根据请求的耗时自适应地调整：
+ * aimd：请求耗时正常就缓慢增加名额，出现排队超时或者耗时过长的请求就按比例减少。耗时过长的标准是
+ * 超过rpcserver_limit_latency_ms，没有配置时是近期耗时超过基线的若干倍；
+ * gradient：比较近期的耗时和基线，耗时上升说明开始排队了，按比例收缩名额，耗时平稳时逐步放大。
+ * 只有服务方法执行完的请求作为耗时样本，基线按样本的类别（方法）分别维护，见LatencyBaseline。
+ * 自适应调整只在拿到锁时进行，拿不到锁的样本直接丢弃，不会让请求互相等待。
+ */
+class ConcurrencyLimiter
+{
+public:
+    /// @brief 自适应限制的参数，从RpcConfig中读取rpcserver_limit_min/rpcserver_limit_max/rpcserver_limit_initial/rpcserver_limit_latency_ms
+    struct Options
+    {
+        size_t min_limit = 8;
+        size_t max_limit = 1000;
+        size_t initial_limit = 64;
+        // aimd中耗时超过它的请求视为过载，为0时和耗时的基线比较
+        std::chrono::milliseconds latency_threshold{0};
+
+        static Options FromConfig();
+    };
+
+    /// @brief 请求结束的方式，只有服务方法执行完的请求的耗时能反映服务端的负载
+    enum class Outcome {
+        kCompleted, // 服务方法执行完
+        kDropped, // 排队超过截止时间被丢弃，是过载的信号
+        kSkipped, // 没有执行服务方法（被拒绝、解析失败、服务端停止等），或者是耗时由客户端决定的流式调用，不作为样本
+    };
+
+    virtual ~ConcurrencyLimiter() = default;
+
+    // 尝试占用一个名额，返回false时应当拒绝请求
+    bool TryAcquire();
+    /**
+     * @brief 请求结束时归还名额
+     * @param latency 请求在服务端的耗时，包括排队的时间
+     * @param outcome 请求结束的方式
+     * @param key 样本的类别，通常是方法，每个类别单独维护耗时的基线
+     */
+    void Release(std::chrono::steady_clock::duration latency, Outcome outcome, const void *key = nullptr);
+
+    size_t Limit() const { return m_limit.load(std::memory_order_relaxed); }
+    size_t InFlight() const { return m_in_flight.load(std::memory_order_relaxed); }
+
+    /**
+     * @brief 按配置创建限制器
+     * @param spec none或者空：不限制，返回nullptr；数字：固定的名额数；aimd、gradient：自适应
+     */
+    static std::unique_ptr<ConcurrencyLimiter> Create(const std::string &spec, const Options &options = Options::FromConfig());
+
+protected:
+    explicit ConcurrencyLimiter(size_t limit)
+        : m_limit(limit)
+    {
+    }
+    // 根据一个样本调整m_limit，in_flight是样本结束时的在途请求数
+    virtual void OnSample(std::chrono::steady_clock::duration latency, bool dropped, const void *key, size_t in_flight) {}
+
+    std::atomic<size_t> m_limit;
+
+private:
+    std::atomic<size_t> m_in_flight = 0;
+};
+
+/// @brief 固定名额数
+class StaticLimiter : public ConcurrencyLimiter
+{
+public:
+    explicit StaticLimiter(size_t limit)
+        : ConcurrencyLimiter(limit)
+    {
+    }
+};
+
+/**
+ * @brief 一类请求的耗时基线
+ * @details 近期耗时是样本的指数平均，基线是最近两个窗口（每个kWindowSamples个样本）内近期耗时的最小值。
+ * 取平均之后的最小值，偶然的一个快请求不会把基线拉低；按窗口滚动，服务本身变慢之后基线也能跟上。
+ * 耗时相差很大的方法混在一起时，快方法的耗时会被当作慢方法的基线，所以每个方法单独维护一份。
+ */
+class LatencyBaseline
+{
+public:
+    static constexpr size_t kWindowSamples = 1000;
+
+    // 加入一个样本（纳秒），返回近期耗时是基线的多少倍
+    double Sample(double rtt);
+
+private:
+    static constexpr double kShortAlpha = 0.1; // 近期耗时的平滑系数
+
+    double m_short_rtt = 0;
+    double m_window_min = 0; // 当前窗口内近期耗时的最小值
+    double m_previous_min = 0; // 上一个窗口的最小值，为0表示还没有
+    size_t m_window_samples = 0;
+};
+
+/// @brief 按类别维护的耗时基线
+class LatencyBaselines
+{
+public:
+    double Sample(const void *key, double rtt) { return m_baselines[key].Sample(rtt); }
+
+private:
+    std::unordered_map<const void *, LatencyBaseline> m_baselines;
+};
+
+/// @brief 加性增、乘性减
+class AimdLimiter : public ConcurrencyLimiter
+{
+public:
+    explicit AimdLimiter(const Options &options);
+
+protected:
+    void OnSample(std::chrono::steady_clock::duration latency, bool dropped, const void *key, size_t in_flight) override;
+
+private:
+    static constexpr double kBackoffRatio = 0.9;
+    static constexpr double kTolerance = 2.0; // 没有配置耗时阈值时，近期耗时超过基线的这个倍数视为过载
+
+    // 根据样本判断是否过载，更新耗时的统计
+    bool Overloaded(std::chrono::steady_clock::duration latency, const void *key);
+
+    Options m_options;
+    std::mutex m_mutex; // 保护下面的成员
+    size_t m_successes = 0; // 上次增加名额之后成功的请求数，攒够当前名额数时名额加一
+    size_t m_cooldown = 0; // 减少名额之后还要忽略的过载样本数，一轮请求内最多减少一次，避免名额被连续的慢请求一下子压到最小
+    LatencyBaselines m_baselines;
+};
+
+/**
+ * @brief 根据耗时的梯度调整名额
+ * @details new_limit = limit * (baseline * tolerance / short_rtt) + sqrt(limit)，
+ * 其中short_rtt是样本所属方法的近期耗时，baseline是它的耗时基线（见LatencyBaseline）。
+ * sqrt(limit)是允许的排队数，保证名额在耗时平稳时能够增长。
+ */
+class GradientLimiter : public ConcurrencyLimiter
+{
+public:
+    explicit GradientLimiter(const Options &options);
+
+protected:
+    void OnSample(std::chrono::steady_clock::duration latency, bool dropped, const void *key, size_t in_flight) override;
+
+private:
+    static constexpr double kTolerance = 1.5; // 近期耗时不超过基线的这个倍数时认为没有排队
+    static constexpr double kSmoothing = 0.2; // 每次调整只向目标值移动这么多
+
+    Options m_options;
+    std::mutex m_mutex; // 保护下面的成员
+    double m_limit_value; // 名额数的浮点值，m_limit是它取整的结果
+    LatencyBaselines m_baselines;
+};
+
+}
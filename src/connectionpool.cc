@@ -0,0 +1,105 @@
+#include "connectionpool.h"
+#include "rpcconfig.h"
+#include "unixsocket.h"
+#include <algorithm>
+#include <glog/logging.h>
+
+using namespace meha;
+
+ConnectionPool::Options ConnectionPool::Options::FromConfig()
+{
+    Options options;
+    auto &config = RpcConfig::Instance();
+    options.max_idle = config.LookupCount("rpcclient_max_idle_conns", options.max_idle, 0);
+    options.max_active = config.LookupCount("rpcclient_max_active_conns", options.max_active, 1);
+    options.max_pending_per_conn = config.LookupCount("rpcclient_max_pending_per_conn", options.max_pending_per_conn, 1);
+    options.idle_timeout = std::chrono::milliseconds(config.LookupInt("rpcclient_idle_timeout_ms", options.idle_timeout.count()));
+    options.connect_timeout = std::chrono::milliseconds(config.LookupInt("rpcclient_connect_timeout_ms", options.connect_timeout.count()));
+    options.batch.window = std::chrono::microseconds(config.LookupInt("rpcclient_batch_window_us", options.batch.window.count()));
+    options.batch.max_calls = config.LookupCount("rpcclient_batch_max_calls", options.batch.max_calls, 1);
+    options.prefer_unix_socket = config.Lookup("rpcclient_prefer_uds").value_or("true") == "true";
+    return options;
+}
+
+ConnectionPool::ConnectionPool(const Options &options)
+    : m_options(options)
+{
+}
+
+ConnectionPool::~ConnectionPool()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (auto &[key, pool] : m_pools) {
+        for (auto &conn : pool.conns) {
+            conn->Close();
+        }
+    }
+}
+
+RpcConnection::Ptr ConnectionPool::Get(const Endpoint &endpoint)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    EndpointPool &pool = m_pools[endpoint.ToString()];
+    Prune(pool);
+    RpcConnection::Ptr best;
+    size_t best_inflight = 0;
+    for (auto &conn : pool.conns) {
+        size_t inflight = conn->InFlight();
+        if (!best || inflight < best_inflight) {
+            best = conn;
+            best_inflight = inflight;
+        }
+    }
+    // 已有连接还不算忙，或者连接数已经到达上限，就复用已有的连接
+    if (best && (best_inflight < m_options.max_pending_per_conn || pool.conns.size() >= m_options.max_active)) {
+        return best;
+    }
+    // 只有服务端在本机时才使用它注册的Unix域套接字，否则同名路径上可能是本机的另一个进程
+    Endpoint target = endpoint;
+    if (!m_options.prefer_unix_socket || !IsLocalAddress(endpoint.ip)) {
+        target.uds.clear();
+    }
+    auto conn = std::make_shared<RpcConnection>(RpcConnection::NextLoop(), target, m_options.batch);
+    conn->Connect(m_options.connect_timeout);
+    pool.conns.push_back(conn);
+    return conn;
+}
+
+size_t ConnectionPool::InFlight(const Endpoint &endpoint)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_pools.find(endpoint.ToString());
+    if (it == m_pools.end()) {
+        return 0;
+    }
+    size_t inflight = 0;
+    for (auto &conn : it->second.conns) {
+        inflight += conn->InFlight();
+    }
+    return inflight;
+}
+
+void ConnectionPool::Prune(EndpointPool &pool)
+{
+    // 断开的连接由muduo在对端关闭或出错时及时发现，直接丢弃
+    std::erase_if(pool.conns, [](const RpcConnection::Ptr &conn) { return !conn->Usable(); });
+
+    auto now = std::chrono::steady_clock::now();
+    size_t idle = 0;
+    // 从前往后遍历，优先保留先建立的连接
+    for (auto it = pool.conns.begin(); it != pool.conns.end();) {
+        // 连接池之外还有引用，说明连接被Get取走之后还没有发出请求（或者正被流式调用等持有），
+        // 这时没有在途调用也不是空闲的，关闭它会让刚取走它的调用还没发送就失败。取走连接都在m_mutex内，这里的判断不会漏掉
+        if (it->use_count() > 1) {
+            ++it;
+            continue;
+        }
+        auto since = (*it)->IdleSince();
+        if (since && (now - *since >= m_options.idle_timeout || ++idle > m_options.max_idle)) {
+            (*it)->Close();
+            it = pool.conns.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "endpoint.h"
+#include "rpcconnection.h"
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace meha
+{
+
+/**
+ * @brief 客户端到RpcProvider的连接池
+ * @details 按照"ip:port"为每个服务端点维护一组长连接，避免每次调用都要经历一次TCP握手。
+ * 连接上的调用是多路复用的，多个调用共享同一个连接，只有当已有连接上的在途调用都比较多时才会新建连接。
+ * 同一个RpcChannel上的所有Stub共享这个连接池。
+ */
+class ConnectionPool
+{
+public:
+    struct Options
+    {
+        size_t max_idle = 2; // 每个端点最多保留的空闲连接（没有在途调用、也没有被调用方持有的连接）数
+        size_t max_active = 8; // 每个端点最多建立的连接数
+        size_t max_pending_per_conn = 64; // 已有连接上的在途调用数都达到该值时才会新建连接
+        std::chrono::milliseconds idle_timeout{60000}; // 空闲超过该时长的连接会被关闭
+        std::chrono::milliseconds connect_timeout{3000};
+        RpcConnection::BatchOptions batch; // 连接上的自动批量发送
+        bool prefer_unix_socket = true; // 服务端在本机并且注册了Unix域套接字时通过它连接
+
+        // 从RpcConfig中读取rpcclient_max_idle_conns/rpcclient_max_active_conns/rpcclient_max_pending_per_conn/
+        // rpcclient_idle_timeout_ms/rpcclient_connect_timeout_ms/rpcclient_batch_window_us/rpcclient_batch_max_calls/
+        // rpcclient_prefer_uds
+        static Options FromConfig();
+    };
+
+    explicit ConnectionPool(const Options &options = Options::FromConfig());
+    ~ConnectionPool();
+
+    /**
+     * @brief 获取一个到endpoint的可用连接
+     * 优先选择在途调用最少的已有连接，需要时新建连接。断开的连接和空闲太久的连接在这里被清理掉。
+     * 新建的连接是异步建立的，这个函数不会阻塞，连接失败时通过连接上的调用报告
+     */
+    RpcConnection::Ptr Get(const Endpoint &endpoint);
+    // 到endpoint的所有连接上的在途调用数之和，作为负载均衡时该实例的负载
+    size_t InFlight(const Endpoint &endpoint);
+
+private:
+    struct EndpointPool
+    {
+        std::vector<RpcConnection::Ptr> conns;
+    };
+
+    // 清理断开的连接，关闭多余的空闲连接
+    void Prune(EndpointPool &pool);
+
+    Options m_options;
+    std::mutex m_mutex;
+    std::unordered_map<std::string, EndpointPool> m_pools;
+};
+
+}
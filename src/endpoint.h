@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <optional>
+#include <string>
+
+namespace meha
+{
+
+/**
+ * @brief 服务提供者的网络地址
+ */
+struct Endpoint
+{
+    std::string ip;
+    uint16_t port = 0;
+    // 服务端同时监听的Unix域套接字路径，为空表示没有。客户端和服务端在同一台机器上时优先通过它连接
+    std::string uds{};
+
+    // 格式化为"ip:port"，同时也作为连接池等处的键
+    std::string ToString() const
+    {
+        return ip + ":" + std::to_string(port);
+    }
+
+    // 注册中心中保存的格式，有Unix域套接字时为"ip:port;uds=路径"，否则和ToString相同
+    std::string Encode() const
+    {
+        return uds.empty() ? ToString() : ToString() + kUdsPrefix + uds;
+    }
+
+    // 从"ip:port"或者"ip:port;uds=路径"格式的字符串中解析出地址
+    static std::optional<Endpoint> Parse(const std::string &str)
+    {
+        auto uds_idx = str.find(kUdsPrefix);
+        std::string address = str.substr(0, uds_idx);
+        auto idx = address.find(':');
+        if (idx == std::string::npos || idx == 0 || idx + 1 == address.size()) {
+            return std::nullopt;
+        }
+        int port = std::atoi(address.c_str() + idx + 1);
+        if (port <= 0 || port > UINT16_MAX) {
+            return std::nullopt;
+        }
+        Endpoint endpoint{address.substr(0, idx), static_cast<uint16_t>(port)};
+        if (uds_idx != std::string::npos) {
+            endpoint.uds = str.substr(uds_idx + sizeof(kUdsPrefix) - 1);
+        }
+        return endpoint;
+    }
+
+    bool operator==(const Endpoint &other) const = default;
+
+private:
+    static constexpr char kUdsPrefix[] = ";uds=";
+};
+
+}
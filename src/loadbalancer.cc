@@ -0,0 +1,174 @@
+#include "loadbalancer.h"
+#include <algorithm>
+#include <atomic>
+#include <glog/logging.h>
+#include <mutex>
+#include <random>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+using namespace meha;
+
+namespace
+{
+
+class RoundRobinBalancer : public LoadBalancer
+{
+public:
+    const Endpoint &Select(const std::string &service_name, const EndpointList &endpoints, std::optional<uint64_t> request_key) override
+    {
+        return (*endpoints)[m_next.fetch_add(1, std::memory_order_relaxed) % endpoints->size()];
+    }
+
+private:
+    std::atomic<uint64_t> m_next = 0;
+};
+
+class LeastOutstandingBalancer : public LoadBalancer
+{
+public:
+    explicit LeastOutstandingBalancer(LoadFunction load)
+        : m_load(std::move(load))
+    {
+    }
+
+    const Endpoint &Select(const std::string &service_name, const EndpointList &endpoints, std::optional<uint64_t> request_key) override
+    {
+        // 从轮转的位置开始找，负载相同时不会总是选中第一个实例
+        size_t size = endpoints->size();
+        size_t start = m_next.fetch_add(1, std::memory_order_relaxed) % size;
+        size_t best = start;
+        size_t best_load = m_load((*endpoints)[start]);
+        for (size_t i = 1; i < size && best_load > 0; ++i) {
+            size_t index = (start + i) % size;
+            size_t load = m_load((*endpoints)[index]);
+            if (load < best_load) {
+                best = index;
+                best_load = load;
+            }
+        }
+        return (*endpoints)[best];
+    }
+
+private:
+    LoadFunction m_load;
+    std::atomic<uint64_t> m_next = 0;
+};
+
+class PowerOfTwoChoicesBalancer : public LoadBalancer
+{
+public:
+    explicit PowerOfTwoChoicesBalancer(LoadFunction load)
+        : m_load(std::move(load))
+    {
+    }
+
+    const Endpoint &Select(const std::string &service_name, const EndpointList &endpoints, std::optional<uint64_t> request_key) override
+    {
+        size_t size = endpoints->size();
+        if (size == 1) {
+            return endpoints->front();
+        }
+        thread_local std::minstd_rand rng(std::random_device{}());
+        size_t first = rng() % size;
+        size_t second = (first + 1 + rng() % (size - 1)) % size; // 和first不同的另一个实例
+        const Endpoint &a = (*endpoints)[first];
+        const Endpoint &b = (*endpoints)[second];
+        return m_load(a) <= m_load(b) ? a : b;
+    }
+
+private:
+    LoadFunction m_load;
+};
+
+class ConsistentHashBalancer : public LoadBalancer
+{
+public:
+    const Endpoint &Select(const std::string &service_name, const EndpointList &endpoints, std::optional<uint64_t> request_key) override
+    {
+        if (!request_key) {
+            return m_fallback.Select(service_name, endpoints, request_key);
+        }
+        auto ring = GetRing(service_name, endpoints);
+        uint64_t hash = Mix(*request_key);
+        // 顺时针找到第一个虚拟节点
+        auto it = std::lower_bound(ring->begin(), ring->end(), std::make_pair(hash, size_t(0)));
+        if (it == ring->end()) {
+            it = ring->begin();
+        }
+        return (*endpoints)[it->second];
+    }
+
+private:
+    // 每个实例在哈希环上的虚拟节点数，越多负载越均匀
+    static constexpr int kVirtualNodes = 160;
+    // 哈希环，按哈希值排好序的(虚拟节点哈希值, 实例下标)
+    using Ring = std::vector<std::pair<uint64_t, size_t>>;
+
+    // 实例列表没有变化时复用之前构建的哈希环
+    std::shared_ptr<const Ring> GetRing(const std::string &service_name, const EndpointList &endpoints)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto &cached = m_rings[service_name];
+        if (cached.first != endpoints) {
+            auto ring = std::make_shared<Ring>();
+            ring->reserve(endpoints->size() * kVirtualNodes);
+            for (size_t i = 0; i < endpoints->size(); ++i) {
+                // 虚拟节点的位置只和实例地址有关，和实例在列表中的顺序无关
+                uint64_t base = Hash((*endpoints)[i].ToString());
+                for (int v = 0; v < kVirtualNodes; ++v) {
+                    ring->emplace_back(Mix(base + v), i);
+                }
+            }
+            std::sort(ring->begin(), ring->end());
+            cached = {endpoints, std::move(ring)};
+        }
+        return cached.second;
+    }
+
+    // 64位FNV-1a，不同进程中的结果相同，所有客户端会把同一个键映射到同一个实例
+    static uint64_t Hash(const std::string &str)
+    {
+        uint64_t hash = 14695981039346656037ull;
+        for (char c : str) {
+            hash ^= static_cast<uint8_t>(c);
+            hash *= 1099511628211ull;
+        }
+        return hash;
+    }
+
+    // splitmix64的终结函数，把相邻的整数打散到整个哈希空间
+    static uint64_t Mix(uint64_t x)
+    {
+        x ^= x >> 30;
+        x *= 0xbf58476d1ce4e5b9ull;
+        x ^= x >> 27;
+        x *= 0x94d049bb133111ebull;
+        x ^= x >> 31;
+        return x;
+    }
+
+    std::mutex m_mutex;
+    std::unordered_map<std::string, std::pair<EndpointList, std::shared_ptr<const Ring>>> m_rings;
+    RoundRobinBalancer m_fallback;
+};
+
+}
+
+std::unique_ptr<LoadBalancer> LoadBalancer::Create(const std::string &name, LoadFunction load)
+{
+    if (name == "least_outstanding") {
+        return std::make_unique<LeastOutstandingBalancer>(std::move(load));
+    }
+    if (name == "p2c") {
+        return std::make_unique<PowerOfTwoChoicesBalancer>(std::move(load));
+    }
+    if (name == "consistent_hash") {
+        return std::make_unique<ConsistentHashBalancer>();
+    }
+    if (name != "round_robin") {
+        LOG(WARNING) << "unknown load balancer " << name << ", use round_robin";
+    }
+    return std::make_unique<RoundRobinBalancer>();
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "endpoint.h"
+#include "servicediscovery.h"
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+
+namespace meha
+{
+
+/**
+ * @brief 客户端负载均衡器，从服务的多个实例中为每次调用选择一个
+ * @details 通过配置项rpcclient_load_balancer选择具体的策略：
+ * round_robin（默认）：轮询；
+ * least_outstanding：选择客户端到它的在途调用最少的实例；
+ * p2c：随机选两个实例，取在途调用较少的一个，开销和轮询相当，效果接近least_outstanding；
+ * consistent_hash：按RpcController::SetRequestKey设置的路由键做一致性哈希，实例增减时只有少量的键会换实例。
+ */
+class LoadBalancer
+{
+public:
+    // 返回客户端到某个实例上的在途调用数，由连接池提供
+    using LoadFunction = std::function<size_t(const Endpoint &endpoint)>;
+
+    virtual ~LoadBalancer() = default;
+
+    /**
+     * @brief 为一次调用选择实例，线程安全
+     * @param endpoints 服务的实例列表，不能为空
+     * @param request_key 请求的路由键，只有consistent_hash使用，没有设置时退化为轮询
+     */
+    virtual const Endpoint &Select(const std::string &service_name, const EndpointList &endpoints, std::optional<uint64_t> request_key) = 0;
+
+    /**
+     * @brief 按策略名创建负载均衡器，不认识的策略名使用round_robin
+     * @param load 获取实例负载的方法，least_outstanding和p2c使用
+     */
+    static std::unique_ptr<LoadBalancer> Create(const std::string &name, LoadFunction load);
+};
+
+}
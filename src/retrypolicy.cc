@@ -0,0 +1,111 @@
+#include "retrypolicy.h"
+#include "rpcconfig.h"
+#include "rpcmetrics.h"
+#include "tinyrpcoptions.pb.h"
+#include <algorithm>
+#include <glog/logging.h>
+#include <random>
+#include <unordered_map>
+
+using namespace meha;
+
+RetryPolicy RetryPolicy::FromConfig()
+{
+    RetryPolicy policy;
+    auto &config = RpcConfig::Instance();
+    policy.max_attempts = std::max<int64_t>(1, config.LookupInt("rpcclient_max_attempts", policy.max_attempts));
+    policy.initial_backoff = std::chrono::milliseconds(config.LookupInt("rpcclient_retry_backoff_ms", policy.initial_backoff.count()));
+    policy.max_backoff = std::chrono::milliseconds(config.LookupInt("rpcclient_retry_max_backoff_ms", policy.max_backoff.count()));
+    policy.hedge_percentile = config.LookupDouble("rpcclient_hedge_percentile", 0);
+    if (policy.hedge_percentile < 0 || policy.hedge_percentile >= 100) {
+        LOG(ERROR) << "rpcclient_hedge_percentile=" << policy.hedge_percentile << " should be in [0, 100), hedging disabled";
+        policy.hedge_percentile = 0;
+    }
+    policy.hedge_min_delay = std::chrono::milliseconds(config.LookupInt("rpcclient_hedge_min_delay_ms", policy.hedge_min_delay.count()));
+    return policy;
+}
+
+std::chrono::milliseconds RetryPolicy::Backoff(size_t retry) const
+{
+    // 上限是initial_backoff * 2^(retry-1)，实际等待时间在[0, 上限]中均匀随机
+    auto ceiling = initial_backoff.count() << std::min<size_t>(retry > 0 ? retry - 1 : 0, 20);
+    ceiling = std::min<int64_t>(ceiling, max_backoff.count());
+    thread_local std::minstd_rand rand(std::random_device{}());
+    return std::chrono::milliseconds(std::uniform_int_distribution<int64_t>(0, std::max<int64_t>(ceiling, 0))(rand));
+}
+
+std::optional<std::chrono::milliseconds> RetryPolicy::HedgeDelay(const google::protobuf::MethodDescriptor *method) const
+{
+    // 直方图的快照需要遍历所有的桶，每个线程每个方法每秒最多计算一次
+    constexpr auto kRefreshInterval = std::chrono::seconds(1);
+    constexpr uint64_t kMinSamples = 100;
+    struct Entry
+    {
+        std::optional<std::chrono::milliseconds> delay;
+        std::chrono::steady_clock::time_point expires;
+    };
+    thread_local std::unordered_map<const google::protobuf::MethodDescriptor *, Entry> cache;
+    auto now = std::chrono::steady_clock::now();
+    Entry &entry = cache[method];
+    if (now < entry.expires) {
+        return entry.delay;
+    }
+    entry.expires = now + kRefreshInterval;
+    HistogramSnapshot latency = Metrics::Instance().Get(Metrics::Side::kClient, method)->latency.Snapshot();
+    if (latency.count < kMinSamples) {
+        entry.delay = std::nullopt;
+    } else {
+        auto delay = std::chrono::ceil<std::chrono::milliseconds>(std::chrono::microseconds(latency.Percentile(hedge_percentile / 100)));
+        entry.delay = std::max(delay, hedge_min_delay);
+    }
+    return entry.delay;
+}
+
+RetryBudget::RetryBudget(double ratio, size_t max_tokens)
+    : m_ratio(static_cast<int64_t>(ratio * kScale))
+    , m_max_tokens(static_cast<int64_t>(max_tokens) * kScale)
+    , m_tokens(m_max_tokens)
+{
+}
+
+RetryBudget RetryBudget::FromConfig()
+{
+    auto &config = RpcConfig::Instance();
+    double ratio = config.LookupInt("rpcclient_retry_budget_percent", 10) / 100.0;
+    return RetryBudget(ratio, config.LookupInt("rpcclient_retry_budget_tokens", 100));
+}
+
+void RetryBudget::OnSuccess()
+{
+    // 令牌已满时不需要写，避免所有成功的调用都去争抢同一个缓存行
+    int64_t tokens = m_tokens.load(std::memory_order_relaxed);
+    while (tokens < m_max_tokens && !m_tokens.compare_exchange_weak(tokens, std::min(tokens + m_ratio, m_max_tokens), std::memory_order_relaxed)) {
+    }
+}
+
+bool RetryBudget::TryRetry()
+{
+    int64_t tokens = m_tokens.load(std::memory_order_relaxed);
+    while (tokens >= kScale) {
+        if (m_tokens.compare_exchange_weak(tokens, tokens - kScale, std::memory_order_relaxed)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool meha::IsIdempotent(const google::protobuf::MethodDescriptor *method)
+{
+    thread_local std::unordered_map<const google::protobuf::MethodDescriptor *, bool> cache;
+    auto it = cache.find(method);
+    if (it != cache.end()) {
+        return it->second;
+    }
+    bool idempotent = method->options().GetExtension(tinyrpc::idempotent);
+    if (!idempotent) {
+        auto value = RpcConfig::Instance().Lookup("rpcclient_idempotent." + method->service()->name() + "." + method->name());
+        idempotent = value && *value == "true";
+    }
+    cache.emplace(method, idempotent);
+    return idempotent;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <google/protobuf/descriptor.h>
+#include <optional>
+
+namespace meha
+{
+
+/**
+ * @brief 客户端的重试和对冲策略，从RpcConfig中读取
+ * @details
+ * rpcclient_max_attempts：每个调用最多的尝试次数，包括第一次和对冲请求，默认1即不重试；
+ * rpcclient_retry_backoff_ms/rpcclient_retry_max_backoff_ms：重试前等待的时间，按指数增长并加上随机抖动（full jitter），
+ * 避免大量客户端在同一时刻一起重试；
+ * rpcclient_hedge_percentile：大于0时，幂等的方法在超过该方法客户端延迟的这个分位数（例如95）还没有返回时，
+ * 向另一个实例发送一个对冲请求，先返回的结果生效；rpcclient_hedge_min_delay_ms是对冲等待时间的下限。
+ * 重试和对冲都不会超过调用的截止时间，也都要消耗RetryBudget中的令牌。
+ */
+struct RetryPolicy
+{
+    size_t max_attempts = 1;
+    std::chrono::milliseconds initial_backoff{10};
+    std::chrono::milliseconds max_backoff{1000};
+    double hedge_percentile = 0;
+    std::chrono::milliseconds hedge_min_delay{1};
+
+    static RetryPolicy FromConfig();
+
+    bool Enabled() const { return max_attempts > 1; }
+    bool HedgeEnabled() const { return max_attempts > 1 && hedge_percentile > 0; }
+    // 第retry次重试（从1开始）之前等待的时间
+    std::chrono::milliseconds Backoff(size_t retry) const;
+    /**
+     * @brief 方法的对冲等待时间，即客户端延迟的hedge_percentile分位数
+     * 从方法的客户端指标中计算，每个线程按方法缓存一段时间，没有足够的样本时返回std::nullopt，此时不对冲
+     */
+    std::optional<std::chrono::milliseconds> HedgeDelay(const google::protobuf::MethodDescriptor *method) const;
+};
+
+/**
+ * @brief 重试预算，防止下游故障时重试把流量放大好几倍
+ * @details 每个成功的调用存入ratio个令牌，每次重试或对冲花掉一个令牌，令牌数不超过max_tokens。
+ * 下游正常时令牌充足，重试不受限制；大量调用失败时令牌很快耗尽，重试流量被限制在成功流量的ratio倍以内。
+ * 配置项为rpcclient_retry_budget_percent（默认10）和rpcclient_retry_budget_tokens（默认100）
+ */
+class RetryBudget
+{
+public:
+    RetryBudget(double ratio, size_t max_tokens);
+    static RetryBudget FromConfig();
+
+    void OnSuccess();
+    // 有令牌时消耗一个并返回true
+    bool TryRetry();
+
+private:
+    static constexpr int64_t kScale = 1000; // 令牌按千分之一计数，避免浮点原子操作
+
+    int64_t m_ratio;
+    int64_t m_max_tokens;
+    std::atomic<int64_t> m_tokens;
+};
+
+/**
+ * @brief 方法是否幂等：proto中的方法选项(tinyrpc.idempotent)，或者配置项rpcclient_idempotent.<服务名>.<方法名>=true
+ * 结果按线程缓存
+ */
+bool IsIdempotent(const google::protobuf::MethodDescriptor *method);
+
+}
@@ -0,0 +1,59 @@
+#include "rpcbatch.h"
+#include <algorithm>
+#include <latch>
+
+using namespace meha;
+
+RpcBatch::RpcBatch(meha::RpcChannel *channel)
+    : m_channel(channel)
+{
+}
+
+RpcBatch::~RpcBatch()
+{
+    if (!m_calls.empty()) {
+        Flush();
+    }
+}
+
+void RpcBatch::CallMethod(const ::google::protobuf::MethodDescriptor *method,
+                          ::google::protobuf::RpcController *controller,
+                          const ::google::protobuf::Message *request,
+                          ::google::protobuf::Message *response,
+                          ::google::protobuf::Closure *done)
+{
+    m_calls.push_back(PendingCall{method, controller, request, response, done});
+}
+
+void RpcBatch::Flush()
+{
+    std::vector<PendingCall> calls;
+    calls.swap(m_calls);
+    auto sync_calls = std::count_if(calls.begin(), calls.end(), [](const PendingCall &call) { return call.done == nullptr; });
+    std::latch finished(sync_calls);
+
+    // 按连接分组，一批调用通常都在同一个服务的同一个实例上，组数很少
+    std::vector<std::pair<RpcConnection::Ptr, std::vector<RpcConnection::Request>>> groups;
+    for (auto &call : calls) {
+        std::function<void()> on_done;
+        if (call.done) {
+            on_done = [done = call.done] { done->Run(); };
+        } else {
+            on_done = [&finished] { finished.count_down(); };
+        }
+        // 准备失败的调用已经以失败结束了
+        auto prepared = m_channel->Prepare(call.method, call.controller, call.request, call.response, std::move(on_done));
+        if (!prepared) {
+            continue;
+        }
+        auto it = std::find_if(groups.begin(), groups.end(), [&](const auto &group) { return group.first == prepared->conn; });
+        if (it == groups.end()) {
+            it = groups.emplace(groups.end(), prepared->conn, std::vector<RpcConnection::Request>());
+        }
+        it->second.push_back(std::move(prepared->request));
+    }
+    for (auto &[conn, requests] : groups) {
+        conn->SendBatch(requests);
+    }
+    finished.wait();
+}
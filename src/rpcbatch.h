@@ -0,0 +1,62 @@
+#pragma once
+
+#include "rpcchannel.h"
+#include <google/protobuf/service.h>
+#include <vector>
+
+namespace meha
+{
+
+/**
+ * @brief 把多个调用打包发送的RpcChannel
+ * @details 在它上面创建Stub，通过Stub发起的调用先记录下来，Flush时按选中的连接分组，每组打包成一个批量帧发送，
+ * 服务端处理完整批调用后把响应打包成一帧返回。同一批中可以是同一个服务的不同方法，也可以是不同的服务。
+ * 适合在循环中发起大量小调用的场景，省去每个调用各自的帧和系统调用。
+ * 整批的响应在最慢的调用结束后才返回，慢调用不要和快调用放在同一批中。
+ * @code
+ *   meha::RpcBatch batch(&channel);
+ *   example::UserService_Stub stub(&batch);
+ *   for (size_t i = 0; i < n; ++i) {
+ *       stub.IsUserOnline(&controllers[i], &requests[i], &responses[i], nullptr);
+ *   }
+ *   batch.Flush(); // 返回时所有done为nullptr的调用都已经结束
+ * @endcode
+ * @note 不是线程安全的。调用的controller、request、response在调用结束之前需要一直有效
+ */
+class RpcBatch : public google::protobuf::RpcChannel
+{
+public:
+    explicit RpcBatch(meha::RpcChannel *channel);
+    // 还没有发送的调用在析构时发送
+    ~RpcBatch() override;
+
+    // 只记录调用，不发送
+    void CallMethod(const ::google::protobuf::MethodDescriptor *method,
+                    ::google::protobuf::RpcController *controller,
+                    const ::google::protobuf::Message *request,
+                    ::google::protobuf::Message *response,
+                    ::google::protobuf::Closure *done) override;
+
+    /**
+     * @brief 发送记录的所有调用，等待其中的同步调用（done为nullptr）全部结束后返回
+     * 异步调用的done在调用结束后在客户端IO线程中执行。每个调用仍然有各自的超时和结果
+     */
+    void Flush();
+    // 已经记录、还没有发送的调用数
+    size_t Size() const { return m_calls.size(); }
+
+private:
+    struct PendingCall
+    {
+        const google::protobuf::MethodDescriptor *method;
+        google::protobuf::RpcController *controller;
+        const google::protobuf::Message *request;
+        google::protobuf::Message *response;
+        google::protobuf::Closure *done;
+    };
+
+    meha::RpcChannel *m_channel;
+    std::vector<PendingCall> m_calls;
+};
+
+}
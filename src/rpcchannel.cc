@@ -1,177 +1,383 @@
 #include "rpcchannel.h"
+#include "rpccodec.h"
+#include "rpccompress.h"
+#include "rpcconfig.h"
+#include "rpccontroller.h"
+#include "rpcmetrics.h"
+#include "rpctrace.h"
+#include "servicediscovery.h"
 #include "tinyrpcheader.pb.h"
-#include "zookeeperutil.h"
-#include <arpa/inet.h>
-#include <cerrno>
 #include <format>
+#include <algorithm>
 #include <glog/logging.h>
+#include <mutex>
+#include <semaphore>
+#include <vector>
 
 using namespace meha;
 
+namespace
+{
+
+// 调用结束时先记录调用的指标再执行on_done，done执行之后controller可能已经被释放了
+std::function<void()> FinishWithMetrics(google::protobuf::RpcController *controller, MethodMetrics *metrics, std::function<void()> on_done)
+{
+    auto start = std::chrono::steady_clock::now();
+    return [on_done = std::move(on_done), controller, metrics, start] {
+        metrics->requests.Add();
+        if (controller->Failed()) {
+            metrics->errors.Add();
+        }
+        metrics->latency.Record(std::chrono::steady_clock::now() - start);
+        on_done();
+    };
+}
+
+// 一次尝试使用自己的controller和response，成功之后才把响应交换给调用方
+struct Attempt
+{
+    RpcController controller;
+    std::unique_ptr<google::protobuf::Message> response;
+};
+
+}
+
+struct RpcChannel::RetryState
+{
+    const google::protobuf::MethodDescriptor *method = nullptr;
+    google::protobuf::RpcController *controller = nullptr;
+    const google::protobuf::Message *request = nullptr;
+    google::protobuf::Message *response = nullptr;
+    MethodMetrics *metrics = nullptr;
+    std::function<void()> finish;
+    std::optional<std::chrono::steady_clock::time_point> deadline;
+    std::optional<uint64_t> request_key;
+    bool idempotent = false;
+    uint32_t method_id = 0;
+    uint32_t args_size = 0;
+    tinyrpc::Compression compression = tinyrpc::COMPRESS_NONE;
+
+    // 以下成员由mutex保护，各次尝试在不同的IO线程中结束
+    std::mutex mutex;
+    bool finished = false; // finish已经执行过，之后结束的尝试直接丢弃
+    size_t attempts = 0; // 已经发起的尝试次数
+    size_t outstanding = 0; // 还没有结束的尝试数，包括等待退避的重试
+    std::vector<Endpoint> tried; // 尝试过的实例，重试和对冲时优先选择其他实例
+    std::string last_error;
+    muduo::net::TimerId hedge_timer;
+};
+
 void RpcChannel::CallMethod(const ::google::protobuf::MethodDescriptor *method,
                             ::google::protobuf::RpcController *controller,
                             const ::google::protobuf::Message *request,
                             ::google::protobuf::Message *response,
                             ::google::protobuf::Closure *done)
 {
-    // 如果没有和服务提供者连接过，说明还不知道服务提供者的ip:port，此时要到zk中查一下，然后连接到对应的服务节点
-    // if (-1 == m_clientfd) { // 这个-1 == m_clientfd去掉的原因是，我希望多个Stub公用一个RpcChannel，而这些Stub对应的服务可能不在同一个节点上
-        // 获取服务对象和方法名
-        const google::protobuf::ServiceDescriptor *sd = method->service();
-        m_service_name = sd->name();
-        m_method_name = method->name();
-        // rpc调用方也就是客户端想要调用服务器上服务对象提供的方法，需要查询zk上该服务所在的host信息。
-        ZkClient zkCli;
-        zkCli.Start(); // start返回就代表成功连接上zk服务器了
-        auto host_data = QueryServiceHost(&zkCli, m_service_name, m_method_name);
-        if (!host_data) {
-            controller->SetFailed(std::format("query service {}/{} data error!", m_service_name, m_method_name));
-            LOG(ERROR) << "query service " << m_service_name << " method " << m_method_name << " error";
+    if (m_retry.Enabled()) {
+        // 带重试的调用走单独的路径，不开启重试时不承担这部分开销
+        if (done) {
+            CallWithRetry(method, controller, request, response, [done] { done->Run(); });
             return;
         }
-        std::tie(m_ip, m_port) = *host_data;
-        LOG(INFO) << "RpcProvider data: " << m_ip << ":" << m_port;
-        if (!ConnectTo(m_ip, m_port)) {
-            controller->SetFailed("connect to server error");
-            LOG(ERROR) << "connect to server error";
-            return;
-        } else {
-            LOG(INFO) << "connect to server success";
+        std::binary_semaphore finished(0);
+        CallWithRetry(method, controller, request, response, [&finished] { finished.release(); });
+        finished.acquire();
+        return;
+    }
+    if (done) {
+        // 异步调用：请求发出后立即返回，响应由客户端IO线程反序列化到response之后执行done
+        auto prepared = Prepare(method, controller, request, response, [done] { done->Run(); });
+        if (prepared) {
+            prepared->conn->Send(prepared->request.call, prepared->request.header, *request, prepared->request.timeout);
         }
-    // }
-
-    // 获取参数的序列化结果
-    std::string args_str;
-    if (!request->SerializeToString(&args_str)) {
-        controller->SetFailed("serialize request fail");
-        LOG(ERROR) << "serialize request fail";
         return;
     }
-    // 定义rpc的报文header
-    tinyrpc::RpcHeader header;
-    header.set_service_name(m_service_name);
-    header.set_method_name(m_method_name);
-    header.set_args_size(args_str.size());
-
-    std::string header_str;
-    if (!header.SerializeToString(&header_str)) {
-        controller->SetFailed("serialize rpc header error!");
-        LOG(ERROR) << "serialize rpc header error!";
+
+    // 同步调用：等待客户端IO线程按call_id分发响应
+    std::binary_semaphore finished(0);
+    auto prepared = Prepare(method, controller, request, response, [&finished] { finished.release(); });
+    if (!prepared) {
         return;
     }
-    std::string send_rpc_str;
-    {
-        google::protobuf::io::StringOutputStream string_output(&send_rpc_str);
-        google::protobuf::io::CodedOutputStream coded_output(&string_output);
-        coded_output.WriteVarint32(static_cast<uint32_t>(header_str.size()));
-        coded_output.WriteString(header_str);
-    }
-    send_rpc_str += args_str; // RpcHeader + 实参payload
-    //  打印调试信息
-    // LOG(INFO) << "============================================";
-    // LOG(INFO) << "header_size: " << header_str.size();
-    // LOG(INFO) << "rpc_header_str: " << header_str;
-    // LOG(INFO) << "service_name: " << m_service_name;
-    // LOG(INFO) << "method_name: " << m_method_name;
-    // LOG(INFO) << "args_str: " << args_str;
-    // LOG(INFO) << "============================================";
+    uint64_t call_id = prepared->conn->Send(prepared->request.call, prepared->request.header, *request, prepared->request.timeout);
 
     // 设置一个取消点来检查用户是否取消了该RPC调用
-    if (controller->IsCanceled()) {
-        LOG(INFO) << "canceled before RPC request sent";
+    if (controller->IsCanceled() && prepared->conn->Abandon(call_id)) {
+        LOG(INFO) << "canceled after RPC request sent";
+        // 请求已经发出去了，之后到达的响应会被连接丢弃
         controller->StartCancel();
-        // RPC调用前，应当取消RPC调用
+        prepared->request.call->on_complete();
         return;
     }
+    finished.acquire();
+}
 
-    // 发送rpc的请求
-    if (-1 == send(m_clientfd, send_rpc_str.c_str(), send_rpc_str.size(), 0)) {
-        close(m_clientfd);
-        char errtxt[512] = {};
-        LOG(ERROR) << "send request error: " << strerror_r(errno, errtxt, sizeof(errtxt));
-        controller->SetFailed(std::format("send request error: {}", errtxt));
-        return;
+std::optional<RpcChannel::PreparedCall> RpcChannel::Prepare(const ::google::protobuf::MethodDescriptor *method,
+                                                            ::google::protobuf::RpcController *controller,
+                                                            const ::google::protobuf::Message *request,
+                                                            ::google::protobuf::Message *response,
+                                                            std::function<void()> on_done)
+{
+    // 不管成功还是失败，on_done都要执行一次，否则调用方会一直等下去
+    MethodMetrics *metrics = Metrics::Instance().Get(Metrics::Side::kClient, method);
+    auto finish = FinishWithMetrics(controller, metrics, std::move(on_done));
+    // 获取服务对象和方法名
+    const google::protobuf::ServiceDescriptor *sd = method->service();
+    const std::string &service_name = sd->name();
+    const std::string &method_name = method->name();
+    // rpc调用方也就是客户端想要调用服务器上服务对象提供的方法，需要查询注册中心上该服务所有实例的host信息。
+    // 不再缓存上一次的连接，因为多个Stub可能共用一个RpcChannel，而这些Stub对应的服务可能不在同一个节点上
+    // 查询结果由进程级的ServiceDiscovery缓存，注册中心上的实例变化时更新
+    EndpointList endpoints = ServiceDiscovery::Instance().Resolve(service_name);
+    if (!endpoints) {
+        controller->SetFailed(std::format("query service {}/{} data error!", service_name, method_name));
+        LOG(ERROR) << "query service " << service_name << " method " << method_name << " error";
+        finish();
+        return std::nullopt;
+    }
+    // 由负载均衡器在服务的多个实例中选择一个
+    auto *meha_controller = dynamic_cast<RpcController *>(controller);
+    const Endpoint &endpoint = m_balancer->Select(service_name, endpoints, meha_controller ? meha_controller->RequestKey() : std::nullopt);
+    RPC_TRACE << "call " << service_name << "." << method_name << " on " << endpoint.ToString();
+
+    // 检查参数能否被序列化，参数由连接在发送时直接序列化到发送缓冲区中
+    if (!request->IsInitialized()) {
+        controller->SetFailed("serialize request fail");
+        LOG(ERROR) << "serialize request fail";
+        finish();
+        return std::nullopt;
+    }
+    PreparedCall prepared;
+    // 从连接池获取一个到该节点的连接，连接上的调用是多路复用的，多个调用可以同时共用一个连接
+    prepared.conn = m_pool.Get(endpoint);
+    // 定义rpc的报文header，call_id由连接在发送时分配
+    // 只带方法编号，不带服务名和方法名，服务端按编号直接查表分发
+    tinyrpc::RpcHeader &header = prepared.request.header;
+    header.set_method_id(codec::MethodId(method));
+    header.set_args_size(request->ByteSizeLong()); // 同时缓存了request的序列化长度
+    // 请求按方法配置的算法压缩，并告诉服务端本进程能解压哪些算法
+    header.set_compression(Compressor::ForMethod(method));
+    header.set_accept_compression(Compressor::SupportedMask());
+
+    // 计算调用的超时时间，controller上没有设置截止时间时使用配置的默认超时
+    auto now = std::chrono::steady_clock::now();
+    auto deadline = meha_controller ? meha_controller->Deadline() : std::nullopt;
+    if (!deadline && m_default_timeout > std::chrono::milliseconds::zero()) {
+        deadline = now + m_default_timeout;
+    }
+    if (deadline) {
+        auto timeout = std::chrono::ceil<std::chrono::milliseconds>(*deadline - now);
+        if (timeout <= std::chrono::milliseconds::zero()) {
+            // 例如服务方法中沿用了上游请求的截止时间，而上游请求已经超时了
+            controller->SetFailed("rpc call timeout");
+            LOG(WARNING) << "rpc call " << service_name << "." << method_name << " timeout before sent";
+            finish();
+            return std::nullopt;
+        }
+        header.set_timeout_ms(static_cast<uint32_t>(timeout.count()));
+        prepared.request.timeout = timeout;
     }
 
     // 设置一个取消点来检查用户是否取消了该RPC调用
     if (controller->IsCanceled()) {
-        LOG(INFO) << "canceled after RPC request sent";
+        LOG(INFO) << "canceled before RPC request sent";
         controller->StartCancel();
         // RPC调用前，应当取消RPC调用
-        return;
+        finish();
+        return std::nullopt;
     }
 
-    // 接收rpc请求的响应值 // TODO 这里无法改成支持像wayland那样的异步api，因为这里必须填写response
-                        // 但是应该可以从done这个类似wl_callback这样的来实现异步
-    char recv_buf[1024] = {0};
-    int recv_size = 0;
-    if (-1 == (recv_size = recv(m_clientfd, recv_buf, sizeof(recv_buf), 0))) {
-        char errtxt[512] = {};
-        LOG(ERROR) << "recv retval error" << strerror_r(errno, errtxt, sizeof(errtxt));
-        controller->SetFailed(std::format("recv retval error: {}", errtxt));
+    auto call = std::make_shared<RpcConnection::Call>();
+    call->controller = controller;
+    call->response = response;
+    call->metrics = metrics;
+    call->on_complete = std::move(finish);
+    prepared.request.call = std::move(call);
+    prepared.request.request = request;
+    return prepared;
+}
+
+void RpcChannel::CallWithRetry(const ::google::protobuf::MethodDescriptor *method,
+                               ::google::protobuf::RpcController *controller,
+                               const ::google::protobuf::Message *request,
+                               ::google::protobuf::Message *response,
+                               std::function<void()> on_done)
+{
+    auto state = std::make_shared<RetryState>();
+    state->method = method;
+    state->controller = controller;
+    state->request = request;
+    state->response = response;
+    state->metrics = Metrics::Instance().Get(Metrics::Side::kClient, method);
+    state->finish = FinishWithMetrics(controller, state->metrics, std::move(on_done));
+
+    if (!request->IsInitialized()) {
+        controller->SetFailed("serialize request fail");
+        LOG(ERROR) << "serialize request fail";
+        state->finish();
         return;
     }
-    // 反序列化rpc调用响应数据
-    if (!response->ParseFromArray(recv_buf, recv_size)) {
-        close(m_clientfd);
-        char errtxt[512] = {};
-        LOG(INFO) << "parse retval error" << strerror_r(errno, errtxt, sizeof(errtxt));
-        controller->SetFailed(std::format("parse retval error: {}", errtxt));
+    if (controller->IsCanceled()) {
+        LOG(INFO) << "canceled before RPC request sent";
+        controller->StartCancel();
+        state->finish();
         return;
     }
-    // 执行RPC完成回调
-    if (done) {
-        done->Run();
+    // 截止时间对整个调用有效，所有的尝试（包括退避等待的时间）都不能超过它
+    auto *meha_controller = dynamic_cast<RpcController *>(controller);
+    state->request_key = meha_controller ? meha_controller->RequestKey() : std::nullopt;
+    state->deadline = meha_controller ? meha_controller->Deadline() : std::nullopt;
+    if (!state->deadline && m_default_timeout > std::chrono::milliseconds::zero()) {
+        state->deadline = std::chrono::steady_clock::now() + m_default_timeout;
     }
+    state->idempotent = IsIdempotent(method);
+    state->method_id = codec::MethodId(method);
+    state->args_size = request->ByteSizeLong(); // 同时缓存了request的序列化长度，各次尝试都直接序列化request
+    state->compression = Compressor::ForMethod(method);
+    state->outstanding = 1;
+    StartAttempt(state, false);
 }
 
-bool RpcChannel::ConnectTo(const std::string &ip, uint16_t port)
+void RpcChannel::StartAttempt(const RetryStatePtr &state, bool hedge)
 {
-    int clientfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (-1 == clientfd) {
-        LOG(ERROR) << "socket create error: " << google::StrError(errno);
-        return false;
-    }
-    struct sockaddr_in server_addr;
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port);
-    server_addr.sin_addr.s_addr = inet_addr(ip.c_str());
-    if (-1 == connect(clientfd, (struct sockaddr *)&server_addr, sizeof(server_addr))) {
-        close(clientfd);
-        LOG(ERROR) << "connect server " << ip << ":" << port << " errror: " << google::StrError(errno);
-        return false;
-    }
-    m_clientfd = clientfd;
-    return true;
+    const std::string &service_name = state->method->service()->name();
+    const std::string &method_name = state->method->name();
+    {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        ++state->attempts;
+    }
+    std::chrono::milliseconds timeout = std::chrono::milliseconds::zero();
+    if (state->deadline) {
+        timeout = std::chrono::ceil<std::chrono::milliseconds>(*state->deadline - std::chrono::steady_clock::now());
+        if (timeout <= std::chrono::milliseconds::zero()) {
+            OnAttemptDone(state, nullptr, "rpc call timeout", tinyrpc::RPC_DEADLINE_EXCEEDED);
+            return;
+        }
+    }
+    EndpointList endpoints = ServiceDiscovery::Instance().Resolve(service_name);
+    if (!endpoints || endpoints->empty()) {
+        LOG(ERROR) << "query service " << service_name << " method " << method_name << " error";
+        OnAttemptDone(state, nullptr, std::format("query service {}/{} data error!", service_name, method_name), std::nullopt);
+        return;
+    }
+    Endpoint endpoint = m_balancer->Select(service_name, endpoints, state->request_key);
+    {
+        // 重试和对冲请求优先发往还没有尝试过的实例，所有实例都尝试过时才沿用负载均衡的选择
+        std::lock_guard<std::mutex> lock(state->mutex);
+        auto tried = [&state](const Endpoint &candidate) {
+            return std::find(state->tried.begin(), state->tried.end(), candidate) != state->tried.end();
+        };
+        if (tried(endpoint)) {
+            auto untried = std::find_if_not(endpoints->begin(), endpoints->end(), tried);
+            if (untried != endpoints->end()) {
+                endpoint = *untried;
+            }
+        }
+        state->tried.push_back(endpoint);
+    }
+    RPC_TRACE << (hedge ? "hedge " : "call ") << service_name << "." << method_name << " on " << endpoint.ToString();
+
+    auto attempt = std::make_shared<Attempt>();
+    attempt->response.reset(state->response->New());
+    auto call = std::make_shared<RpcConnection::Call>();
+    call->controller = &attempt->controller;
+    call->response = attempt->response.get();
+    call->metrics = state->metrics;
+    // on_complete由call自己持有，只在call还有效的时候执行，可以直接使用裸指针读取status
+    call->on_complete = [this, state, attempt, raw = call.get()] {
+        if (attempt->controller.Failed()) {
+            OnAttemptDone(state, nullptr, attempt->controller.ErrorText(), raw->status);
+        } else {
+            OnAttemptDone(state, attempt->response.get(), std::string(), tinyrpc::RPC_OK);
+        }
+    };
+
+    tinyrpc::RpcHeader header;
+    header.set_method_id(state->method_id);
+    header.set_args_size(state->args_size);
+    header.set_compression(state->compression);
+    header.set_accept_compression(Compressor::SupportedMask());
+    if (timeout > std::chrono::milliseconds::zero()) {
+        header.set_timeout_ms(static_cast<uint32_t>(timeout.count()));
+    }
+    m_pool.Get(endpoint)->Send(call, header, *state->request, timeout);
+
+    if (hedge || !m_retry.HedgeEnabled() || !state->idempotent) {
+        return;
+    }
+    // 第一次尝试发出之后，超过对冲等待时间还没有结束时向另一个实例发送对冲请求
+    auto delay = m_retry.HedgeDelay(state->method);
+    if (!delay || (state->deadline && std::chrono::steady_clock::now() + *delay >= *state->deadline)) {
+        return;
+    }
+    auto timer = RpcConnection::DefaultLoop()->runAfter(std::chrono::duration<double>(*delay).count(), [this, state] {
+        {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            if (state->finished || state->attempts >= m_retry.max_attempts || !m_budget.TryRetry()) {
+                return;
+            }
+            ++state->outstanding;
+        }
+        StartAttempt(state, true);
+    });
+    std::lock_guard<std::mutex> lock(state->mutex);
+    state->hedge_timer = timer;
 }
 
-std::optional<std::pair<std::string, uint16_t>> RpcChannel::QueryServiceHost(ZkClient *zkclient, std::string service_name, std::string method_name)
+void RpcChannel::OnAttemptDone(const RetryStatePtr &state, google::protobuf::Message *response,
+                               const std::string &error, std::optional<tinyrpc::RpcStatus> status)
 {
-    std::string method_path = "/meha/" + service_name + "/" + method_name;
-    LOG(INFO) << "method_path: " << method_path;
-    auto host_data = zkclient->GetNodeData(method_path);
-    if (!host_data) {
-        LOG(ERROR) << method_path + " is not exist!";
-        return std::nullopt;
+    std::unique_lock<std::mutex> lock(state->mutex);
+    --state->outstanding;
+    if (state->finished) {
+        // 对冲请求中较慢的那个，结果直接丢弃
+        return;
     }
-    int idx = (*host_data).find(":");
-    if (idx == -1) {
-        LOG(ERROR) << method_path + " address is invalid!";
-        return std::nullopt;
+    if (response) {
+        state->finished = true;
+        muduo::net::TimerId hedge_timer = state->hedge_timer;
+        lock.unlock();
+        RpcConnection::DefaultLoop()->cancel(hedge_timer);
+        state->response->GetReflection()->Swap(state->response, response);
+        m_budget.OnSuccess();
+        state->finish();
+        return;
     }
-    std::string ip = (*host_data).substr(0, idx);
-    uint16_t port = std::atoi((*host_data).substr(idx + 1, (*host_data).size() - idx).c_str());
-    return std::make_pair(ip, port);
+    state->last_error = error;
+    // 被过载保护拒绝的请求没有被执行，总是可以重试；
+    // 没有收到响应时不知道服务端是否执行过，只有幂等的方法才能重试
+    bool retryable = (status && *status == tinyrpc::RPC_OVERLOADED) || (!status && state->idempotent);
+    if (retryable && state->attempts < m_retry.max_attempts && !state->controller->IsCanceled()) {
+        auto backoff = m_retry.Backoff(state->attempts);
+        bool in_time = !state->deadline || std::chrono::steady_clock::now() + backoff < *state->deadline;
+        if (in_time && m_budget.TryRetry()) {
+            ++state->outstanding;
+            lock.unlock();
+            LOG(WARNING) << "rpc call " << state->method->full_name() << " failed: " << error << ", retry after " << backoff.count() << "ms";
+            RpcConnection::DefaultLoop()->runAfter(std::chrono::duration<double>(backoff).count(), [this, state] { StartAttempt(state, false); });
+            return;
+        }
+    }
+    if (state->outstanding > 0) {
+        // 还有对冲请求或者等待中的重试，由最后结束的那个报告失败
+        return;
+    }
+    state->finished = true;
+    lock.unlock();
+    state->controller->SetFailed(state->last_error);
+    state->finish();
 }
 
 RpcChannel::RpcChannel()
-    : m_clientfd(-1)
+    : m_balancer(LoadBalancer::Create(RpcConfig::Instance().Lookup("rpcclient_load_balancer").value_or("round_robin"),
+                                      [this](const Endpoint &endpoint) { return m_pool.InFlight(endpoint); }))
+    , m_default_timeout(RpcConfig::Instance().LookupInt("rpcclient_timeout_ms", 0))
+    , m_retry(RetryPolicy::FromConfig())
+    , m_budget(RetryBudget::FromConfig())
 {
+    RpcTrace::Configure();
 }
 
 RpcChannel::~RpcChannel()
 {
-    if (-1 != m_clientfd) {
-        close(m_clientfd);
-    }
-}
\ No newline at end of file
+}
@@ -3,8 +3,15 @@
 // 此类是继承自google::protobuf::RpcChannel
 // 目的是为了给客户端进行方法调用的时候，统一接收的
 
-#include "zookeeperutil.h"
+#include "connectionpool.h"
+#include "endpoint.h"
+#include "loadbalancer.h"
+#include "retrypolicy.h"
+#include <chrono>
 #include <google/protobuf/service.h>
+#include <functional>
+#include <memory>
+#include <optional>
 
 namespace meha
 {
@@ -24,6 +31,16 @@ public:
      * @param request: 指向 HelloRequest 对象的指针，其中包含 RPC 方法的请求参数。
      * @param response: 指向 HelloReply 对象的指针，应在其中设置 RPC 方法的响应结果。
      * @param done: 指向 Closure 对象的指针，表示 RPC 方法完成后应执行的操作。
+     * 为nullptr时是同步调用，返回时调用已经结束；
+     * 不为nullptr时是异步调用，请求发出后立即返回，调用结束（成功或失败）后在客户端IO线程中执行done，
+     * 此时controller、response必须在done执行之前一直有效。
+     * 服务有多个实例时由负载均衡器选择其中一个，controller是meha::RpcController时可以通过SetRequestKey设置路由键。
+     * controller是meha::RpcController时可以通过SetDeadline/SetTimeout设置截止时间，没有设置时使用配置项rpcclient_timeout_ms，
+     * 为0时不超时。超时的调用以失败结束，同步调用会在超时后返回。
+     * 配置了rpcclient_batch_window_us时，请求在连接上等待一个窗口，和窗口内的其他请求打包成一帧发送；
+     * 需要显式地批量发送时使用RpcBatch。
+     * 配置了rpcclient_max_attempts时，过载被拒绝的调用和幂等方法的传输失败会换一个实例重试，
+     * 幂等的方法还可以按rpcclient_hedge_percentile发送对冲请求，见RetryPolicy。
      */
     void CallMethod(const ::google::protobuf::MethodDescriptor *method,
                     ::google::protobuf::RpcController *controller,
@@ -32,27 +49,53 @@ public:
                     ::google::protobuf::Closure *done) override;
 
 private:
+    friend class RpcBatch;
+    friend class ClientStream;
+
+    /// @brief 已经选好实例和连接，可以发送的调用
+    struct PreparedCall
+    {
+        RpcConnection::Ptr conn;
+        RpcConnection::Request request;
+    };
     /**
-     * @brief 查询注册中心中服务的注册表项信息
-     * @param zkclient
-     * @param service_name 服务名
-     * @param method_name 方法名
-     * @return std::optional<std::pair<std::string, uint16_t>> IP和端口号
+     * @brief 查询服务实例、选择连接、计算超时，准备好要发送的请求
+     * @param on_done 调用结束（成功或失败）后执行，已经记录了调用的指标
+     * @return std::nullopt 调用在发送之前就失败或者被取消了，此时on_done已经执行过了
      */
-    std::optional<std::pair<std::string, uint16_t>> QueryServiceHost(ZkClient *zkclient, std::string service_name, std::string method_name);
+    std::optional<PreparedCall> Prepare(const ::google::protobuf::MethodDescriptor *method,
+                                        ::google::protobuf::RpcController *controller,
+                                        const ::google::protobuf::Message *request,
+                                        ::google::protobuf::Message *response,
+                                        std::function<void()> on_done);
+
+    // 一个带重试的调用在多次尝试之间共享的状态，定义在rpcchannel.cc中
+    struct RetryState;
+    using RetryStatePtr = std::shared_ptr<RetryState>;
+    // 按m_retry发起调用，on_done在最后一次尝试结束后执行一次
+    void CallWithRetry(const ::google::protobuf::MethodDescriptor *method,
+                       ::google::protobuf::RpcController *controller,
+                       const ::google::protobuf::Message *request,
+                       ::google::protobuf::Message *response,
+                       std::function<void()> on_done);
+    // 发起一次尝试，调用前已经在state->outstanding中为它计数。hedge为true时是对冲请求
+    void StartAttempt(const RetryStatePtr &state, bool hedge);
     /**
-     * @brief 连接到RpcProvider
-     * @param ip
-     * @param port
-     * @return true
-     * @return false
+     * @brief 一次尝试结束，决定调用成功、重试还是失败
+     * @param response 尝试成功时的响应，为nullptr表示尝试失败
+     * @param status 服务端返回的状态，没有收到服务端的响应（连接失败、超时等）时为std::nullopt
      */
-    bool ConnectTo(const std::string &ip, uint16_t port);
+    void OnAttemptDone(const RetryStatePtr &state, google::protobuf::Message *response,
+                       const std::string &error, std::optional<tinyrpc::RpcStatus> status);
 
-    int m_clientfd = -1; // 存放客户端套接字
-    std::string m_service_name;
-    std::string m_method_name;
-    std::string m_ip;
-    uint16_t m_port;
+    // 到各个RpcProvider的连接池，共享这个RpcChannel的所有Stub都复用其中的连接
+    ConnectionPool m_pool;
+    // 在服务的多个实例之间选择，策略由配置项rpcclient_load_balancer决定
+    std::unique_ptr<LoadBalancer> m_balancer;
+    // 没有在controller上设置截止时间的调用的默认超时时间
+    std::chrono::milliseconds m_default_timeout;
+    // 重试和对冲策略，以及所有调用共享的重试预算
+    RetryPolicy m_retry;
+    RetryBudget m_budget;
 };
 }
\ No newline at end of file
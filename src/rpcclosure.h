@@ -0,0 +1,37 @@
+#pragma once
+
+#include <functional>
+#include <google/protobuf/stubs/callback.h>
+
+namespace meha
+{
+
+/**
+ * @brief 用std::function构造的Closure，执行一次后自动释放
+ * @details google::protobuf::NewCallback最多只能绑定两个参数，也不能捕获lambda，这里补上这个能力
+ */
+class FunctionClosure : public google::protobuf::Closure
+{
+public:
+    explicit FunctionClosure(std::function<void()> func)
+        : m_func(std::move(func))
+    {
+    }
+
+    void Run() override
+    {
+        std::function<void()> func = std::move(m_func);
+        delete this;
+        func();
+    }
+
+private:
+    std::function<void()> m_func;
+};
+
+inline google::protobuf::Closure *NewClosure(std::function<void()> func)
+{
+    return new FunctionClosure(std::move(func));
+}
+
+}
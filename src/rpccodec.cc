@@ -0,0 +1,71 @@
+#include "rpccodec.h"
+#include <algorithm>
+#include <climits>
+#include <google/protobuf/io/coded_stream.h>
+
+using namespace meha;
+
+bool codec::AppendFrame(const google::protobuf::MessageLite &header, const std::string &body, std::string *out)
+{
+    size_t header_size = header.ByteSizeLong();
+    size_t varint_size = google::protobuf::io::CodedOutputStream::VarintSize32(static_cast<uint32_t>(header_size));
+    size_t offset = out->size();
+    out->resize(offset + varint_size + header_size);
+    auto *begin = reinterpret_cast<uint8_t *>(out->data() + offset);
+    google::protobuf::io::CodedOutputStream::WriteVarint32ToArray(static_cast<uint32_t>(header_size), begin);
+    if (!header.SerializeToArray(begin + varint_size, static_cast<int>(header_size))) {
+        out->resize(offset);
+        return false;
+    }
+    out->append(body);
+    return true;
+}
+
+bool codec::AppendFrame(const google::protobuf::MessageLite &header, const google::protobuf::MessageLite &body, std::string *out)
+{
+    if (!body.IsInitialized()) {
+        return false;
+    }
+    size_t header_size = header.ByteSizeLong();
+    size_t varint_size = google::protobuf::io::CodedOutputStream::VarintSize32(static_cast<uint32_t>(header_size));
+    size_t body_size = static_cast<size_t>(body.GetCachedSize());
+    size_t offset = out->size();
+    out->resize(offset + varint_size + header_size + body_size);
+    auto *target = reinterpret_cast<uint8_t *>(out->data() + offset);
+    target = google::protobuf::io::CodedOutputStream::WriteVarint32ToArray(static_cast<uint32_t>(header_size), target);
+    target = header.SerializeWithCachedSizesToArray(target);
+    body.SerializeWithCachedSizesToArray(target);
+    return true;
+}
+
+uint32_t codec::MethodId(const google::protobuf::MethodDescriptor *method)
+{
+    uint32_t hash = 2166136261u;
+    for (char c : method->full_name()) {
+        hash ^= static_cast<uint8_t>(c);
+        hash *= 16777619u;
+    }
+    return hash != 0 ? hash : 1;
+}
+
+codec::DecodeStatus codec::ParseHeader(const char *data, size_t len, google::protobuf::MessageLite *header, size_t *body_offset)
+{
+    google::protobuf::io::CodedInputStream input(reinterpret_cast<const uint8_t *>(data), static_cast<int>(std::min<size_t>(len, INT_MAX)));
+    uint32_t header_size = 0;
+    if (!input.ReadVarint32(&header_size)) {
+        // varint32最多5个字节，不足5个字节时可能只是还没收全
+        return len < 5 ? DecodeStatus::kIncomplete : DecodeStatus::kError;
+    }
+    if (header_size > kMaxHeaderSize) {
+        return DecodeStatus::kError;
+    }
+    size_t varint_size = input.CurrentPosition();
+    if (len < varint_size + header_size) {
+        return DecodeStatus::kIncomplete;
+    }
+    if (!header->ParseFromArray(data + varint_size, static_cast<int>(header_size))) {
+        return DecodeStatus::kError;
+    }
+    *body_offset = varint_size + header_size;
+    return DecodeStatus::kOk;
+}
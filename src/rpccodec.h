@@ -0,0 +1,116 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/message_lite.h>
+#include <string>
+#include "tinyrpcheader.pb.h"
+
+namespace meha
+{
+
+/**
+ * @brief tinyrpc的帧编解码
+ * @details 请求和响应使用相同的帧格式：varint32(header_size) + header + body，
+ * 其中header是RpcHeader或RpcResponseHeader，body的长度记录在header中。
+ * 这样接收方总是可以先解析出header，再根据其中的长度判断body是否已经完整到达。
+ */
+namespace codec
+{
+
+enum class DecodeStatus {
+    kOk,
+    kIncomplete, // 数据还没有收全，需要等待更多数据
+    kError, // 数据格式错误，连接上的字节流已经无法继续解析
+};
+
+// header的长度上限，超过这个长度认为是错误的数据
+constexpr uint32_t kMaxHeaderSize = 64 * 1024;
+// body的长度上限，防止错误的长度字段让接收方无限制地缓存数据
+constexpr uint32_t kMaxBodySize = 64 * 1024 * 1024;
+// 一个批量帧中最多包含的子帧数
+constexpr uint32_t kMaxBatchSize = 1024;
+
+// 把header和body编码成一帧，追加到out的末尾
+bool AppendFrame(const google::protobuf::MessageLite &header, const std::string &body, std::string *out);
+/**
+ * @brief 把header和body消息直接序列化到out的末尾，整帧只分配一次内存，不经过中间的std::string
+ * @note 调用前需要已经通过body.ByteSizeLong()得到body的长度并填入header，之后body不能再被修改
+ */
+bool AppendFrame(const google::protobuf::MessageLite &header, const google::protobuf::MessageLite &body, std::string *out);
+
+/**
+ * @brief 遍历批量帧中的子帧。批量帧就是header中batch_size不为0的普通帧，用AppendFrame把首尾相连的子帧作为body编码
+ * @param visit 对每个子帧调用一次，参数为解析出的header、子帧的body和body的长度，返回false时停止遍历
+ * @return false 子帧格式错误、长度和batch_size不一致，或者visit返回了false
+ */
+template <typename Header, typename Visitor>
+bool ForEachInBatch(const char *data, size_t len, uint32_t batch_size, Visitor &&visit);
+
+/**
+ * @brief 计算方法的编号，客户端和服务端用同样的方法各自计算，不需要额外协商
+ * @details 对方法全名（包名.服务名.方法名）做32位FNV-1a哈希，结果不会为0，0表示请求中没有带编号。
+ * 服务端注册时会检查同一个进程中的方法编号有没有冲突
+ */
+uint32_t MethodId(const google::protobuf::MethodDescriptor *method);
+
+/**
+ * @brief 从data开始的len字节中解析一帧的header
+ * @param body_offset 解析成功时输出body相对于data的偏移
+ */
+DecodeStatus ParseHeader(const char *data, size_t len, google::protobuf::MessageLite *header, size_t *body_offset);
+
+// 帧的body长度，请求帧为args_size，响应帧为body_size
+inline uint32_t BodySize(const tinyrpc::RpcHeader &header) { return header.args_size(); }
+inline uint32_t BodySize(const tinyrpc::RpcResponseHeader &header) { return header.body_size(); }
+
+/**
+ * @brief 从data开始的len字节中切分出一个完整的帧
+ * @details body超过kMaxBodySize时直接返回kError，不会为错误的长度字段一直等待、缓存数据
+ * @param frame_size 解析成功时输出整帧的长度，body位于[body_offset, frame_size)
+ */
+template <typename Header>
+DecodeStatus ParseFrame(const char *data, size_t len, Header *header, size_t *body_offset, size_t *frame_size)
+{
+    DecodeStatus status = ParseHeader(data, len, header, body_offset);
+    if (status != DecodeStatus::kOk) {
+        return status;
+    }
+    uint32_t body_size = BodySize(*header);
+    if (body_size > kMaxBodySize) {
+        return DecodeStatus::kError;
+    }
+    if (len - *body_offset < body_size) {
+        return DecodeStatus::kIncomplete;
+    }
+    *frame_size = *body_offset + body_size;
+    return DecodeStatus::kOk;
+}
+
+template <typename Header, typename Visitor>
+bool ForEachInBatch(const char *data, size_t len, uint32_t batch_size, Visitor &&visit)
+{
+    if (batch_size > kMaxBatchSize) {
+        return false;
+    }
+    size_t offset = 0;
+    for (uint32_t i = 0; i < batch_size; ++i) {
+        Header header;
+        size_t body_offset = 0;
+        if (ParseHeader(data + offset, len - offset, &header, &body_offset) != DecodeStatus::kOk || header.batch_size() != 0) {
+            // 批量帧的长度是完整的，子帧不完整只能是格式错误；也不允许批量帧嵌套
+            return false;
+        }
+        uint32_t body_size = BodySize(header);
+        if (len - offset - body_offset < body_size || !visit(header, data + offset + body_offset, body_size)) {
+            return false;
+        }
+        offset += body_offset + body_size;
+    }
+    return offset == len;
+}
+
+}
+
+}
@@ -0,0 +1,277 @@
+#include "rpccompress.h"
+#include "rpccodec.h"
+#include "rpcconfig.h"
+#include <array>
+#include <atomic>
+#include <glog/logging.h>
+#include <memory>
+#include <unordered_map>
+
+#ifdef TINYRPC_WITH_LZ4
+#include <lz4.h>
+#endif
+#ifdef TINYRPC_WITH_ZSTD
+#include <zstd.h>
+#endif
+#ifdef TINYRPC_WITH_SNAPPY
+#include <snappy.h>
+#endif
+
+using namespace meha;
+
+namespace
+{
+
+#ifdef TINYRPC_WITH_LZ4
+class Lz4Compressor : public Compressor
+{
+public:
+    bool Compress(const char *data, size_t len, std::string *out) const override
+    {
+        size_t offset = out->size();
+        int bound = LZ4_compressBound(static_cast<int>(len));
+        out->resize(offset + bound);
+        int n = LZ4_compress_default(data, out->data() + offset, static_cast<int>(len), bound);
+        out->resize(offset + (n > 0 ? n : 0));
+        return n > 0;
+    }
+
+    bool Decompress(const char *data, size_t len, size_t raw_size, std::string *out) const override
+    {
+        out->resize(raw_size);
+        int n = LZ4_decompress_safe(data, out->data(), static_cast<int>(len), static_cast<int>(raw_size));
+        return n >= 0 && static_cast<size_t>(n) == raw_size;
+    }
+};
+#endif
+
+#ifdef TINYRPC_WITH_ZSTD
+class ZstdCompressor : public Compressor
+{
+public:
+    explicit ZstdCompressor(int level)
+        : m_level(level)
+    {
+    }
+
+    bool Compress(const char *data, size_t len, std::string *out) const override
+    {
+        // 压缩上下文的创建开销不小，每个线程复用一个
+        thread_local std::unique_ptr<ZSTD_CCtx, decltype(&ZSTD_freeCCtx)> cctx(ZSTD_createCCtx(), ZSTD_freeCCtx);
+        size_t offset = out->size();
+        size_t bound = ZSTD_compressBound(len);
+        out->resize(offset + bound);
+        size_t n = ZSTD_compressCCtx(cctx.get(), out->data() + offset, bound, data, len, m_level);
+        out->resize(offset + (ZSTD_isError(n) ? 0 : n));
+        return !ZSTD_isError(n);
+    }
+
+    bool Decompress(const char *data, size_t len, size_t raw_size, std::string *out) const override
+    {
+        thread_local std::unique_ptr<ZSTD_DCtx, decltype(&ZSTD_freeDCtx)> dctx(ZSTD_createDCtx(), ZSTD_freeDCtx);
+        out->resize(raw_size);
+        size_t n = ZSTD_decompressDCtx(dctx.get(), out->data(), raw_size, data, len);
+        return !ZSTD_isError(n) && n == raw_size;
+    }
+
+private:
+    int m_level;
+};
+#endif
+
+#ifdef TINYRPC_WITH_SNAPPY
+class SnappyCompressor : public Compressor
+{
+public:
+    bool Compress(const char *data, size_t len, std::string *out) const override
+    {
+        size_t offset = out->size();
+        out->resize(offset + snappy::MaxCompressedLength(len));
+        size_t n = 0;
+        snappy::RawCompress(data, len, out->data() + offset, &n);
+        out->resize(offset + n);
+        return true;
+    }
+
+    bool Decompress(const char *data, size_t len, size_t raw_size, std::string *out) const override
+    {
+        size_t n = 0;
+        if (!snappy::GetUncompressedLength(data, len, &n) || n != raw_size) {
+            return false;
+        }
+        out->resize(raw_size);
+        return snappy::RawUncompress(data, len, out->data());
+    }
+};
+#endif
+
+// 按Compression的值索引的所有可用算法，编号和accept_compression的位一一对应
+struct CompressorTable
+{
+    CompressorTable()
+    {
+        // 内置算法的名字总是可以识别，编译时不可用的算法在ForMethod中按none处理
+        names = {{"none", tinyrpc::COMPRESS_NONE}, {"lz4", tinyrpc::COMPRESS_LZ4}, {"zstd", tinyrpc::COMPRESS_ZSTD}, {"snappy", tinyrpc::COMPRESS_SNAPPY}};
+#ifdef TINYRPC_WITH_LZ4
+        Set(tinyrpc::COMPRESS_LZ4, "lz4", std::make_unique<Lz4Compressor>());
+#endif
+#ifdef TINYRPC_WITH_ZSTD
+        Set(tinyrpc::COMPRESS_ZSTD, "zstd", std::make_unique<ZstdCompressor>(static_cast<int>(RpcConfig::Instance().LookupInt("rpc_compression_zstd_level", 1))));
+#endif
+#ifdef TINYRPC_WITH_SNAPPY
+        Set(tinyrpc::COMPRESS_SNAPPY, "snappy", std::make_unique<SnappyCompressor>());
+#endif
+    }
+
+    void Set(tinyrpc::Compression type, const std::string &name, std::unique_ptr<Compressor> compressor)
+    {
+        names[name] = type;
+        compressors[type] = std::move(compressor);
+        mask |= 1u << type;
+    }
+
+    std::array<std::unique_ptr<Compressor>, 32> compressors;
+    std::unordered_map<std::string, tinyrpc::Compression> names; // 配置中使用的算法名
+    std::atomic<uint32_t> mask{1u << tinyrpc::COMPRESS_NONE}; // 可用的算法，none总是可用
+};
+
+CompressorTable &Compressors()
+{
+    static CompressorTable table;
+    return table;
+}
+
+void SetBodySize(tinyrpc::RpcHeader &header, uint32_t size) { header.set_args_size(size); }
+void SetBodySize(tinyrpc::RpcResponseHeader &header, uint32_t size) { header.set_body_size(size); }
+
+template <typename Header>
+bool AppendCompressed(Header &header, const google::protobuf::MessageLite &body, std::string *out)
+{
+    const Compressor *compressor = Compressor::Get(header.compression());
+    uint32_t raw_size = codec::BodySize(header);
+    if (!compressor || raw_size < Compressor::MinBytes()) {
+        header.clear_compression();
+        return codec::AppendFrame(header, body, out);
+    }
+    if (!body.IsInitialized()) {
+        return false;
+    }
+    // 压缩的消息都比较大，中间缓冲区按线程复用
+    thread_local std::string raw;
+    thread_local std::string compressed;
+    raw.resize(raw_size);
+    body.SerializeWithCachedSizesToArray(reinterpret_cast<uint8_t *>(raw.data()));
+    compressed.clear();
+    if (!compressor->Compress(raw.data(), raw.size(), &compressed) || compressed.size() >= raw.size()) {
+        // 压缩不了或者压缩之后没有变小，按原样发送
+        header.clear_compression();
+        return codec::AppendFrame(header, raw, out);
+    }
+    header.set_raw_size(raw_size);
+    SetBodySize(header, static_cast<uint32_t>(compressed.size()));
+    return codec::AppendFrame(header, compressed, out);
+}
+
+template <typename Header>
+bool Parse(const Header &header, const char *body, size_t body_size, google::protobuf::MessageLite *message)
+{
+    if (header.compression() == tinyrpc::COMPRESS_NONE) {
+        return message->ParseFromArray(body, static_cast<int>(body_size));
+    }
+    const Compressor *compressor = Compressor::Get(header.compression());
+    if (!compressor || header.raw_size() > codec::kMaxBodySize) {
+        return false;
+    }
+    thread_local std::string raw;
+    if (!compressor->Decompress(body, body_size, header.raw_size(), &raw)) {
+        return false;
+    }
+    return message->ParseFromArray(raw.data(), static_cast<int>(raw.size()));
+}
+
+}
+
+bool Compressor::Register(tinyrpc::Compression type, const std::string &name, std::unique_ptr<Compressor> compressor)
+{
+    auto &table = Compressors();
+    if (type == tinyrpc::COMPRESS_NONE || static_cast<size_t>(type) >= table.compressors.size() || !compressor) {
+        LOG(ERROR) << "can not register compression " << name << " as " << static_cast<int>(type);
+        return false;
+    }
+    table.Set(type, name, std::move(compressor));
+    return true;
+}
+
+const Compressor *Compressor::Get(tinyrpc::Compression type)
+{
+    auto &table = Compressors();
+    return static_cast<size_t>(type) < table.compressors.size() ? table.compressors[type].get() : nullptr;
+}
+
+uint32_t Compressor::SupportedMask()
+{
+    return Compressors().mask.load(std::memory_order_relaxed);
+}
+
+std::optional<tinyrpc::Compression> Compressor::Parse(const std::string &name)
+{
+    auto &names = Compressors().names;
+    auto it = names.find(name);
+    if (it == names.end()) {
+        return std::nullopt;
+    }
+    return it->second;
+}
+
+tinyrpc::Compression Compressor::ForMethod(const google::protobuf::MethodDescriptor *method)
+{
+    // 方法描述符的地址在进程内不会变化，每个线程缓存查询结果，之后不需要再查配置
+    thread_local std::unordered_map<const google::protobuf::MethodDescriptor *, tinyrpc::Compression> cache;
+    auto it = cache.find(method);
+    if (it != cache.end()) {
+        return it->second;
+    }
+    auto &config = RpcConfig::Instance();
+    const std::string &service_name = method->service()->name();
+    auto name = config.Lookup("rpc_compression." + service_name + "." + method->name());
+    if (!name) {
+        name = config.Lookup("rpc_compression." + service_name);
+    }
+    if (!name) {
+        name = config.Lookup("rpc_compression");
+    }
+    auto type = Parse(name.value_or("none"));
+    if (!type) {
+        LOG(WARNING) << "unknown compression " << *name << " for " << method->full_name();
+    } else if (*type != tinyrpc::COMPRESS_NONE && !Get(*type)) {
+        LOG(WARNING) << "compression " << *name << " for " << method->full_name() << " is not compiled in";
+        type = tinyrpc::COMPRESS_NONE;
+    }
+    return cache.emplace(method, type.value_or(tinyrpc::COMPRESS_NONE)).first->second;
+}
+
+size_t Compressor::MinBytes()
+{
+    static const size_t min_bytes = RpcConfig::Instance().LookupInt("rpc_compression_min_bytes", 1024);
+    return min_bytes;
+}
+
+bool codec::AppendCompressedFrame(tinyrpc::RpcHeader &header, const google::protobuf::MessageLite &body, std::string *out)
+{
+    return AppendCompressed(header, body, out);
+}
+
+bool codec::AppendCompressedFrame(tinyrpc::RpcResponseHeader &header, const google::protobuf::MessageLite &body, std::string *out)
+{
+    return AppendCompressed(header, body, out);
+}
+
+bool codec::ParseBody(const tinyrpc::RpcHeader &header, const char *body, size_t body_size, google::protobuf::MessageLite *message)
+{
+    return Parse(header, body, body_size, message);
+}
+
+bool codec::ParseBody(const tinyrpc::RpcResponseHeader &header, const char *body, size_t body_size, google::protobuf::MessageLite *message)
+{
+    return Parse(header, body, body_size, message);
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include "tinyrpcheader.pb.h"
+#include <cstddef>
+#include <cstdint>
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/message.h>
+#include <memory>
+#include <optional>
+#include <string>
+
+namespace meha
+{
+
+/**
+ * @brief 请求体和响应体的压缩算法
+ * @details 使用的算法记录在RpcHeader/RpcResponseHeader的compression字段中，两个方向都要协商：
+ * 客户端在请求的accept_compression中带上自己能解压的算法，服务端只用客户端能解压的算法压缩响应；
+ * 服务端在响应的accept_compression中带上自己能解压的算法，客户端之后在这个连接上只用这些算法压缩请求
+ * （收到第一个响应之前不压缩）。所以两端编译进来的算法不同时也能互通。
+ * 每个方法使用的算法由配置项rpc_compression.<服务名>.<方法名>、rpc_compression.<服务名>、rpc_compression依次查找，
+ * 可选none（默认）、lz4、zstd、snappy。小于rpc_compression_min_bytes（默认1024）字节的消息不压缩，
+ * 压缩后没有变小的消息也按原样发送。
+ * 各个算法只有在编译时找到了对应的库才可用（TINYRPC_WITH_LZ4/TINYRPC_WITH_ZSTD/TINYRPC_WITH_SNAPPY），不可用的算法按none处理。
+ * 可以通过Register替换内置的实现，或者为tinyrpcheader.proto中新增的算法编号注册实现。
+ */
+class Compressor
+{
+public:
+    virtual ~Compressor() = default;
+
+    // 把data压缩后追加到out中
+    virtual bool Compress(const char *data, size_t len, std::string *out) const = 0;
+    // 把data解压到out中，raw_size是压缩前的长度，解压出的长度不一致时失败
+    virtual bool Decompress(const char *data, size_t len, size_t raw_size, std::string *out) const = 0;
+
+    /**
+     * @brief 注册一个算法的实现，替换同一编号上已有的实现
+     * 需要在创建RpcProvider、RpcChannel之前调用，之后的调用会和正在进行的压缩、解压并发
+     * @param type 算法编号，不能是COMPRESS_NONE，不能超过31（accept_compression是32位的掩码）
+     * @param name 配置项rpc_compression中使用的名字
+     * @return false 编号不合法
+     */
+    static bool Register(tinyrpc::Compression type, const std::string &name, std::unique_ptr<Compressor> compressor);
+    // 算法不可用时返回nullptr
+    static const Compressor *Get(tinyrpc::Compression type);
+    // 本进程能解压的算法的位掩码
+    static uint32_t SupportedMask();
+    // 解析配置中的算法名，不认识的名字返回std::nullopt
+    static std::optional<tinyrpc::Compression> Parse(const std::string &name);
+    // 按配置查找方法使用的算法，结果按线程缓存。算法不可用时返回COMPRESS_NONE
+    static tinyrpc::Compression ForMethod(const google::protobuf::MethodDescriptor *method);
+    // 小于这个长度的消息不压缩
+    static size_t MinBytes();
+};
+
+namespace codec
+{
+
+/**
+ * @brief 按header.compression()压缩body并编码成一帧，追加到out的末尾
+ * 调用前需要已经通过body.ByteSizeLong()得到body的长度并填入header。不压缩时（算法为none、body太小、压缩后没有变小）
+ * 清除header中的算法，和AppendFrame的结果相同；压缩时改写header中的长度并填入raw_size
+ */
+bool AppendCompressedFrame(tinyrpc::RpcHeader &header, const google::protobuf::MessageLite &body, std::string *out);
+bool AppendCompressedFrame(tinyrpc::RpcResponseHeader &header, const google::protobuf::MessageLite &body, std::string *out);
+// 按header.compression()解压body之后反序列化到message中
+bool ParseBody(const tinyrpc::RpcHeader &header, const char *body, size_t body_size, google::protobuf::MessageLite *message);
+bool ParseBody(const tinyrpc::RpcResponseHeader &header, const char *body, size_t body_size, google::protobuf::MessageLite *message);
+
+}
+
+}
@@ -1,5 +1,6 @@
 #include "rpcconfig.h"
 #include "memory"
+#include <cmath>
 #include <cstdlib>
 #include <glog/logging.h>
 #include <iostream>
@@ -90,6 +91,51 @@ std::optional<std::string> RpcConfig::Lookup(const std::string &key)
     return it->second;
 }
 
+int64_t RpcConfig::LookupInt(const std::string &key, int64_t default_value)
+{
+    auto value = Lookup(key);
+    if (!value || value->empty()) {
+        return default_value;
+    }
+    char *end = nullptr;
+    int64_t result = std::strtoll(value->c_str(), &end, 10);
+    if (*end != '\0') {
+        LOG(WARNING) << "config " << key << "=" << *value << " is not an integer, use default " << default_value;
+        return default_value;
+    }
+    return result;
+}
+
+size_t RpcConfig::LookupCount(const std::string &key, size_t default_value, int64_t min_value)
+{
+    int64_t value = LookupInt(key, static_cast<int64_t>(default_value));
+    if (value < min_value) {
+        LOG(ERROR) << "config " << key << "=" << value << " should be at least " << min_value << ", use default " << default_value;
+        return default_value;
+    }
+    return static_cast<size_t>(value);
+}
+
+double RpcConfig::LookupDouble(const std::string &key, double default_value)
+{
+    auto value = Lookup(key);
+    if (!value || value->empty()) {
+        return default_value;
+    }
+    char *end = nullptr;
+    double result = std::strtod(value->c_str(), &end);
+    if (*end != '\0' || !std::isfinite(result)) {
+        LOG(WARNING) << "config " << key << "=" << *value << " is not a number, use default " << default_value;
+        return default_value;
+    }
+    return result;
+}
+
+void RpcConfig::Set(const std::string &key, const std::string &value)
+{
+    m_config_map.insert_or_assign(key, value);
+}
+
 void RpcConfig::Trim(std::string &read_buf)
 {
     int index = read_buf.find_first_not_of(' '); // 去掉字符串前的空格
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include <optional>
 #include <string>
 #include <unordered_map>
@@ -17,6 +18,14 @@ public:
     void LoadConfigFile(const char *config_file);
     // 查找key对应的value
     std::optional<std::string> Lookup(const std::string &key);
+    // 查找key对应的整数值，不存在或者不是合法整数时返回default_value
+    int64_t LookupInt(const std::string &key, int64_t default_value);
+    // 查找key对应的数量，不存在时返回default_value；小于min_value时（例如负数，直接转成size_t会变成一个极大的值，相当于取消了限制）报错并返回default_value
+    size_t LookupCount(const std::string &key, size_t default_value, int64_t min_value);
+    // 查找key对应的浮点数值，不存在或者不是合法数字时返回default_value
+    double LookupDouble(const std::string &key, double default_value);
+    // 在程序中设置配置项，覆盖配置文件中的值，需要在创建RpcProvider、RpcChannel之前设置
+    void Set(const std::string &key, const std::string &value);
 
 private:
     // 去掉字符串前后的空格
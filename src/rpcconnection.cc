@@ -0,0 +1,649 @@
+#include "rpcconnection.h"
+#include "rpccodec.h"
+#include "rpccompress.h"
+#include "rpcconfig.h"
+#include "unixsocket.h"
+#include <algorithm>
+#include <glog/logging.h>
+#include <muduo/net/EventLoopThread.h>
+
+using namespace meha;
+
+RpcConnection::RpcConnection(muduo::net::EventLoop *loop, const Endpoint &endpoint, const BatchOptions &batch)
+    : m_loop(loop)
+    , m_endpoint(endpoint)
+    , m_state(State::kConnecting)
+    , m_batch(batch)
+    , m_idle_since(std::chrono::steady_clock::now())
+    , m_next_call_id(0)
+{
+}
+
+RpcConnection::~RpcConnection()
+{
+    // TcpClient析构时会关闭连接，回调中持有的是weak_ptr，不会访问到已经析构的对象。
+    // Unix域套接字的连接没有TcpClient管理，需要自己关闭，排在Connect中投递的connectEstablished之后执行
+    if (m_unix_conn) {
+        m_loop->queueInLoop([conn = m_unix_conn] { conn->forceClose(); });
+    }
+}
+
+namespace
+{
+
+// 客户端的IO线程，所有RpcChannel共用，随进程一起退出
+std::vector<muduo::net::EventLoop *> &ClientLoops()
+{
+    static std::vector<std::unique_ptr<muduo::net::EventLoopThread>> threads;
+    static std::vector<muduo::net::EventLoop *> loops = [] {
+        size_t count = std::max<int64_t>(1, RpcConfig::Instance().LookupInt("rpcclient_io_threads", 1));
+        std::vector<muduo::net::EventLoop *> loops;
+        for (size_t i = 0; i < count; ++i) {
+            threads.push_back(std::make_unique<muduo::net::EventLoopThread>(muduo::net::EventLoopThread::ThreadInitCallback(), "RpcClientLoop" + std::to_string(i)));
+            loops.push_back(threads.back()->startLoop());
+        }
+        return loops;
+    }();
+    return loops;
+}
+
+}
+
+muduo::net::EventLoop *RpcConnection::DefaultLoop()
+{
+    return ClientLoops().front();
+}
+
+muduo::net::EventLoop *RpcConnection::NextLoop()
+{
+    static std::atomic<size_t> next{0};
+    auto &loops = ClientLoops();
+    return loops[next.fetch_add(1, std::memory_order_relaxed) % loops.size()];
+}
+
+void RpcConnection::Connect(std::chrono::milliseconds timeout)
+{
+    std::weak_ptr<RpcConnection> weak_self = weak_from_this();
+    auto on_connection = [weak_self](const muduo::net::TcpConnectionPtr &conn) {
+        if (auto self = weak_self.lock()) {
+            self->OnConnection(conn);
+        }
+    };
+    auto on_message = [weak_self](const muduo::net::TcpConnectionPtr &conn, muduo::net::Buffer *buffer, muduo::Timestamp receive_time) {
+        if (auto self = weak_self.lock()) {
+            self->OnMessage(conn, buffer, receive_time);
+        } else {
+            buffer->retrieveAll();
+        }
+    };
+    if (!m_endpoint.uds.empty()) {
+        // 服务端在本机时通过Unix域套接字连接，绕过回环网卡上的TCP协议栈。连接是立即完成的，不需要连接超时
+        m_unix_conn = ConnectUnix(m_loop, m_endpoint.uds, "RpcClient-" + m_endpoint.uds);
+        if (m_unix_conn) {
+            m_unix_conn->setConnectionCallback(on_connection);
+            m_unix_conn->setMessageCallback(on_message);
+            m_unix_conn->setCloseCallback([](const muduo::net::TcpConnectionPtr &conn) {
+                conn->getLoop()->queueInLoop([conn] { conn->connectDestroyed(); });
+            });
+            m_loop->runInLoop([conn = m_unix_conn] { conn->connectEstablished(); });
+            return;
+        }
+        LOG(WARNING) << "connect " << m_endpoint.uds << " error, fall back to tcp " << m_endpoint.ToString();
+    }
+    m_client = std::make_unique<muduo::net::TcpClient>(m_loop, muduo::net::InetAddress(m_endpoint.ip, m_endpoint.port), "RpcClient-" + m_endpoint.ToString());
+    m_client->setConnectionCallback(on_connection);
+    m_client->setMessageCallback(on_message);
+    m_client->connect();
+    m_loop->runAfter(std::chrono::duration<double>(timeout).count(), [weak_self] {
+        if (auto self = weak_self.lock()) {
+            self->OnConnectTimeout();
+        }
+    });
+}
+
+void RpcConnection::OnConnectTimeout()
+{
+    if (m_state != State::kConnecting) {
+        return;
+    }
+    LOG(ERROR) << "connect server " << m_endpoint.ToString() << " timeout";
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_state = State::kClosed;
+        m_backlog.clear();
+        m_outbox.clear();
+        m_outbox_calls = 0;
+        m_write_buffer.clear();
+    }
+    // TcpClient的Connector在连接失败时会一直重试，需要显式停止
+    if (m_client) {
+        m_client->stop();
+    }
+    FailAll("connect to server error");
+}
+
+void RpcConnection::Close()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_state = State::kClosed;
+        m_backlog.clear();
+        m_outbox.clear();
+        m_outbox_calls = 0;
+        m_write_buffer.clear();
+    }
+    if (m_client) {
+        m_client->disconnect();
+        m_client->stop();
+    } else if (m_unix_conn) {
+        m_unix_conn->shutdown();
+    }
+    FailAll("connection closed");
+}
+
+uint64_t RpcConnection::Send(const CallPtr &call, tinyrpc::RpcHeader &header, const google::protobuf::Message &request, std::chrono::milliseconds timeout)
+{
+    uint64_t call_id;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        call_id = ++m_next_call_id;
+    }
+    header.set_call_id(call_id);
+    // header和请求参数直接序列化到同一块缓冲区中。请求帧之后会被拷贝到连接的写缓冲区或者发件箱中，
+    // 所以这块缓冲区可以在同一个线程的下一次调用中复用，不需要每次都重新分配
+    thread_local std::string frame;
+    frame.clear();
+    auto start = std::chrono::steady_clock::now();
+    NegotiateCompression(header);
+    bool serialized = codec::AppendCompressedFrame(header, request, &frame);
+    if (call->metrics) {
+        call->metrics->serialize_time.Record(std::chrono::steady_clock::now() - start);
+        call->metrics->bytes_out.Add(header.args_size());
+    }
+    if (!serialized) {
+        LOG(ERROR) << "serialize rpc request error!";
+        Fail(call, "serialize rpc request error!");
+        return call_id;
+    }
+
+    muduo::net::TcpConnectionPtr conn;
+    std::string outbox;
+    size_t outbox_calls = 0;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_state == State::kConnecting) {
+            // 连接建立后由OnConnection统一发出
+            AddPendingLocked(call_id, call, timeout);
+            m_backlog.append(frame);
+            return call_id;
+        }
+        if (m_state == State::kConnected) {
+            AddPendingLocked(call_id, call, timeout);
+            conn = m_conn;
+            if (call->on_stream) {
+                // 流式调用之后的消息、额度帧都通过写缓冲区发送，打开流的请求不能留在发件箱中，否则会被它们超过，
+                // 服务端收到时调用还不存在而丢弃。发件箱中积攒的请求也一起转到写缓冲区，保持发送顺序
+                if (m_outbox_calls > 0) {
+                    m_loop->cancel(m_outbox_timer);
+                    AppendWriteLocked(PackFrames(std::move(m_outbox), m_outbox_calls));
+                    m_outbox.clear();
+                    m_outbox_calls = 0;
+                }
+                AppendWriteLocked(frame);
+                return call_id;
+            }
+            if (m_batch.window > std::chrono::microseconds::zero()) {
+                // 自动批量发送：先放进发件箱，窗口到期或者积攒够了再一起发出
+                m_outbox.append(frame);
+                if (++m_outbox_calls < m_batch.max_calls) {
+                    if (m_outbox_calls == 1) {
+                        std::weak_ptr<RpcConnection> weak_self = weak_from_this();
+                        m_outbox_timer = m_loop->runAfter(std::chrono::duration<double>(m_batch.window).count(), [weak_self] {
+                            if (auto self = weak_self.lock()) {
+                                self->FlushOutbox();
+                            }
+                        });
+                    }
+                    return call_id;
+                }
+                m_loop->cancel(m_outbox_timer);
+                outbox.swap(m_outbox);
+                outbox_calls = m_outbox_calls;
+                m_outbox_calls = 0;
+            } else {
+                AppendWriteLocked(frame);
+                return call_id;
+            }
+        }
+    }
+    if (!conn) {
+        Fail(call, "connection closed");
+        return call_id;
+    }
+    SendFrames(conn, std::move(outbox), outbox_calls);
+    return call_id;
+}
+
+void RpcConnection::SendBatch(std::vector<Request> &requests)
+{
+    std::string frames;
+    std::vector<std::pair<uint64_t, const Request *>> encoded;
+    encoded.reserve(requests.size());
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (auto &request : requests) {
+            request.header.set_call_id(++m_next_call_id);
+        }
+    }
+    for (auto &request : requests) {
+        auto start = std::chrono::steady_clock::now();
+        NegotiateCompression(request.header);
+        bool serialized = codec::AppendCompressedFrame(request.header, *request.request, &frames);
+        if (request.call->metrics) {
+            request.call->metrics->serialize_time.Record(std::chrono::steady_clock::now() - start);
+            request.call->metrics->bytes_out.Add(request.header.args_size());
+        }
+        if (!serialized) {
+            LOG(ERROR) << "serialize rpc request error!";
+            Fail(request.call, "serialize rpc request error!");
+            continue;
+        }
+        encoded.emplace_back(request.header.call_id(), &request);
+    }
+    if (encoded.empty()) {
+        return;
+    }
+
+    muduo::net::TcpConnectionPtr conn;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_state != State::kClosed) {
+            for (auto &[call_id, request] : encoded) {
+                AddPendingLocked(call_id, request->call, request->timeout);
+            }
+        }
+        if (m_state == State::kConnecting) {
+            m_backlog.append(frames);
+            return;
+        }
+        if (m_state == State::kConnected) {
+            conn = m_conn;
+        }
+    }
+    if (!conn) {
+        for (auto &[call_id, request] : encoded) {
+            Fail(request->call, "connection closed");
+        }
+        return;
+    }
+    SendFrames(conn, std::move(frames), encoded.size());
+}
+
+void RpcConnection::AddPendingLocked(uint64_t call_id, const CallPtr &call, std::chrono::milliseconds timeout)
+{
+    if (timeout > std::chrono::milliseconds::zero()) {
+        // 在锁内设置定时器，保证定时器触发时调用已经在m_pending中，调用结束时也能拿到定时器去取消
+        std::weak_ptr<RpcConnection> weak_self = weak_from_this();
+        call->timer = m_loop->runAfter(std::chrono::duration<double>(timeout).count(), [weak_self, call_id] {
+            if (auto self = weak_self.lock()) {
+                self->OnCallTimeout(call_id);
+            }
+        });
+    }
+    m_pending.emplace(call_id, call);
+}
+
+void RpcConnection::FlushOutbox()
+{
+    muduo::net::TcpConnectionPtr conn;
+    std::string outbox;
+    size_t outbox_calls = 0;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_outbox_calls == 0 || !m_conn) {
+            return;
+        }
+        conn = m_conn;
+        outbox.swap(m_outbox);
+        outbox_calls = m_outbox_calls;
+        m_outbox_calls = 0;
+    }
+    SendFrames(conn, std::move(outbox), outbox_calls);
+}
+
+bool RpcConnection::SendStreamFrame(tinyrpc::RpcHeader &header, const google::protobuf::Message *message)
+{
+    std::string frame;
+    NegotiateCompression(header);
+    bool serialized = message ? codec::AppendCompressedFrame(header, *message, &frame) : codec::AppendFrame(header, std::string(), &frame);
+    if (!serialized) {
+        LOG(ERROR) << "serialize rpc stream frame error!";
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_state == State::kConnecting) {
+        m_backlog.append(frame);
+        return true;
+    }
+    if (m_state == State::kClosed) {
+        return false;
+    }
+    AppendWriteLocked(frame);
+    return true;
+}
+
+void RpcConnection::AppendWriteLocked(const std::string &frame)
+{
+    // 在其他线程中直接调用TcpConnection::send，每个请求都要唤醒一次IO线程、单独write一次。
+    // 这里先把请求帧追加到写缓冲区，缓冲区从空变为非空时才投递一次写任务，
+    // IO线程处理到它时把期间到达的所有请求帧一次写出，并发调用多时省掉大部分唤醒和系统调用
+    bool schedule = m_write_buffer.empty();
+    m_write_buffer.append(frame);
+    if (schedule) {
+        std::weak_ptr<RpcConnection> weak_self = weak_from_this();
+        m_loop->queueInLoop([weak_self] {
+            if (auto self = weak_self.lock()) {
+                self->FlushWrites();
+            }
+        });
+    }
+}
+
+void RpcConnection::FlushWrites()
+{
+    muduo::net::TcpConnectionPtr conn;
+    std::string frames;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_write_buffer.empty() || !m_conn) {
+            return;
+        }
+        conn = m_conn;
+        frames.swap(m_write_buffer);
+    }
+    // 在IO线程中调用TcpConnection::send会直接写socket，
+    // 内核一次没有写完的部分会留在发送缓冲区中，等可写事件到来时继续写
+    conn->send(frames);
+}
+
+void RpcConnection::SendFrames(const muduo::net::TcpConnectionPtr &conn, std::string frames, size_t count)
+{
+    std::string batch = PackFrames(std::move(frames), count);
+    conn->send(batch);
+}
+
+std::string RpcConnection::PackFrames(std::string frames, size_t count)
+{
+    if (count == 1) {
+        // 只有一个请求时没有必要打包
+        return frames;
+    }
+    std::string batch;
+    tinyrpc::RpcHeader header;
+    if (count <= codec::kMaxBatchSize) {
+        header.set_batch_size(static_cast<uint32_t>(count));
+        header.set_args_size(static_cast<uint32_t>(frames.size()));
+        codec::AppendFrame(header, frames, &batch);
+        return batch;
+    }
+    // 服务端一个批量帧最多接受kMaxBatchSize个请求，超过时拆成多个批量帧
+    size_t offset = 0;
+    while (count > 0) {
+        uint32_t batch_size = static_cast<uint32_t>(std::min<size_t>(count, codec::kMaxBatchSize));
+        size_t end = offset;
+        codec::ForEachInBatch<tinyrpc::RpcHeader>(frames.data() + offset, frames.size() - offset, batch_size, [&](const tinyrpc::RpcHeader &, const char *args, size_t args_size) {
+            end = args + args_size - frames.data();
+            return true;
+        });
+        header.set_batch_size(batch_size);
+        header.set_args_size(static_cast<uint32_t>(end - offset));
+        codec::AppendFrame(header, frames.substr(offset, end - offset), &batch);
+        offset = end;
+        count -= batch_size;
+    }
+    return batch;
+}
+
+bool RpcConnection::Abandon(uint64_t call_id)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_pending.erase(call_id) == 0) {
+            return false;
+        }
+        if (m_pending.empty()) {
+            m_idle_since = std::chrono::steady_clock::now();
+        }
+    }
+    CloseIfDrained();
+    return true;
+}
+
+size_t RpcConnection::InFlight() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_pending.size();
+}
+
+std::optional<std::chrono::steady_clock::time_point> RpcConnection::IdleSince() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!m_pending.empty()) {
+        return std::nullopt;
+    }
+    return m_idle_since;
+}
+
+void RpcConnection::OnConnection(const muduo::net::TcpConnectionPtr &conn)
+{
+    if (conn->connected()) {
+        // RPC请求都是小包，关闭Nagle算法避免和对端的延迟确认叠加
+        if (m_client) {
+            conn->setTcpNoDelay(true);
+        }
+        std::string backlog;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_state == State::kClosed) {
+                // 已经超时或者被主动关闭了
+                conn->shutdown();
+                return;
+            }
+            m_conn = conn;
+            m_state = State::kConnected;
+            backlog.swap(m_backlog);
+        }
+        if (!backlog.empty()) {
+            conn->send(backlog);
+        }
+    } else {
+        LOG(WARNING) << "connection to " << m_endpoint.ToString() << " closed";
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_conn.reset();
+            m_state = State::kClosed;
+            m_outbox.clear();
+            m_outbox_calls = 0;
+            m_write_buffer.clear();
+        }
+        FailAll("connection closed");
+    }
+}
+
+void RpcConnection::OnCallTimeout(uint64_t call_id)
+{
+    CallPtr call;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_pending.find(call_id);
+        if (it == m_pending.end()) {
+            return;
+        }
+        call = std::move(it->second);
+        m_pending.erase(it);
+        if (m_pending.empty()) {
+            m_idle_since = std::chrono::steady_clock::now();
+        }
+    }
+    LOG(WARNING) << "rpc call " << call_id << " to " << m_endpoint.ToString() << " timeout";
+    Fail(call, "rpc call timeout");
+    CloseIfDrained();
+}
+
+void RpcConnection::OnMessage(const muduo::net::TcpConnectionPtr &conn, muduo::net::Buffer *buffer, muduo::Timestamp receive_time)
+{
+    // 一次可读事件中可能有多个响应，也可能只有半个响应
+    while (buffer->readableBytes() > 0) {
+        tinyrpc::RpcResponseHeader header;
+        size_t body_offset = 0;
+        size_t frame_size = 0;
+        auto status = codec::ParseFrame(buffer->peek(), buffer->readableBytes(), &header, &body_offset, &frame_size);
+        if (status == codec::DecodeStatus::kIncomplete) {
+            break;
+        }
+        if (status == codec::DecodeStatus::kError) {
+            // 字节流已经错位，这个连接不能再用了
+            LOG(ERROR) << "bad response frame from " << m_endpoint.ToString();
+            buffer->retrieveAll();
+            conn->forceClose();
+            return;
+        }
+        if (header.goaway()) {
+            OnGoAway();
+        } else if (header.batch_size() == 0) {
+            Complete(header, buffer->peek() + body_offset, header.body_size());
+        } else if (!codec::ForEachInBatch<tinyrpc::RpcResponseHeader>(buffer->peek() + body_offset, header.body_size(), header.batch_size(),
+                                                                      [this](const tinyrpc::RpcResponseHeader &sub, const char *body, size_t body_size) {
+                                                                          Complete(sub, body, body_size);
+                                                                          return true;
+                                                                      })) {
+            // 已经分发的子响应是完整的，格式错误的部分和之后的数据都不可信
+            LOG(ERROR) << "bad batch response frame from " << m_endpoint.ToString();
+            buffer->retrieveAll();
+            conn->forceClose();
+            return;
+        }
+        buffer->retrieve(frame_size);
+    }
+}
+
+void RpcConnection::Complete(const tinyrpc::RpcResponseHeader &header, const char *body, size_t body_size)
+{
+    CallPtr call;
+    if (header.stream_op() != tinyrpc::STREAM_NONE) {
+        // 流式调用中间的帧，调用还没有结束
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            auto it = m_pending.find(header.call_id());
+            if (it == m_pending.end()) {
+                return;
+            }
+            call = it->second;
+        }
+        if (call->on_stream) {
+            call->on_stream(header, body, body_size);
+        }
+        return;
+    }
+    if (header.accept_compression() != 0) {
+        m_peer_compression.store(header.accept_compression() | (1u << tinyrpc::COMPRESS_NONE), std::memory_order_relaxed);
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_pending.find(header.call_id());
+        if (it == m_pending.end()) {
+            // 调用已经被放弃了
+            return;
+        }
+        call = std::move(it->second);
+        m_pending.erase(it);
+        if (m_pending.empty()) {
+            m_idle_since = std::chrono::steady_clock::now();
+        }
+    }
+    m_loop->cancel(call->timer);
+    call->status = header.status();
+    if (header.status() != tinyrpc::RPC_OK) {
+        call->controller->SetFailed(header.error_text());
+    } else {
+        auto start = std::chrono::steady_clock::now();
+        bool parsed = codec::ParseBody(header, body, body_size, call->response);
+        if (call->metrics) {
+            call->metrics->parse_time.Record(std::chrono::steady_clock::now() - start);
+            call->metrics->bytes_in.Add(body_size);
+        }
+        if (!parsed) {
+            LOG(ERROR) << "parse response error";
+            call->controller->SetFailed("parse response error");
+        }
+    }
+    if (call->on_complete) {
+        call->on_complete();
+    }
+    CloseIfDrained();
+}
+
+void RpcConnection::OnGoAway()
+{
+    LOG(INFO) << m_endpoint.ToString() << " is draining, stop sending new calls on this connection";
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_goaway = true;
+        if (!m_pending.empty()) {
+            m_drain_self = shared_from_this();
+        }
+    }
+    CloseIfDrained();
+}
+
+void RpcConnection::CloseIfDrained()
+{
+    Ptr self;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_goaway || !m_pending.empty() || m_state == State::kClosed) {
+            return;
+        }
+        self.swap(m_drain_self);
+    }
+    Close();
+    if (self) {
+        // 可能正在TcpClient的回调中，不能在这里析构TcpClient，推迟到下一轮事件循环释放
+        m_loop->queueInLoop([self] {});
+    }
+}
+
+void RpcConnection::NegotiateCompression(tinyrpc::RpcHeader &header) const
+{
+    if (!(m_peer_compression.load(std::memory_order_relaxed) & (1u << header.compression()))) {
+        header.clear_compression();
+    }
+}
+
+void RpcConnection::FailAll(const std::string &reason)
+{
+    std::unordered_map<uint64_t, CallPtr> pending;
+    Ptr self; // 连接已经关闭，不再需要为在途调用保持存活
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        pending.swap(m_pending);
+        self.swap(m_drain_self);
+        m_idle_since = std::chrono::steady_clock::now();
+    }
+    if (self) {
+        // 可能正在TcpClient的回调中，不能在这里析构TcpClient，推迟到下一轮事件循环释放
+        m_loop->queueInLoop([self] {});
+    }
+    for (auto &[call_id, call] : pending) {
+        m_loop->cancel(call->timer);
+        Fail(call, reason);
+    }
+}
+
+void RpcConnection::Fail(const CallPtr &call, const std::string &reason)
+{
+    call->controller->SetFailed(reason);
+    if (call->on_complete) {
+        call->on_complete();
+    }
+}
@@ -0,0 +1,182 @@
+#pragma once
+
+#include "endpoint.h"
+#include "rpcmetrics.h"
+#include "tinyrpcheader.pb.h"
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <google/protobuf/service.h>
+#include <memory>
+#include <mutex>
+#include <muduo/net/EventLoop.h>
+#include <muduo/net/TcpClient.h>
+#include <muduo/net/TimerId.h>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace meha
+{
+
+/**
+ * @brief 客户端到一个RpcProvider的连接
+ * @details 基于muduo的TcpClient，运行在客户端的IO线程中。每个请求都带有连接内唯一的call_id，
+ * 响应按照call_id找到对应的在途调用，所以同一个连接上可以同时有多个调用，并且响应可以乱序到达。
+ * endpoint带有Unix域套接字路径时优先通过它连接，连不上时再使用TCP。
+ */
+class RpcConnection : public std::enable_shared_from_this<RpcConnection>
+{
+public:
+    using Ptr = std::shared_ptr<RpcConnection>;
+
+    /// @brief 一次在途的RPC调用
+    struct Call
+    {
+        google::protobuf::RpcController *controller = nullptr; // 调用失败时在上面SetFailed
+        google::protobuf::Message *response = nullptr; // 调用成功时把响应反序列化到这里
+        std::function<void()> on_complete; // 调用结束（成功或失败）后在IO线程中执行，只执行一次
+        muduo::net::TimerId timer; // 调用的超时定时器，调用先结束时取消
+        MethodMetrics *metrics = nullptr; // 不为空时记录序列化、反序列化的耗时和字节数
+        // 收到响应时为响应中的状态，没有收到响应（连接失败、连接断开、超时）时为空，用于判断能否重试
+        std::optional<tinyrpc::RpcStatus> status;
+        // 流式调用中收到的消息和额度帧，在IO线程中执行，调用仍然在途，最后的普通响应帧才结束调用
+        std::function<void(const tinyrpc::RpcResponseHeader &, const char *, size_t)> on_stream;
+    };
+    using CallPtr = std::shared_ptr<Call>;
+
+    /// @brief 批量发送中的一个请求
+    struct Request
+    {
+        CallPtr call;
+        tinyrpc::RpcHeader header; // args_size需要已经通过request->ByteSizeLong()设置好
+        const google::protobuf::Message *request = nullptr;
+        std::chrono::milliseconds timeout{0};
+    };
+
+    /// @brief 自动批量发送的配置
+    struct BatchOptions
+    {
+        // 发送请求后最多等待这么久，把期间发送的请求打包成一个批量帧，为0时不等待，每个请求单独发送
+        std::chrono::microseconds window{0};
+        size_t max_calls = 64; // 等待中的请求达到这个数量时立即发送
+    };
+
+    RpcConnection(muduo::net::EventLoop *loop, const Endpoint &endpoint, const BatchOptions &batch);
+    ~RpcConnection();
+
+    // 客户端的第一个IO线程的EventLoop，用于不属于某个连接的定时器
+    static muduo::net::EventLoop *DefaultLoop();
+    /**
+     * @brief 为新建的连接选择一个客户端IO线程
+     * IO线程数由配置项rpcclient_io_threads决定（默认1），连接按轮询分配到各个线程，
+     * 扇出很大的调用方可以增加线程数，把收发和异步调用的done分摊到多个核上
+     */
+    static muduo::net::EventLoop *NextLoop();
+
+    /**
+     * @brief 异步发起连接，不等待连接建立
+     * 连接建立之前发送的请求会先缓存起来，连接建立后再发出；超过timeout还没有连上时，连接关闭，缓存的调用都以失败结束
+     */
+    void Connect(std::chrono::milliseconds timeout);
+    // 主动关闭连接，所有在途调用都以失败结束
+    void Close();
+
+    /**
+     * @brief 发送一个请求
+     * 为调用分配call_id并填入header，调用的结果通过call->on_complete通知，这个函数本身不会阻塞。
+     * 连接已经断开时调用会立即以失败结束。
+     * @param header args_size需要已经通过request.ByteSizeLong()设置好
+     * @param timeout 大于0时，超过timeout还没有收到响应的调用以超时失败结束，之后到达的响应会被丢弃
+     * @return uint64_t 分配的call_id
+     */
+    uint64_t Send(const CallPtr &call, tinyrpc::RpcHeader &header, const google::protobuf::Message &request,
+                  std::chrono::milliseconds timeout = std::chrono::milliseconds::zero());
+    /**
+     * @brief 把多个请求打包成一个批量帧发送，服务端在所有请求都处理完之后一起返回响应
+     * 每个请求都分配call_id、有各自的超时，和分别调用Send的效果相同，只是只需要一帧和一次系统调用
+     */
+    void SendBatch(std::vector<Request> &requests);
+    /**
+     * @brief 在已经开始的流式调用上发送一帧，不分配新的call_id，见ClientStream
+     * @param header call_id和stream_op需要已经设置好，带有message时args_size也需要已经设置好
+     * @return false 连接已经断开
+     */
+    bool SendStreamFrame(tinyrpc::RpcHeader &header, const google::protobuf::Message *message);
+    /**
+     * @brief 放弃一个在途调用，之后到达的响应会被丢弃
+     * @return false 调用已经结束或者正在结束，on_complete一定会被执行
+     */
+    bool Abandon(uint64_t call_id);
+
+    // 连接正在建立或者已经建立，并且服务端没有要求停止使用（goaway），可以继续发送请求
+    bool Usable() const { return m_state != State::kClosed && !m_goaway; }
+    size_t InFlight() const;
+    // 连接上没有在途调用时，返回最后一个调用结束的时间
+    std::optional<std::chrono::steady_clock::time_point> IdleSince() const;
+    const Endpoint &endpoint() const { return m_endpoint; }
+
+private:
+    enum class State {
+        kConnecting,
+        kConnected,
+        kClosed,
+    };
+
+    void OnConnection(const muduo::net::TcpConnectionPtr &conn);
+    void OnConnectTimeout();
+    void OnMessage(const muduo::net::TcpConnectionPtr &conn, muduo::net::Buffer *buffer, muduo::Timestamp receive_time);
+    // 调用超时，在IO线程中执行
+    void OnCallTimeout(uint64_t call_id);
+    // 在m_mutex内登记在途调用，并设置它的超时定时器
+    void AddPendingLocked(uint64_t call_id, const CallPtr &call, std::chrono::milliseconds timeout);
+    // 把积攒的请求帧发送出去，自动批量发送的窗口到期时在IO线程中执行
+    void FlushOutbox();
+    // 在m_mutex内把请求帧追加到写缓冲区，需要时投递一次FlushWrites
+    void AppendWriteLocked(const std::string &frame);
+    // 把写缓冲区中的请求帧一次写出去，在IO线程中执行
+    void FlushWrites();
+    // 发送count个首尾相连的请求帧，多于一个时打包成批量帧
+    static void SendFrames(const muduo::net::TcpConnectionPtr &conn, std::string frames, size_t count);
+    // 把count个首尾相连的请求帧打包成批量帧，超过kMaxBatchSize时拆成多个，只有一个时原样返回
+    static std::string PackFrames(std::string frames, size_t count);
+    // 收到call_id对应的响应，body为响应体。流式调用中间的帧交给调用的on_stream
+    void Complete(const tinyrpc::RpcResponseHeader &header, const char *body, size_t body_size);
+    /**
+     * @brief 服务端正在停止，不再在这个连接上发起新的调用，在IO线程中执行
+     * 连接池随后会丢弃这个连接，连接在已经发出的调用都结束后关闭
+     */
+    void OnGoAway();
+    // 收到goaway之后在途调用都已经结束时关闭连接
+    void CloseIfDrained();
+    // 服务端不能解压header中的算法时改为不压缩
+    void NegotiateCompression(tinyrpc::RpcHeader &header) const;
+    // 以失败结束所有在途调用
+    void FailAll(const std::string &reason);
+    static void Fail(const CallPtr &call, const std::string &reason);
+
+    muduo::net::EventLoop *m_loop;
+    Endpoint m_endpoint;
+    std::unique_ptr<muduo::net::TcpClient> m_client; // 通过TCP连接时使用
+    muduo::net::TcpConnectionPtr m_unix_conn; // 通过Unix域套接字连接时使用
+
+    mutable std::mutex m_mutex; // 保护下面的成员
+    std::atomic<State> m_state;
+    std::atomic<bool> m_goaway = false;
+    // 服务端能解压的算法的位掩码，从响应中得知，收到第一个响应之前请求都不压缩，兼容不支持压缩的旧版本服务端
+    std::atomic<uint32_t> m_peer_compression = 1u << tinyrpc::COMPRESS_NONE;
+    Ptr m_drain_self; // 收到goaway时还有在途调用，连接池丢弃连接之后由自己保持存活，直到调用都结束
+    muduo::net::TcpConnectionPtr m_conn;
+    std::unordered_map<uint64_t, CallPtr> m_pending; // 在途调用
+    std::string m_backlog; // 连接建立之前缓存的请求帧
+    BatchOptions m_batch;
+    std::string m_outbox; // 自动批量发送时，窗口内积攒的请求帧
+    size_t m_outbox_calls = 0;
+    muduo::net::TimerId m_outbox_timer;
+    std::string m_write_buffer; // 等待IO线程写出的请求帧，不等待窗口，只合并同一轮事件循环之前到达的请求
+    std::chrono::steady_clock::time_point m_idle_since;
+    uint64_t m_next_call_id;
+};
+
+}
@@ -5,8 +5,9 @@ using namespace meha;
 RpcController::RpcController()
     : m_failed(false)
     , m_canceled(false)
-    , m_errText("RPC error occurred: ")
+    , m_errText()
     , m_callback(nullptr)
+    , m_stream(nullptr)
 {
 }
 
@@ -15,6 +16,8 @@ void RpcController::Reset()
     m_failed = false;
     m_canceled = false;
     m_errText.clear();
+    m_request_key.reset();
+    m_deadline.reset();
 }
 
 bool RpcController::Failed() const
@@ -1,11 +1,16 @@
 #pragma once
 
+#include <chrono>
+#include <cstdint>
 #include <google/protobuf/service.h>
+#include <optional>
 #include <string>
 
 namespace meha
 {
 
+class ServerStream;
+
 /**
  * @brief 用于描述RPC调用的控制器
  * 主要作用是跟踪RPC方法调用的状态、错误信息并提供控制功能(如取消调用)
@@ -23,11 +28,36 @@ public:
     bool IsCanceled() const override;
     void NotifyOnCancel(google::protobuf::Closure *callback) override;
 
+    /**
+     * @brief 设置请求的路由键，客户端使用一致性哈希负载均衡时，路由键相同的请求总是发往同一个服务实例
+     * 例如按用户id设置，可以让同一个用户的请求命中同一个实例上的缓存
+     */
+    void SetRequestKey(uint64_t key) { m_request_key = key; }
+    std::optional<uint64_t> RequestKey() const { return m_request_key; }
+
+    /**
+     * @brief 设置调用的截止时间，到截止时间还没有收到响应时，调用以失败结束
+     * 截止时间会随请求传给服务端，服务端在执行服务方法之前发现已经超时的请求会直接丢弃。
+     * 服务端传给服务方法的controller上也带有请求的截止时间，服务方法中再调用其他服务时可以沿用
+     */
+    void SetDeadline(std::chrono::steady_clock::time_point deadline) { m_deadline = deadline; }
+    void SetTimeout(std::chrono::milliseconds timeout) { m_deadline = std::chrono::steady_clock::now() + timeout; }
+    std::optional<std::chrono::steady_clock::time_point> Deadline() const { return m_deadline; }
+
+    /**
+     * @brief 服务端执行流式方法时调用的消息流，其他时候为nullptr。服务方法中通过ServerStream::From获取
+     */
+    ServerStream *Stream() const { return m_stream; }
+    void SetStream(ServerStream *stream) { m_stream = stream; }
+
 private:
     bool m_failed; // RPC方法执行过程中的状态
     bool m_canceled;
     std::string m_errText; // RPC方法执行过程中的错误信息
     google::protobuf::Closure *m_callback;
+    std::optional<uint64_t> m_request_key;
+    std::optional<std::chrono::steady_clock::time_point> m_deadline;
+    ServerStream *m_stream;
 };
 
 }
\ No newline at end of file
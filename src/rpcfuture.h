@@ -0,0 +1,106 @@
+#pragma once
+
+#include "rpcclosure.h"
+#include "rpccontroller.h"
+#include <atomic>
+#include <coroutine>
+#include <future>
+#include <memory>
+#include <string>
+
+namespace meha
+{
+
+/// @brief 异步调用的结果
+template <typename Response>
+struct RpcResult
+{
+    bool ok = false;
+    std::string error_text;
+    Response response;
+};
+
+/// @brief protobuf生成的Stub上的RPC方法，例如&example::UserService_Stub::Login
+template <typename Stub, typename Request, typename Response>
+using StubMethod = void (Stub::*)(google::protobuf::RpcController *, const Request *, Response *, google::protobuf::Closure *);
+
+/**
+ * @brief 通过Stub发起异步调用，返回std::future
+ * 请求发出后立即返回，可以同时发起很多个调用而不需要为每个调用占用一个线程
+ * @code
+ *   auto future = meha::CallAsync(stub, &example::UserService_Stub::IsUserOnline, request);
+ *   meha::RpcResult<example::IsUserOnlineResponse> result = future.get();
+ * @endcode
+ */
+template <typename Stub, typename Request, typename Response>
+std::future<RpcResult<Response>> CallAsync(Stub &stub, StubMethod<Stub, Request, Response> method, const Request &request)
+{
+    struct State
+    {
+        RpcController controller;
+        RpcResult<Response> result;
+        std::promise<RpcResult<Response>> promise;
+    };
+    auto state = std::make_shared<State>();
+    auto future = state->promise.get_future();
+    (stub.*method)(&state->controller, &request, &state->result.response, NewClosure([state] {
+        state->result.ok = !state->controller.Failed();
+        state->result.error_text = state->controller.ErrorText();
+        state->promise.set_value(std::move(state->result));
+    }));
+    return future;
+}
+
+/**
+ * @brief 可以co_await的RPC调用，调用结束后在客户端IO线程中恢复协程
+ * @code
+ *   meha::RpcResult<example::EchoResponse> result = co_await meha::CoCall(stub, &example::EchoService_Stub::Echo, request);
+ * @endcode
+ */
+template <typename Stub, typename Request, typename Response>
+class RpcAwaitable
+{
+public:
+    RpcAwaitable(Stub &stub, StubMethod<Stub, Request, Response> method, const Request &request)
+        : m_stub(stub)
+        , m_method(method)
+        , m_request(request)
+    {
+    }
+
+    bool await_ready() const noexcept { return false; }
+
+    bool await_suspend(std::coroutine_handle<> handle)
+    {
+        m_handle = handle;
+        (m_stub.*m_method)(&m_controller, &m_request, &m_result.response, NewClosure([this] {
+            m_result.ok = !m_controller.Failed();
+            m_result.error_text = m_controller.ErrorText();
+            // 协程已经挂起了才能恢复，否则由await_suspend返回false直接继续执行
+            if (m_completed.exchange(true, std::memory_order_acq_rel)) {
+                m_handle.resume();
+            }
+        }));
+        // done可能已经在当前线程中执行完了（例如服务发现失败），这时不需要挂起
+        return !m_completed.exchange(true, std::memory_order_acq_rel);
+    }
+
+    RpcResult<Response> await_resume() { return std::move(m_result); }
+
+private:
+    Stub &m_stub;
+    StubMethod<Stub, Request, Response> m_method;
+    const Request &m_request;
+    RpcController m_controller;
+    RpcResult<Response> m_result;
+    std::coroutine_handle<> m_handle;
+    std::atomic<bool> m_completed = false;
+};
+
+template <typename Stub, typename Request, typename Response>
+RpcAwaitable<Stub, Request, Response> CoCall(Stub &stub, StubMethod<Stub, Request, Response> method, const Request &request)
+{
+    return RpcAwaitable<Stub, Request, Response>(stub, method, request);
+}
+
+}
@@ -0,0 +1,218 @@
+#include "rpcmetrics.h"
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstdio>
+#include <string_view>
+#include <unordered_map>
+
+using namespace meha;
+
+size_t meha::MetricShard()
+{
+    static std::atomic<size_t> next_shard = 0;
+    thread_local size_t shard = next_shard.fetch_add(1, std::memory_order_relaxed);
+    return shard;
+}
+
+uint64_t Counter::Value() const
+{
+    uint64_t value = 0;
+    for (auto &shard : m_shards) {
+        value += shard.value.load(std::memory_order_relaxed);
+    }
+    return value;
+}
+
+size_t Histogram::BucketIndex(uint64_t value)
+{
+    constexpr uint64_t kSubBuckets = 1ull << kSubBucketBits;
+    if (value < kSubBuckets) {
+        return value;
+    }
+    int exponent = std::bit_width(value) - 1;
+    if (exponent >= kMaxBits) {
+        return kBuckets - 1;
+    }
+    int shift = exponent - kSubBucketBits;
+    return ((shift + 1) << kSubBucketBits) + ((value >> shift) - kSubBuckets);
+}
+
+uint64_t Histogram::BucketUpperBound(size_t index)
+{
+    constexpr uint64_t kSubBuckets = 1ull << kSubBucketBits;
+    if (index < kSubBuckets) {
+        return index;
+    }
+    int shift = static_cast<int>(index >> kSubBucketBits) - 1;
+    uint64_t sub = index & (kSubBuckets - 1);
+    return ((kSubBuckets + sub + 1) << shift) - 1;
+}
+
+void Histogram::Record(uint64_t value)
+{
+    Shard &shard = m_shards[MetricShard() % kShards];
+    shard.buckets[BucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+    shard.count.fetch_add(1, std::memory_order_relaxed);
+    shard.sum.fetch_add(value, std::memory_order_relaxed);
+    uint64_t max = shard.max.load(std::memory_order_relaxed);
+    while (value > max && !shard.max.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+    }
+}
+
+HistogramSnapshot Histogram::Snapshot() const
+{
+    HistogramSnapshot snapshot;
+    snapshot.buckets.assign(kBuckets, 0);
+    for (auto &shard : m_shards) {
+        snapshot.count += shard.count.load(std::memory_order_relaxed);
+        snapshot.sum += shard.sum.load(std::memory_order_relaxed);
+        snapshot.max = std::max(snapshot.max, shard.max.load(std::memory_order_relaxed));
+        for (size_t i = 0; i < kBuckets; ++i) {
+            snapshot.buckets[i] += shard.buckets[i].load(std::memory_order_relaxed);
+        }
+    }
+    return snapshot;
+}
+
+uint64_t HistogramSnapshot::Percentile(double p) const
+{
+    // 各个计数是分别读取的，桶计数之和可能和count略有出入，以桶计数为准
+    uint64_t total = 0;
+    for (uint64_t n : buckets) {
+        total += n;
+    }
+    if (total == 0) {
+        return 0;
+    }
+    uint64_t target = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(p * total)));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < buckets.size(); ++i) {
+        seen += buckets[i];
+        if (seen >= target) {
+            return std::min(Histogram::BucketUpperBound(i), max);
+        }
+    }
+    return max;
+}
+
+Metrics &Metrics::Instance()
+{
+    static Metrics metrics;
+    return metrics;
+}
+
+MethodMetrics *Metrics::Get(Side side, const google::protobuf::MethodDescriptor *method)
+{
+    // 方法描述符的地址在进程内不会变化，每个线程缓存查询结果，之后不需要再加锁
+    thread_local std::unordered_map<const google::protobuf::MethodDescriptor *, MethodMetrics *> cache[2];
+    auto &local = cache[side == Side::kServer];
+    auto it = local.find(method);
+    if (it != local.end()) {
+        return it->second;
+    }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto &metrics = m_methods[{side, method->full_name()}];
+    if (!metrics) {
+        metrics = std::make_unique<MethodMetrics>();
+    }
+    local.emplace(method, metrics.get());
+    return metrics.get();
+}
+
+std::vector<Metrics::MethodSnapshot> Metrics::Snapshot() const
+{
+    std::vector<MethodSnapshot> snapshots;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    snapshots.reserve(m_methods.size());
+    for (auto &[key, metrics] : m_methods) {
+        snapshots.push_back(MethodSnapshot{
+            key.first,
+            key.second,
+            metrics->requests.Value(),
+            metrics->errors.Value(),
+            metrics->rejected.Value(),
+            metrics->bytes_in.Value(),
+            metrics->bytes_out.Value(),
+            metrics->latency.Snapshot(),
+            metrics->queue_time.Snapshot(),
+            metrics->handler_time.Snapshot(),
+            metrics->serialize_time.Snapshot(),
+            metrics->parse_time.Snapshot(),
+        });
+    }
+    return snapshots;
+}
+
+std::string Metrics::PrometheusText() const
+{
+    auto snapshots = Snapshot();
+    auto labels = [](const MethodSnapshot &s) {
+        return std::string("side=\"") + (s.side == Side::kServer ? "server" : "client") + "\",method=\"" + s.method + "\"";
+    };
+    std::string text;
+    auto counter = [&](const char *name, uint64_t MethodSnapshot::*field) {
+        text += std::string("# TYPE tinyrpc_") + name + " counter\n";
+        for (auto &s : snapshots) {
+            text += std::string("tinyrpc_") + name + "{" + labels(s) + "} " + std::to_string(s.*field) + "\n";
+        }
+    };
+    auto summary = [&](const char *name, HistogramSnapshot MethodSnapshot::*field) {
+        std::string metric = std::string("tinyrpc_") + name + "_microseconds";
+        text += "# TYPE " + metric + " summary\n";
+        for (auto &s : snapshots) {
+            const HistogramSnapshot &h = s.*field;
+            if (h.count == 0) {
+                continue;
+            }
+            for (double q : {0.5, 0.9, 0.99, 0.999}) {
+                char quantile[16];
+                snprintf(quantile, sizeof(quantile), "%g", q);
+                text += metric + "{" + labels(s) + ",quantile=\"" + quantile + "\"} " + std::to_string(h.Percentile(q)) + "\n";
+            }
+            text += metric + "_sum{" + labels(s) + "} " + std::to_string(h.sum) + "\n";
+            text += metric + "_count{" + labels(s) + "} " + std::to_string(h.count) + "\n";
+        }
+    };
+    counter("requests_total", &MethodSnapshot::requests);
+    counter("errors_total", &MethodSnapshot::errors);
+    counter("rejected_total", &MethodSnapshot::rejected);
+    counter("bytes_in_total", &MethodSnapshot::bytes_in);
+    counter("bytes_out_total", &MethodSnapshot::bytes_out);
+    summary("latency", &MethodSnapshot::latency);
+    summary("queue_time", &MethodSnapshot::queue_time);
+    summary("handler_time", &MethodSnapshot::handler_time);
+    summary("serialize_time", &MethodSnapshot::serialize_time);
+    summary("parse_time", &MethodSnapshot::parse_time);
+    return text;
+}
+
+MetricsServer::MetricsServer(muduo::net::EventLoop *loop, const muduo::net::InetAddress &address)
+    : m_server(loop, address, "RpcMetrics")
+{
+    m_server.setMessageCallback(std::bind(&MetricsServer::OnMessage, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3));
+}
+
+void MetricsServer::Start()
+{
+    m_server.start();
+}
+
+void MetricsServer::OnMessage(const muduo::net::TcpConnectionPtr &conn, muduo::net::Buffer *buffer, muduo::Timestamp receive_time)
+{
+    // 只需要等请求头收完整，不关心请求的内容
+    std::string_view request(buffer->peek(), buffer->readableBytes());
+    if (request.find("\r\n\r\n") == std::string_view::npos) {
+        if (buffer->readableBytes() > 8192) {
+            conn->forceClose();
+        }
+        return;
+    }
+    buffer->retrieveAll();
+    std::string body = Metrics::Instance().PrometheusText();
+    conn->send("HTTP/1.1 200 OK\r\n"
+               "Content-Type: text/plain; version=0.0.4\r\n"
+               "Content-Length: " + std::to_string(body.size()) + "\r\n"
+               "Connection: close\r\n\r\n" + body);
+    conn->shutdown();
+}
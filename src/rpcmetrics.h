@@ -0,0 +1,169 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <google/protobuf/descriptor.h>
+#include <map>
+#include <memory>
+#include <muduo/net/EventLoop.h>
+#include <muduo/net/InetAddress.h>
+#include <muduo/net/TcpServer.h>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace meha
+{
+
+// 当前线程写入的分片下标。每个线程固定写一个分片，分片之间按缓存行对齐，多个线程同时计数时不会争抢同一个缓存行
+size_t MetricShard();
+
+/**
+ * @brief 按线程分片的计数器，写入只是一次relaxed的原子加，读取时把所有分片加起来
+ */
+class Counter
+{
+public:
+    void Add(uint64_t n = 1) { m_shards[MetricShard() % kShards].value.fetch_add(n, std::memory_order_relaxed); }
+    uint64_t Value() const;
+
+private:
+    static constexpr size_t kShards = 16;
+    struct alignas(64) Shard
+    {
+        std::atomic<uint64_t> value = 0;
+    };
+    std::array<Shard, kShards> m_shards;
+};
+
+/// @brief 直方图某一时刻的快照
+struct HistogramSnapshot
+{
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    uint64_t max = 0;
+    std::vector<uint64_t> buckets;
+
+    // 第p(0~1)分位数所在桶的上界
+    uint64_t Percentile(double p) const;
+};
+
+/**
+ * @brief 按线程分片的延迟直方图，单位是微秒
+ * @details 和HdrHistogram一样使用对数-线性分桶：每个2的幂区间再线性地分成16个桶，
+ * 任何取值的相对误差都不超过1/16，用几百个桶就能覆盖1微秒到数小时，记录一次只需要几次位运算和原子加
+ */
+class Histogram
+{
+public:
+    static constexpr int kSubBucketBits = 4;
+    static constexpr int kMaxBits = 36; // 超过2^36微秒的值记到最后一个桶
+    static constexpr size_t kBuckets = (kMaxBits - kSubBucketBits + 1) << kSubBucketBits;
+
+    void Record(uint64_t value);
+    void Record(std::chrono::steady_clock::duration duration)
+    {
+        Record(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(duration).count()));
+    }
+    HistogramSnapshot Snapshot() const;
+
+    static size_t BucketIndex(uint64_t value);
+    // 桶中取值的上界
+    static uint64_t BucketUpperBound(size_t index);
+
+private:
+    static constexpr size_t kShards = 4;
+    struct alignas(64) Shard
+    {
+        std::atomic<uint64_t> count = 0;
+        std::atomic<uint64_t> sum = 0;
+        std::atomic<uint64_t> max = 0;
+        std::array<std::atomic<uint64_t>, kBuckets> buckets{};
+    };
+    std::array<Shard, kShards> m_shards;
+};
+
+/// @brief 一个服务方法在客户端或者服务端的指标
+struct MethodMetrics
+{
+    Counter requests; // 结束的调用数
+    Counter errors; // 失败的调用数
+    Counter rejected; // 服务端因为过载直接拒绝的调用数，也计入errors
+    Counter bytes_in; // 收到的请求体（服务端）或响应体（客户端）字节数
+    Counter bytes_out; // 发出的响应体（服务端）或请求体（客户端）字节数
+    Histogram latency; // 服务端从收到请求到发出响应，客户端从发起调用到调用结束
+    Histogram queue_time; // 服务端请求在业务线程池中排队的时间
+    Histogram handler_time; // 服务端服务方法的执行时间
+    Histogram serialize_time; // 序列化响应（服务端）或请求（客户端）的时间
+    Histogram parse_time; // 反序列化请求（服务端）或响应（客户端）的时间
+};
+
+/**
+ * @brief 进程级的RPC指标
+ * @details RpcChannel和RpcProvider为每个服务方法各记录一份MethodMetrics，MethodMetrics创建之后不会释放，
+ * 调用方可以长期持有它的指针，记录时不需要再查表。
+ */
+class Metrics
+{
+public:
+    enum class Side {
+        kClient,
+        kServer,
+    };
+
+    /// @brief 一个服务方法的指标快照
+    struct MethodSnapshot
+    {
+        Side side;
+        std::string method; // 方法全名
+        uint64_t requests;
+        uint64_t errors;
+        uint64_t rejected;
+        uint64_t bytes_in;
+        uint64_t bytes_out;
+        HistogramSnapshot latency;
+        HistogramSnapshot queue_time;
+        HistogramSnapshot handler_time;
+        HistogramSnapshot serialize_time;
+        HistogramSnapshot parse_time;
+    };
+
+    static Metrics &Instance();
+
+    // 获取方法的指标，线程安全
+    MethodMetrics *Get(Side side, const google::protobuf::MethodDescriptor *method);
+    // 所有方法的指标快照
+    std::vector<MethodSnapshot> Snapshot() const;
+    // Prometheus文本格式的指标
+    std::string PrometheusText() const;
+
+private:
+    Metrics() = default;
+    Metrics(const Metrics &) = delete;
+    Metrics &operator=(const Metrics &) = delete;
+
+    mutable std::mutex m_mutex;
+    std::map<std::pair<Side, std::string>, std::unique_ptr<MethodMetrics>> m_methods;
+};
+
+/**
+ * @brief 以HTTP方式输出Prometheus文本格式指标的最小服务器
+ * 运行在RpcProvider的EventLoop中，不管请求的路径是什么都返回全部指标，输出后关闭连接
+ */
+class MetricsServer
+{
+public:
+    MetricsServer(muduo::net::EventLoop *loop, const muduo::net::InetAddress &address);
+    void Start();
+
+private:
+    void OnMessage(const muduo::net::TcpConnectionPtr &conn, muduo::net::Buffer *buffer, muduo::Timestamp receive_time);
+
+    muduo::net::TcpServer m_server;
+};
+
+}
@@ -1,19 +1,30 @@
 #include "rpcprovider.h"
 #include "common.h"
+#include "rpccodec.h"
+#include "rpccompress.h"
 #include "rpcconfig.h"
+#include "rpctrace.h"
 #include "tinyrpcheader.pb.h"
-#include "zookeeperutil.h"
+#include "tinyrpcoptions.pb.h"
+#include "unixsocket.h"
 #include <glog/logging.h>
+#include <thread>
 
 using namespace meha;
 
 RpcProvider::RpcProvider(const std::string &package)
+    : m_dispatch_table(std::make_shared<const DispatchTable>())
+    , m_worker_pool("RpcWorker")
+    , m_worker_threads(0)
+    , m_stream_pool("RpcStream")
+    , m_stream_threads(0)
+    , m_limiter(ConcurrencyLimiter::Create(RpcConfig::Instance().Lookup("rpcserver_limit").value_or("none")))
+    , m_max_connections(RpcConfig::Instance().LookupCount("rpcserver_max_connections", 0, 0))
+    , m_registry(ServiceRegistry::Create())
 {
-    ZkClient zkclient;
-    zkclient.Start();
-    std::string toplevel = "/" + package;
-    zkclient.CreateNode(toplevel.c_str(), "", ZkClient::CreateMode::Persistent);
-    LOG(INFO) << "zk create " << toplevel << " as toplevel node";
+    // 服务节点的路径由注册中心决定，package不再使用，保留参数是为了兼容已有的调用方
+    UNUSED(package);
+    RpcTrace::Configure();
 }
 
 void RpcProvider::RegisterService(std::unique_ptr<google::protobuf::Service> service)
@@ -37,21 +48,53 @@ void RpcProvider::RegisterService(std::unique_ptr<google::protobuf::Service> ser
         const google::protobuf::MethodDescriptor *pmd = psd->method(i);
         std::string method_name = pmd->name();
         LOG(INFO) << "method_name=" << method_name;
-        service_info.method_map.emplace(method_name, pmd);
+        // 方法级别的配置优先于服务级别的配置
+        auto dispatch = RpcConfig::Instance().Lookup("rpcserver_dispatch." + service_name + "." + method_name);
+        if (!dispatch) {
+            dispatch = RpcConfig::Instance().Lookup("rpcserver_dispatch." + service_name);
+        }
+        auto limit = RpcConfig::Instance().Lookup("rpcserver_limit." + service_name + "." + method_name);
+        if (!limit) {
+            limit = RpcConfig::Instance().Lookup("rpcserver_limit." + service_name);
+        }
+        bool streaming = pmd->options().GetExtension(tinyrpc::server_streaming) || pmd->options().GetExtension(tinyrpc::client_streaming);
+        service_info.method_map.emplace(method_name, MethodInfo{pmd, dispatch.value_or("worker") == "io", Metrics::Instance().Get(Metrics::Side::kServer, pmd),
+                                                                Compressor::ForMethod(pmd), ConcurrencyLimiter::Create(limit.value_or("none")), streaming});
     }
     service_info.service = std::move(service);
-    m_rwlock.WriteLock();
-    m_service_map.emplace(service_name, std::move(service_info));
-    m_rwlock.Unlock();
+    auto info = std::make_shared<const ServiceInfo>(std::move(service_info));
+
+    // 复制当前的分发表，加入新服务之后整体替换，正在处理的请求仍然使用旧表
+    std::lock_guard<std::mutex> lock(m_registry_mutex);
+    auto table = std::make_shared<DispatchTable>(*m_dispatch_table.Load());
+    for (auto &[method_name, method_info] : info->method_map) {
+        uint32_t method_id = codec::MethodId(method_info.descriptor);
+        auto it = table->methods.find(method_id);
+        if (it != table->methods.end() && it->second.method->descriptor != method_info.descriptor) {
+            // 编号冲突时按编号分发可能调用到错误的方法，宁可不发布这个服务
+            LOG(ERROR) << method_info.descriptor->full_name() << " has the same method id as "
+                       << it->second.method->descriptor->full_name() << ", service " << service_name << " not registered";
+            return;
+        }
+        table->methods[method_id] = MethodEntry{info, &method_info};
+    }
+    table->services[service_name] = info;
+    m_dispatch_table.Store(std::move(table));
 }
 
 void RpcProvider::UnregisterService(const std::string &service_name)
 {
     // RpcProvider维护的是本进程的服务注册表，所以直接删掉本进程所注册的服务表项就可以
-    m_rwlock.WriteLock();
-    m_service_map.erase(service_name);
+    std::lock_guard<std::mutex> lock(m_registry_mutex);
+    auto table = std::make_shared<DispatchTable>(*m_dispatch_table.Load());
+    auto it = table->services.find(service_name);
+    if (it == table->services.end()) {
+        return;
+    }
+    std::erase_if(table->methods, [&](const auto &entry) { return entry.second.service == it->second; });
+    table->services.erase(it);
+    m_dispatch_table.Store(std::move(table));
     LOG(WARNING) << "service_name=" << service_name << " unregistered";
-    m_rwlock.Unlock();
     // 不用到zookeeper上删除节点，因为创建的是临时节点，本进程服务下线时会断开连接，从而自动删除
 }
 
@@ -64,164 +107,643 @@ void RpcProvider::Run()
     // 使用muduo网络库，创建address对象
     muduo::net::InetAddress address(ip, std::atoi(port.c_str()));
 
-    // 创建tcpserver对象
-    muduo::net::TcpServer server(&m_event_loop, address, "KrpcProvider");
+    // 创建tcpserver对象。开启SO_REUSEPORT时新旧进程可以同时监听同一个端口，用于不停机重启（见Drain）
+    bool reuse_port = RpcConfig::Instance().Lookup("rpcserver_reuse_port").value_or("false") == "true";
+    muduo::net::TcpServer server(&m_event_loop, address, "KrpcProvider",
+                                 reuse_port ? muduo::net::TcpServer::kReusePort : muduo::net::TcpServer::kNoReusePort);
 
     // 绑定连接回调和消息回调，分离了网络连接业务和消息处理业务
     server.setConnectionCallback(std::bind(&RpcProvider::onConnection, this, std::placeholders::_1));
     server.setMessageCallback(std::bind(&RpcProvider::onMessage, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3));
 
-    // 设置muduo库的线程数量（这里是1个IO线程处理链接，3个工作线程处理业务）
-    server.setThreadNum(4);
-
-    // 把当前rpc节点上要发布的服务全部注册到zk上面，让rpc client可以在zk上发现服务
-    // NOTE 这里没有区分注册多个相同服务的情况（比如同一个服务部署在多台机器上，这种情况可能是要修改zk的节点名）
-    ZkClient zkclient;
-    zkclient.Start();
-    m_rwlock.ReadLock();
-    // service_name为永久节点(因为可能很多个该服务的实例），method_name为临时节点(因为每个method节点对应一个该服务的实例)
-    for (auto &sp : m_service_map) {
-        // service_name 在zk中的目录下是"/meha/service_name"
-        std::string service_path = "/meha/" + sp.first;
-        zkclient.CreateNode(service_path, "", ZkClient::CreateMode::Persistent);
-        for (auto &mp : sp.second.method_map) {
-            std::string method_path = service_path + "/" + mp.first;
-            std::string method_path_data = ip + ":" + port;
-            zkclient.CreateNode(method_path, method_path_data, ZkClient::CreateMode::Ephemeral
-                                , std::bind(&RpcProvider::UnregisterService, this, std::placeholders::_1));
-        }
-    }
-    m_rwlock.Unlock();
-    // rpc服务端准备启动，打印信息
-    LOG(INFO) << "RpcProvider start service at ip:" << ip << " port:" << port;
-    // 启动网络服务
+    // 设置muduo库的IO线程数量（除了负责接受连接的主线程之外，还有这么多个IO线程处理连接上的读写）
+    server.setThreadNum(static_cast<int>(RpcConfig::Instance().LookupCount("rpcserver_io_threads", 4, 0)));
+
+    // 启动业务线程池。队列是有界的，队列满时IO线程会阻塞在投递任务上，从而不再读取新的请求，形成背压
+    // 线程数为0时服务方法在IO线程中执行；队列长度为0时不限制
+    m_worker_threads = static_cast<int>(RpcConfig::Instance().LookupCount("rpcserver_worker_threads", 4, 0));
+    if (m_worker_threads > 0) {
+        m_worker_pool.setMaxQueueSize(static_cast<int>(RpcConfig::Instance().LookupCount("rpcserver_worker_queue_size", 10000, 0)));
+        m_worker_pool.start(m_worker_threads);
+    }
+    // 流式线程池的队列不设上限，同时进行的流已经被m_stream_limiter限制在线程数以内，投递时不会阻塞IO线程
+    m_stream_threads = static_cast<int>(RpcConfig::Instance().LookupCount("rpcserver_stream_threads", 4, 0));
+    if (m_stream_threads > 0) {
+        m_stream_limiter = std::make_unique<StaticLimiter>(static_cast<size_t>(m_stream_threads));
+        m_stream_pool.start(m_stream_threads);
+    }
+
+    // 启动网络服务，开始监听之后再注册，客户端发现实例时总是可以连上
     server.start();
+    // 配置了rpcserver_uds_path时同时监听Unix域套接字，和TCP连接共用IO线程和回调，同一台机器上的客户端优先使用
+    Endpoint self{ip, static_cast<uint16_t>(std::atoi(port.c_str()))};
+    if (auto uds_path = RpcConfig::Instance().Lookup("rpcserver_uds_path"); uds_path && !uds_path->empty()) {
+        m_unix_server = std::make_unique<UnixServer>(&m_event_loop, *uds_path, server.threadPool());
+        m_unix_server->setConnectionCallback(std::bind(&RpcProvider::onConnection, this, std::placeholders::_1));
+        m_unix_server->setMessageCallback(std::bind(&RpcProvider::onMessage, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3));
+        if (m_unix_server->Start()) {
+            self.uds = *uds_path;
+            LOG(INFO) << "RpcProvider start service at unix socket " << *uds_path;
+        }
+    }
+
+    // 把当前rpc节点上要发布的服务全部发布到注册中心，让rpc client可以发现服务。
+    // 实例被从注册中心摘除（例如被运维手动删除）时，停止提供对应的服务
+    auto table = m_dispatch_table.Load();
+    for (auto &sp : table->services) {
+        std::string service_name = sp.first;
+        if (!m_registry->Register(service_name, self, [this, service_name] { UnregisterService(service_name); })) {
+            LOG(ERROR) << "register " << service_name << " at " << self.ToString() << " error!";
+        }
+    }
+    // 指标输出端口，和RPC服务共用同一个EventLoop，为0时不开启
+    std::unique_ptr<MetricsServer> metrics_server;
+    int64_t metrics_port = RpcConfig::Instance().LookupInt("rpcserver_metrics_port", 0);
+    if (metrics_port > 0) {
+        metrics_server = std::make_unique<MetricsServer>(&m_event_loop, muduo::net::InetAddress(ip, static_cast<uint16_t>(metrics_port)));
+        metrics_server->Start();
+        LOG(INFO) << "RpcProvider export metrics at ip:" << ip << " port:" << metrics_port;
+    }
+    // rpc服务端已经启动，打印信息
+    LOG(INFO) << "RpcProvider start service at ip:" << ip << " port:" << port;
     m_event_loop.loop();
+    // IO线程随server一起销毁，在这之前结束所有的调用
+    stopCalls();
+    // Unix域套接字上的连接使用server的IO线程，需要在server之前销毁
+    m_unix_server.reset();
     LOG(INFO) << "RpcProvider stop service at ip:" << ip << " port:" << port;
 }
 
+void RpcProvider::Stop()
+{
+    m_event_loop.quit();
+}
+
+void RpcProvider::stopCalls()
+{
+    m_stopping = true;
+    // 唤醒阻塞在收发消息上的流式方法
+    std::unordered_map<const muduo::net::TcpConnection *, std::unordered_map<uint64_t, std::shared_ptr<ServerStream>>> streams;
+    {
+        std::lock_guard<std::mutex> lock(m_streams_mutex);
+        streams.swap(m_streams);
+    }
+    for (auto &[conn, conn_streams] : streams) {
+        for (auto &[call_id, stream] : conn_streams) {
+            stream->Close();
+        }
+    }
+    // 排队中的调用在invokeMethod中直接结束，很快就会被取完。线程池停止时会等待执行中的服务方法返回，
+    // 之后队列中剩下的任务不会再执行，只有服务方法一直不返回时才会有剩下的
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(RpcConfig::Instance().LookupInt("rpcserver_stop_timeout_ms", 3000));
+    auto wait_until = [&deadline](const std::function<bool()> &done) {
+        while (!done() && std::chrono::steady_clock::now() < deadline) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    };
+    wait_until([this] { return m_worker_pool.queueSize() == 0 && m_stream_pool.queueSize() == 0; });
+    size_t dropped = m_worker_pool.queueSize() + m_stream_pool.queueSize();
+    if (dropped > 0) {
+        LOG(ERROR) << "RpcProvider stop, " << dropped << " queued calls are dropped";
+    }
+    m_worker_pool.stop();
+    m_stream_pool.stop();
+    // 不在线程池中完成的调用，IO线程还在运行，这期间结束的调用照常发送响应
+    wait_until([this] { return m_inflight.load() == 0; });
+    m_loops_closed = true;
+    while (m_senders.load() > 0) {
+        std::this_thread::yield();
+    }
+    if (size_t inflight = m_inflight.load(); inflight > 0) {
+        LOG(ERROR) << "RpcProvider stop, responses of " << inflight << " unfinished calls will be dropped";
+    }
+}
+
+void RpcProvider::Drain()
+{
+    if (m_draining.exchange(true)) {
+        return;
+    }
+    // 先从注册中心摘除，客户端的服务发现缓存随后失效，不再把新的调用发到这里
+    auto table = m_dispatch_table.Load();
+    for (auto &sp : table->services) {
+        m_registry->Unregister(sp.first);
+    }
+    auto grace = std::chrono::milliseconds(RpcConfig::Instance().LookupInt("rpcserver_drain_grace_ms", 2000));
+    auto timeout = std::chrono::milliseconds(RpcConfig::Instance().LookupInt("rpcserver_drain_timeout_ms", 10000));
+    LOG(WARNING) << "RpcProvider draining, stop accepting after " << grace.count() << "ms";
+    m_event_loop.runInLoop([this, grace, timeout] {
+        // 等待客户端更新缓存期间照常处理请求，还没有更新的客户端发来的调用也能成功
+        m_event_loop.runAfter(std::chrono::duration<double>(grace).count(), [this, timeout] {
+            stopAccepting();
+            m_drain_deadline = std::chrono::steady_clock::now() + timeout;
+            checkDrained();
+        });
+    });
+}
+
+void RpcProvider::stopAccepting()
+{
+    // muduo的TcpServer没有办法只关闭监听套接字而保留已有的连接，所以TCP端口仍然在监听，
+    // 之后建立的连接在onConnection中立即收到goaway，客户端不会在上面发起新的调用
+    m_goaway = true;
+    if (m_unix_server) {
+        m_unix_server->StopAccepting();
+    }
+    std::vector<muduo::net::TcpConnectionPtr> conns;
+    {
+        std::lock_guard<std::mutex> lock(m_conns_mutex);
+        conns.assign(m_conns.begin(), m_conns.end());
+    }
+    LOG(WARNING) << "RpcProvider stop accepting, notify " << conns.size() << " connections, " << m_inflight.load() << " calls in flight";
+    for (auto &conn : conns) {
+        sendGoAway(conn);
+    }
+}
+
+void RpcProvider::checkDrained()
+{
+    size_t inflight = m_inflight.load();
+    if (inflight == 0) {
+        LOG(WARNING) << "RpcProvider drained";
+        m_event_loop.quit();
+    } else if (std::chrono::steady_clock::now() >= m_drain_deadline) {
+        LOG(ERROR) << "RpcProvider drain timeout, " << inflight << " calls in flight are dropped";
+        m_event_loop.quit();
+    } else {
+        m_event_loop.runAfter(0.05, [this] { checkDrained(); });
+    }
+}
+
+void RpcProvider::sendGoAway(const muduo::net::TcpConnectionPtr &conn)
+{
+    tinyrpc::RpcResponseHeader header;
+    header.set_goaway(true);
+    std::string frame;
+    if (codec::AppendFrame(header, std::string(), &frame)) {
+        sendFrame(conn, std::move(frame));
+    }
+}
+
 void RpcProvider::onConnection(const muduo::net::TcpConnectionPtr &conn)
 {
     if (!conn->connected()) { // 如果连接关闭则断开连接即可。
+        m_connections.fetch_sub(1, std::memory_order_relaxed);
+        {
+            std::lock_guard<std::mutex> lock(m_conns_mutex);
+            m_conns.erase(conn);
+        }
+        // 连接上进行中的流式调用没法再收发消息了，唤醒阻塞在Write/Read中的服务方法
+        std::unordered_map<uint64_t, std::shared_ptr<ServerStream>> streams;
+        {
+            std::lock_guard<std::mutex> lock(m_streams_mutex);
+            auto it = m_streams.find(conn.get());
+            if (it != m_streams.end()) {
+                streams.swap(it->second);
+                m_streams.erase(it);
+            }
+        }
+        for (auto &[call_id, stream] : streams) {
+            stream->Close();
+        }
         conn->shutdown();
+        return;
+    }
+    // 被拒绝的连接关闭时同样会减一，所以这里不管是否拒绝都要加一
+    size_t connections = m_connections.fetch_add(1, std::memory_order_relaxed) + 1;
+    if (m_max_connections > 0 && connections > m_max_connections) {
+        LOG(WARNING) << "too many connections, reject " << conn->peerAddress().toIpPort();
+        conn->forceClose();
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_conns_mutex);
+        m_conns.insert(conn);
+    }
+    // 正在停止时，新连接上的调用仍然会被处理，但是客户端不应该再使用这个连接
+    if (m_goaway) {
+        sendGoAway(conn);
     }
 }
 
 void RpcProvider::onMessage(const muduo::net::TcpConnectionPtr &conn, muduo::net::Buffer *buffer, muduo::Timestamp receive_time)
 {
-    /* 1. 网络上接收的远程rpc调用请求的字符流    Login args  */
-    /* 2. 对收到的字符流反序列化  */
-    /* 3. 从反序列化的字符流中解析出service_name 和 method_name 和 args_str参数 */
-	/* 4. m_serviceMap是一个哈希表，我们之前将服务对象和方法对象保存在这个表里面，
-          根据service_name和method_name可以从m_serviceMap中找到服务对象service和方法对象描述符method。
-       5. 将args_str解码填充至request对象中
+    UNUSED(receive_time);
+    // TCP是字节流，一次可读事件中可能只有半个请求，也可能有多个首尾相连的请求（客户端在同一个连接上流水线发送），
+    // 所以要先根据header_size和header中的args_size切分出完整的请求帧，不完整的部分留在buffer中等待下次可读事件
+    while (buffer->readableBytes() > 0) {
+        tinyrpc::RpcHeader header;
+        size_t body_offset = 0;
+        size_t frame_size = 0;
+        auto status = codec::ParseFrame(buffer->peek(), buffer->readableBytes(), &header, &body_offset, &frame_size);
+        if (status == codec::DecodeStatus::kIncomplete) {
+            break;
+        }
+        if (status == codec::DecodeStatus::kError) {
+            // 连call_id都拿不到，无法回复错误响应，字节流也已经无法继续切分，只能断开连接
+            LOG(ERROR) << "header parse error";
+            buffer->retrieveAll();
+            conn->shutdown();
+            return;
+        }
+        // 直接在buffer上原地解析请求参数，处理完这一帧之后再从buffer中取走，省去拷贝成std::string的开销
+        if (header.stream_op() != tinyrpc::STREAM_NONE) {
+            handleStreamFrame(conn, header, buffer->peek() + body_offset, header.args_size());
+        } else if (header.batch_size() == 0) {
+            handleRequest(conn, header, buffer->peek() + body_offset, header.args_size());
+        } else if (!handleBatch(conn, header, buffer->peek() + body_offset, header.args_size())) {
+            LOG(ERROR) << "batch frame parse error";
+            buffer->retrieveAll();
+            conn->shutdown();
+            return;
+        }
+        buffer->retrieve(frame_size);
+    }
+}
+
+static google::protobuf::ArenaOptions CallArenaOptions(char *initial_block, size_t size)
+{
+    google::protobuf::ArenaOptions options;
+    options.initial_block = initial_block;
+    options.initial_block_size = size;
+    return options;
+}
+
+RpcProvider::CallContext::CallContext()
+    : arena(CallArenaOptions(arena_block, kArenaInitialBlockSize))
+{
+}
+
+RpcProvider::CallContext::~CallContext()
+{
+    auto latency = std::chrono::steady_clock::now() - receive_time;
+    if (server_limiter) {
+        server_limiter->Release(latency, outcome, method);
+    }
+    if (method_limiter) {
+        method_limiter->Release(latency, outcome, method);
+    }
+    if (stream_limiter) {
+        stream_limiter->Release(latency, outcome, method);
+    }
+    if (inflight) {
+        inflight->fetch_sub(1, std::memory_order_relaxed);
+    }
+}
+
+void RpcProvider::rejectRequest(const muduo::net::TcpConnectionPtr &conn, const BatchResponsePtr &batch, uint64_t call_id, const MethodInfo *method_info)
+{
+    method_info->metrics->requests.Add();
+    method_info->metrics->errors.Add();
+    method_info->metrics->rejected.Add();
+    RPC_TRACE << method_info->descriptor->full_name() << " call " << call_id << " rejected, server overloaded";
+    sendErrorResponse(conn, batch, call_id, tinyrpc::RPC_OVERLOADED, method_info->descriptor->full_name() + " overloaded");
+}
+
+bool RpcProvider::handleBatch(const muduo::net::TcpConnectionPtr &conn, const tinyrpc::RpcHeader &header, const char *frames, size_t frames_size)
+{
+    // 先检查所有子帧的格式，整个批量帧都可以处理时才开始分发，保证批次中的每个子调用都会有响应
+    auto check = [](const tinyrpc::RpcHeader &, const char *, size_t) { return true; };
+    if (!codec::ForEachInBatch<tinyrpc::RpcHeader>(frames, frames_size, header.batch_size(), check)) {
+        return false;
+    }
+    auto batch = std::make_shared<BatchResponse>();
+    batch->count = batch->remaining = header.batch_size();
+    // 子调用和单独发送的调用一样按各自方法的配置分发，整批的响应在最慢的子调用结束后发出
+    codec::ForEachInBatch<tinyrpc::RpcHeader>(frames, frames_size, header.batch_size(), [&](const tinyrpc::RpcHeader &sub, const char *args, size_t args_size) {
+        handleRequest(conn, sub, args, args_size, batch);
+        return true;
+    });
+    return true;
+}
+
+void RpcProvider::handleStreamFrame(const muduo::net::TcpConnectionPtr &conn, const tinyrpc::RpcHeader &header, const char *body, size_t body_size)
+{
+    std::shared_ptr<ServerStream> stream;
+    {
+        std::lock_guard<std::mutex> lock(m_streams_mutex);
+        auto it = m_streams.find(conn.get());
+        if (it == m_streams.end()) {
+            return;
+        }
+        auto sit = it->second.find(header.call_id());
+        if (sit == it->second.end()) {
+            // 调用已经结束了，例如服务端发完了所有消息之后才收到客户端的额度
+            return;
+        }
+        stream = sit->second;
+    }
+    stream->OnFrame(header, body, body_size);
+}
+
+void RpcProvider::handleRequest(const muduo::net::TcpConnectionPtr &conn, const tinyrpc::RpcHeader &header, const char *args, size_t args_size,
+                                const BatchResponsePtr &batch)
+{
+    /* 1. onMessage已经从网络上接收的字节流中切分出一个完整的请求帧，并反序列化出了RpcHeader */
+    /* 2. 从RpcHeader中取出method_id，没有带method_id的请求取出service_name 和 method_name */
+	/* 3. 分发表中保存了注册时计算好的method_id和服务对象、方法描述符的对应关系，
+          根据method_id（或者service_name和method_name）可以找到服务对象service和方法对象描述符method。
+       4. 将args解码填充至request对象中
     	  之后request对象就可以这样使用了：request.name() = "zhangsan"  |  request.pwd() = "123456"
     */
-    UNUSED(receive_time);
-    LOG(INFO) << "call onMessage";
-    // 网络上接收远程rpc调用请求的字节流
-    std::string recv_buf = buffer->retrieveAllAsString();
-
-    // 使用porotbuf的CodeInputStream反序列化rpc请求
-    google::protobuf::io::ArrayInputStream raw_input(recv_buf.data(), recv_buf.size());
-    google::protobuf::io::CodedInputStream coded_input(&raw_input);
-
-    // 获取RpcHeader字符串
-    uint32_t header_size{};
-    coded_input.ReadVarint32(&header_size); // 解析header_size（固定4B即32bits）
-    // 根据header_size读取数据头的原始字符流，反序列化数据，得到rpc请求的详细信息
-    std::string rpc_header_str;
-    tinyrpc::RpcHeader header;
-    std::string service_name;
-    std::string method_name;
-    uint32_t args_size{};
-    // 设置读取限制，读出RpcHeader
-    google::protobuf::io::CodedInputStream::Limit msg_limit = coded_input.PushLimit(header_size);
-    coded_input.ReadString(&rpc_header_str, header_size);
-    // 恢复之前的限制，以便安全地继续读取其他数据
-    coded_input.PopLimit(msg_limit);
-    // 将读到的RpcHeader数据填充至对象中方便使用
-    if (header.ParseFromString(rpc_header_str)) {
-        // 2. 反序列化出RpcHeader结构体各成员
-        service_name = header.service_name();
-        method_name = header.method_name();
-        args_size = header.args_size();
+    uint64_t call_id = header.call_id();
+
+    // 获取service对象和method对象，分发表发布之后不会再修改，这里不需要加锁。
+    // 使用IO线程缓存的快照，只在函数返回之前有效，调用需要的服务由下面的service_info持有
+    const DispatchTable &table = m_dispatch_table.Local();
+    // 指向分发表中的表项，确定要执行调用之后才拷贝到上下文中，被拒绝的请求不用增减服务的引用计数
+    const std::shared_ptr<const ServiceInfo> *service_info = nullptr;
+    const MethodInfo *method_info = nullptr;
+    if (header.method_id() != 0) {
+        auto it = table.methods.find(header.method_id());
+        if (it == table.methods.end()) {
+            LOG(WARNING) << "method id " << header.method_id() << " is not exist!";
+            sendErrorResponse(conn, batch, call_id, tinyrpc::RPC_METHOD_NOT_FOUND, "method id " + std::to_string(header.method_id()) + " is not exist!");
+            return;
+        }
+        service_info = &it->second.service;
+        method_info = it->second.method;
     } else {
-        LOG(ERROR) << "header parse error";
-        return;
+        // 兼容只带服务名和方法名的请求
+        const std::string &service_name = header.service_name();
+        const std::string &method_name = header.method_name();
+        auto sit = table.services.find(service_name);
+        if (sit == table.services.end()) {
+            LOG(WARNING) << service_name << " is not exist!";
+            sendErrorResponse(conn, batch, call_id, tinyrpc::RPC_SERVICE_NOT_FOUND, service_name + " is not exist!");
+            return;
+        }
+        auto mit = sit->second->method_map.find(method_name);
+        if (mit == sit->second->method_map.end()) {
+            LOG(WARNING) << service_name << "." << method_name << " is not exist!";
+            sendErrorResponse(conn, batch, call_id, tinyrpc::RPC_METHOD_NOT_FOUND, service_name + "." + method_name + " is not exist!");
+            return;
+        }
+        service_info = &sit->second;
+        method_info = &mit->second;
     }
-    std::string args_str; // rpc参数
-    // 直接读取args_size长度的字节payload
-    if (!coded_input.ReadString(&args_str, args_size)) {
-        LOG(ERROR) << "read args error";
+
+    // 并发已满时直接拒绝，不再解析请求，客户端可以换一个实例重试
+    ConcurrencyLimiter *method_limiter = method_info->limiter.get();
+    if (method_limiter && !method_limiter->TryAcquire()) {
+        rejectRequest(conn, batch, call_id, method_info);
         return;
     }
-    // 打印调试信息
-    // LOG(INFO) << "============================================";
-    // LOG(INFO) << "header_size: " << header_size;
-    // LOG(INFO) << "rpc_header_str: " << rpc_header_str;
-    // LOG(INFO) << "service_name: " << service_name;
-    // LOG(INFO) << "method_name: " << method_name;
-    // LOG(INFO) << "args_str: " << args_str;
-    // LOG(INFO) << "============================================";
-
-    // 获取service对象和method对象
-    m_rwlock.ReadLock();
-    auto sit = m_service_map.find(service_name);
-    if (sit == m_service_map.end()) {
-        LOG(WARNING) << service_name << " is not exist!";
-        m_rwlock.Unlock();
+    if (m_limiter && !m_limiter->TryAcquire()) {
+        if (method_limiter) {
+            method_limiter->Release(std::chrono::steady_clock::duration::zero(), ConcurrencyLimiter::Outcome::kSkipped);
+        }
+        rejectRequest(conn, batch, call_id, method_info);
         return;
     }
-    m_rwlock.Unlock();
-
-    auto mit = sit->second.method_map.find(method_name);
-    if (mit == sit->second.method_map.end()) {
-        LOG(WARNING) << service_name << "." << method_name << " is not exist!";
+    // 流式线程都被占用时同样拒绝，不让流在队列中等待
+    ConcurrencyLimiter *stream_limiter = method_info->streaming ? m_stream_limiter.get() : nullptr;
+    if (stream_limiter && !stream_limiter->TryAcquire()) {
+        if (method_limiter) {
+            method_limiter->Release(std::chrono::steady_clock::duration::zero(), ConcurrencyLimiter::Outcome::kSkipped);
+        }
+        if (m_limiter) {
+            m_limiter->Release(std::chrono::steady_clock::duration::zero(), ConcurrencyLimiter::Outcome::kSkipped);
+        }
+        rejectRequest(conn, batch, call_id, method_info);
         return;
     }
 
     // 此时说明服务和方法都在，可以执行了
     // 我们要通过Protobuf RPC框架来调用本地的服务方法实现，所以要先准备一些需要的对象
+    auto *ctx = new CallContext;
+    ctx->receive_time = std::chrono::steady_clock::now();
+    ctx->server_limiter = m_limiter.get();
+    ctx->method_limiter = method_limiter;
+    ctx->stream_limiter = stream_limiter;
+    ctx->inflight = &m_inflight;
+    m_inflight.fetch_add(1, std::memory_order_relaxed);
+    ctx->trace = RpcTrace::ShouldTrace();
+    RPC_TRACE_IF(ctx->trace) << "recv " << method_info->descriptor->full_name() << " call " << call_id << " from " << conn->peerAddress().toIpPort();
+    ctx->metrics = method_info->metrics;
+    ctx->metrics->bytes_in.Add(args_size);
+    ctx->conn = conn;
+    ctx->batch = batch;
+    ctx->call_id = call_id;
+    ctx->service = (*service_info)->service.get(); // 获取服务对象
+    ctx->method = method_info->descriptor; // 获取方法对象
+    if (header.accept_compression() & (1u << method_info->compression)) {
+        ctx->compression = method_info->compression;
+    }
+    ctx->service_info = *service_info;
+    if (header.timeout_ms() > 0) {
+        // 服务方法中也能拿到请求的截止时间，再调用其他服务时可以沿用
+        ctx->controller.SetTimeout(std::chrono::milliseconds(header.timeout_ms()));
+    }
 
-    google::protobuf::Service * const service = sit->second.service.get(); // 获取服务对象
-    const google::protobuf::MethodDescriptor *method = mit->second; // 获取方法对象
+    // 生成rpc方法调用请求的request参数，直接从接收缓冲区中反序列化，args只在这个函数返回之前有效
+    ctx->request = ctx->service->GetRequestPrototype(ctx->method).New(&ctx->arena); // 通过 GetRequestPrototype，可以根据方法描述符动态获取对应的请求消息类型，并New()实例化该类型的对象【这样我就不用手动多态创建了】。对象分配在本次调用的arena上
+    bool parsed = codec::ParseBody(header, args, args_size, ctx->request);
+    ctx->metrics->parse_time.Record(std::chrono::steady_clock::now() - ctx->receive_time);
+    if (!parsed) {
+        ctx->metrics->requests.Add();
+        ctx->metrics->errors.Add();
+        LOG(ERROR) << ctx->method->full_name() << " parse error!";
+        sendErrorResponse(conn, batch, call_id, tinyrpc::RPC_BAD_REQUEST, ctx->method->full_name() + " parse error!");
+        delete ctx;
+        return;
+    }
 
-    // 生成rpc方法调用请求的request和响应的response参数。本地的RPC回调需要这两个参数
-    google::protobuf::Message *request = service->GetRequestPrototype(method).New(); // 通过 GetRequestPrototype，可以根据方法描述符动态获取对应的请求消息类型，并New()实例化该类型的对象【这样我就不用手动多态创建了】
-    if (!request->ParseFromString(args_str)) {
-        LOG(ERROR) << service_name << "." << method_name << "parse error!";
+    if (method_info->streaming) {
+        // 流式方法会阻塞等待消息和额度，只能在流式线程中执行；额度为0说明客户端没有通过ClientStream调用，无法进行流控
+        const char *error = nullptr;
+        if (header.credit() == 0) {
+            error = " must be called with ClientStream";
+        } else if (!m_stream_limiter) {
+            error = " requires stream threads";
+        }
+        if (error) {
+            ctx->metrics->requests.Add();
+            ctx->metrics->errors.Add();
+            LOG(ERROR) << ctx->method->full_name() << error;
+            sendErrorResponse(conn, batch, call_id, tinyrpc::RPC_BAD_REQUEST, ctx->method->full_name() + error);
+            delete ctx;
+            return;
+        }
+        // 消息的类型使用生成代码中的默认实例，它比这次调用的上下文活得久
+        ctx->stream.reset(new ServerStream(call_id, &ctx->service->GetRequestPrototype(ctx->method), header.credit(), ctx->compression, ctx->controller.Deadline(),
+                                           [this, conn](std::string frame) { sendFrame(conn, std::move(frame)); }));
+        ctx->controller.SetStream(ctx->stream.get());
+        {
+            // 在开始执行之前登记，之后客户端发来的消息和额度都能找到这个调用
+            std::lock_guard<std::mutex> lock(m_streams_mutex);
+            m_streams[conn.get()][call_id] = ctx->stream;
+        }
+        m_stream_pool.run([this, ctx] { invokeMethod(ctx); });
+    } else if (method_info->run_in_io_thread || m_worker_threads <= 0) {
+        invokeMethod(ctx);
+    } else {
+        m_worker_pool.run([this, ctx] { invokeMethod(ctx); });
+    }
+}
+
+void RpcProvider::invokeMethod(CallContext *ctx)
+{
+    // 在业务线程池中排队期间已经超过截止时间的请求，客户端已经不再等待结果了，不必再执行
+    ctx->dispatch_time = std::chrono::steady_clock::now();
+    ctx->metrics->queue_time.Record(ctx->dispatch_time - ctx->receive_time);
+    if (m_stopping) {
+        // 服务端正在停止，不再执行，请求没有被处理过，客户端可以换一个实例重试
+        ctx->metrics->requests.Add();
+        ctx->metrics->errors.Add();
+        unregisterStream(ctx);
+        sendErrorResponse(ctx->conn, ctx->batch, ctx->call_id, tinyrpc::RPC_OVERLOADED, ctx->method->full_name() + " not executed, server is stopping");
+        delete ctx;
         return;
     }
+    auto deadline = ctx->controller.Deadline();
+    if (deadline && ctx->dispatch_time >= *deadline) {
+        ctx->metrics->requests.Add();
+        ctx->metrics->errors.Add();
+        LOG(WARNING) << ctx->method->full_name() << " deadline exceeded before dispatch";
+        ctx->outcome = ConcurrencyLimiter::Outcome::kDropped;
+        unregisterStream(ctx);
+        sendErrorResponse(ctx->conn, ctx->batch, ctx->call_id, tinyrpc::RPC_DEADLINE_EXCEEDED, ctx->method->full_name() + " deadline exceeded");
+        delete ctx;
+        return;
+    }
+
+    google::protobuf::Service *service = ctx->service;
+    const google::protobuf::MethodDescriptor *method = ctx->method;
 
-    google::protobuf::Message *response = service->GetResponsePrototype(method).New(); // 同理获取请求消息对象
+    // 生成rpc方法调用响应的response参数。本地的RPC回调需要request和response这两个参数
+    ctx->response = service->GetResponsePrototype(method).New(&ctx->arena); // 同理获取响应消息对象，repeated字段的元素也都分配在arena上
 
     // 给下面的mehod方法的调用绑定一个回调函数，当服务的方法调用完成后，这个回调函数会被调用
     /***
-    template <typename Class, typename Arg1, typename Arg2>
-    inline Closure* NewCallback(Class* object, void (Class::*method)(Arg1, Arg2), Arg1 arg1, Arg2 arg2) { // void (Class::*)(Arg1, Arg2) 成员函数指针类型
-        return new internal::MethodClosure2<Class, Arg1, Arg2> (object, method, true, arg1, arg2);
+    template <typename Class, typename Arg1>
+    inline Closure* NewCallback(Class* object, void (Class::*method)(Arg1), Arg1 arg1) { // void (Class::*)(Arg1) 成员函数指针类型
+        return new internal::MethodClosure1<Class, Arg1> (object, method, true, arg1);
     }
     ***/
-    google::protobuf::Closure *done = google::protobuf::NewCallback<RpcProvider, const muduo::net::TcpConnectionPtr &, google::protobuf::Message *>(this, &RpcProvider::sendRpcResponse, conn, response);
+    google::protobuf::Closure *done = google::protobuf::NewCallback<RpcProvider, CallContext *>(this, &RpcProvider::sendRpcResponse, ctx);
 
     // 使用protobuf框架，调用当前rpc节点上发布的服务方法
-    service->CallMethod(method, nullptr, request, response, done); // request,response是method方法(如login)的参数。done是执行完method方法后会执行的回调函数。
+    service->CallMethod(method, &ctx->controller, ctx->request, ctx->response, done); // request,response是method方法(如login)的参数。done是执行完method方法后会执行的回调函数。
 }
 
-void RpcProvider::sendRpcResponse(const muduo::net::TcpConnectionPtr &conn, google::protobuf::Message *response)
+void RpcProvider::sendRpcResponse(CallContext *ctx)
 {
-    LOG(INFO) << "RPC Call finished, sending response to caller";
-    std::string response_str;
-    if (response->SerializeToString(&response_str)) {
-        // 序列化成功，通过网络把rpc方法执行的结果返回给rpc的调用方（执行结果在response里，序列化到response_str）
-        conn->send(response_str);
+    RPC_TRACE_IF(ctx->trace) << ctx->method->full_name() << " call " << ctx->call_id << " finished, sending response to caller";
+    std::unique_ptr<CallContext> guard(ctx); // 响应序列化之后本次调用的上下文连同arena上的request和response就可以释放了
+    if (!ctx->stream) {
+        // 流式调用的耗时取决于客户端收发消息的快慢，不能反映服务端的负载
+        ctx->outcome = ConcurrencyLimiter::Outcome::kCompleted;
+    }
+    // 流式调用的最后一个响应，在这之前Write发出的消息已经交给了IO线程，客户端会先收到它们
+    unregisterStream(ctx);
+    MethodMetrics *metrics = ctx->metrics;
+    auto handled_time = std::chrono::steady_clock::now();
+    metrics->handler_time.Record(handled_time - ctx->dispatch_time);
+    metrics->requests.Add();
+    if (ctx->controller.Failed()) {
+        metrics->errors.Add();
+        sendErrorResponse(ctx->conn, ctx->batch, ctx->call_id, tinyrpc::RPC_FAILED, ctx->controller.ErrorText());
+        metrics->latency.Record(std::chrono::steady_clock::now() - ctx->receive_time);
+        return;
+    }
+    tinyrpc::RpcResponseHeader header;
+    header.set_call_id(ctx->call_id);
+    header.set_status(tinyrpc::RPC_OK);
+    header.set_body_size(ctx->response->ByteSizeLong()); // 同时缓存了response的序列化长度
+    header.set_compression(ctx->compression);
+    header.set_accept_compression(Compressor::SupportedMask());
+    // header和response直接序列化到同一块按整帧长度分配的缓冲区中，需要压缩时先压缩
+    std::string send_str;
+    bool serialized = codec::AppendCompressedFrame(header, *ctx->response, &send_str);
+    metrics->serialize_time.Record(std::chrono::steady_clock::now() - handled_time);
+    if (serialized) {
+        // 序列化成功，通过网络把rpc方法执行的结果返回给rpc的调用方
+        metrics->bytes_out.Add(header.body_size());
+        sendResponse(ctx->conn, ctx->batch, std::move(send_str));
     } else {
+        metrics->errors.Add();
         LOG(ERROR) << "serialize response error!";
+        sendErrorResponse(ctx->conn, ctx->batch, ctx->call_id, tinyrpc::RPC_FAILED, "serialize response error!");
+    }
+    metrics->latency.Record(std::chrono::steady_clock::now() - ctx->receive_time);
+    // 连接由客户端的连接池管理，可以被多个调用复用，这里不能主动断开
+}
+
+void RpcProvider::unregisterStream(CallContext *ctx)
+{
+    if (!ctx->stream) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_streams_mutex);
+        auto it = m_streams.find(ctx->conn.get());
+        if (it != m_streams.end()) {
+            it->second.erase(ctx->call_id);
+            if (it->second.empty()) {
+                m_streams.erase(it);
+            }
+        }
+    }
+    ctx->stream->Close();
+}
+
+void RpcProvider::sendErrorResponse(const muduo::net::TcpConnectionPtr &conn, const BatchResponsePtr &batch, uint64_t call_id, tinyrpc::RpcStatus status,
+                                    const std::string &error_text)
+{
+    tinyrpc::RpcResponseHeader header;
+    header.set_call_id(call_id);
+    header.set_status(status);
+    header.set_error_text(error_text);
+    // 请求因为用了服务端不支持的算法而无法解压时，客户端也能从错误响应中知道应该改用什么算法
+    header.set_accept_compression(Compressor::SupportedMask());
+    std::string send_str;
+    if (codec::AppendFrame(header, std::string(), &send_str)) {
+        sendResponse(conn, batch, std::move(send_str));
+    }
+}
+
+void RpcProvider::sendResponse(const muduo::net::TcpConnectionPtr &conn, const BatchResponsePtr &batch, std::string frame)
+{
+    if (!batch) {
+        sendFrame(conn, std::move(frame));
+        return;
+    }
+    std::string frames;
+    {
+        std::lock_guard<std::mutex> lock(batch->mutex);
+        batch->frames.append(frame);
+        if (--batch->remaining > 0) {
+            return;
+        }
+        frames.swap(batch->frames);
+    }
+    // 最后一个结束的子调用负责把整批响应打包发送
+    tinyrpc::RpcResponseHeader header;
+    header.set_batch_size(batch->count);
+    header.set_body_size(static_cast<uint32_t>(frames.size()));
+    std::string send_str;
+    if (codec::AppendFrame(header, frames, &send_str)) {
+        sendFrame(conn, std::move(send_str));
+    }
+}
+
+void RpcProvider::sendFrame(const muduo::net::TcpConnectionPtr &conn, std::string frame)
+{
+    // 先登记再检查，stopCalls设置m_loops_closed之后会等待已经登记的线程发送完，之后的发送都被丢弃
+    m_senders.fetch_add(1);
+    if (m_loops_closed.load()) {
+        m_senders.fetch_sub(1);
+        return;
+    }
+    muduo::net::EventLoop *loop = conn->getLoop();
+    if (loop->isInLoopThread()) {
+        conn->send(frame);
+    } else {
+        // 在业务线程中完成的调用，把已经序列化好的数据转交给IO线程发送，避免TcpConnection::send再拷贝一次
+        loop->runInLoop([conn, frame = std::move(frame)] { conn->send(frame); });
     }
-    // 模拟http短链接（毕竟是方法调用），由rpcprovider主动断开连接【目前无法使用，因为我在RpcChannel中有一个m_clientFd改不了】
-    // TODO 要想改得能用，应该是要把RpcChannel中使用裸的socket API改成使用muduo::TcpConnectionPtr
-    // conn->shutdown();
+    m_senders.fetch_sub(1);
 }
 
 RpcProvider::~RpcProvider()
@@ -1,18 +1,33 @@
 #pragma once
 
 #include "google/protobuf/service.h"
+#include <atomic>
+#include <cstddef>
+#include <google/protobuf/arena.h>
 #include <google/protobuf/descriptor.h>
+#include <memory>
+#include <mutex>
+#include <muduo/base/ThreadPool.h>
 #include <muduo/net/EventLoop.h>
 #include <muduo/net/InetAddress.h>
 #include <muduo/net/TcpConnection.h>
 #include <muduo/net/TcpServer.h>
 #include <string>
 #include <unordered_map>
-#include "rwlock.h"
+#include <unordered_set>
+#include "concurrencylimiter.h"
+#include "rpccontroller.h"
+#include "rpcmetrics.h"
+#include "rpcstream.h"
+#include "serviceregistry.h"
+#include "snapshot.h"
+#include "tinyrpcheader.pb.h"
 
 namespace meha
 {
 
+class UnixServer;
+
 /**
  * @brief 管理当前进程中发布服务和移除服务的类
  * @details 作为TCP服务器，监听客户端（即caller）发送的数据，并调用服务方法来实现远程调用
@@ -28,6 +43,17 @@ public:
      * 这个函数用于注册服务对象和其对应的 RPC 方法，以便服务端处理客户端的请求。
      * 参数类型设置为 google::protobuf::Service，是因为所有由 protobuf 生成的服务类
      * 都继承自 google::protobuf::Service，这样我们可以通过基类指针指向子类对象，实现动态多态。
+     * 服务方法默认在业务线程池中执行，可以通过配置项rpcserver_dispatch.<服务名>或者rpcserver_dispatch.<服务名>.<方法名>
+     * 设置为io，让不会阻塞的轻量方法直接在IO线程中执行。
+     * 响应的压缩算法由配置项rpc_compression.<服务名>.<方法名>等指定（见Compressor），只在客户端支持该算法时压缩。
+     * 配置项rpcserver_limit限制整个Provider的并发请求数，rpcserver_limit.<服务名>或rpcserver_limit.<服务名>.<方法名>
+     * 限制单个方法的并发请求数，取值为固定的数字或者自适应的aimd、gradient（见ConcurrencyLimiter）。
+     * 超过限制的请求在IO线程中直接以RPC_OVERLOADED拒绝。rpcserver_max_connections限制连接数，超过时新连接被直接关闭。
+     * 每个方法的调用数、错误数、字节数和各阶段耗时记录在Metrics中，配置了rpcserver_metrics_port时
+     * 可以通过该端口以Prometheus文本格式获取。
+     * 用(tinyrpc.server_streaming)或(tinyrpc.client_streaming)标记的流式方法通过ServerStream收发消息，
+     * 在单独的流式线程池中执行（rpcserver_stream_threads，默认4），每个流在整个生命周期内占用一个线程，
+     * 同时进行的流不超过线程数，超过时以RPC_OVERLOADED拒绝，慢的流不会占满执行普通方法的业务线程
      * @param service 
      */
     void RegisterService(std::unique_ptr<google::protobuf::Service> service);
@@ -35,6 +61,23 @@ public:
     void UnregisterService(const std::string &service_name);
     // 启动RPC服务节点，开始提供RPC服务
     void Run();
+    /**
+     * @brief 立即停止，可以在其他线程中调用
+     * 事件循环退出后，Run不再开始执行新的调用，排队中的调用以RPC_OVERLOADED结束，然后等待执行中的服务方法返回，
+     * 最多等待rpcserver_stop_timeout_ms（默认3000毫秒）让不在线程池中完成的调用（例如在其他线程中执行done）结束，
+     * 之后IO线程被销毁，再完成的调用的响应被丢弃。服务方法需要在RpcProvider析构之前结束
+     */
+    void Stop();
+    /**
+     * @brief 优雅停止，结束后Run返回，可以在其他线程中调用（例如收到SIGTERM的线程），重复调用无效
+     * 1. 从注册中心摘除本实例的所有服务，期间照常处理请求；
+     * 2. 等待rpcserver_drain_grace_ms（默认2000毫秒），让客户端的服务发现缓存更新；
+     * 3. 不再接受新连接，并通知所有连接上的客户端（goaway）不要再发起新的调用，客户端在已经发出的调用结束后关闭连接；
+     * 4. 等待进行中的调用都结束，最多等待rpcserver_drain_timeout_ms（默认10000毫秒），之后和Stop一样结束剩下的调用，然后Run返回。
+     * 配置rpcserver_reuse_port=true时监听端口设置了SO_REUSEPORT，新进程可以在旧进程还在运行时监听同一个端口，
+     * 先启动新进程再让旧进程Drain，部署时端口上始终有进程在接受连接。
+     */
+    void Drain();
 
 private:
     /**
@@ -48,16 +91,48 @@ private:
      * 格式是header_size(4个字节)+header_str+arg_size+arg_str，是二进制字节流，
      * 其中header_str是服务对象和服务对象中的方法，arg_size是要传入服务对象方法的参数长度，
      * 然后就会接着arg_str，即Caller在Stub上设置的服务对象方法的传入参数。
+     * 收到的数据中可能有不完整的请求，也可能有多个请求，这里负责切分出每一个完整的请求交给handleRequest。
      * @param conn
      * @param buffer
      * @param receive_time
      */
     void onMessage(const muduo::net::TcpConnectionPtr &conn, muduo::net::Buffer *buffer, muduo::Timestamp receive_time);
+    /// @brief 一个批量请求的响应，所有子调用都结束后作为一个批量响应帧发送
+    struct BatchResponse
+    {
+        std::mutex mutex; // 子调用可能在不同的业务线程中结束
+        std::string frames; // 已经结束的子调用的响应帧，顺序和请求中的不一定相同，客户端按call_id分发
+        uint32_t count = 0;
+        uint32_t remaining = 0;
+    };
+    using BatchResponsePtr = std::shared_ptr<BatchResponse>;
+
     /**
-     * @brief RPCClosure的回调操作，用于序列化rpc的响应和网络发送
+     * @brief 处理一个完整的请求帧
+     * @param header onMessage从字节流中切分出来的一帧的RpcHeader
+     * @param args 指向接收缓冲区中的请求参数，只在函数返回之前有效
+     * @param batch 不为空时这是批量请求中的一个子调用，响应交给batch汇总
      */
-    void sendRpcResponse(const muduo::net::TcpConnectionPtr &conn, google::protobuf::Message *response);
-
+    void handleRequest(const muduo::net::TcpConnectionPtr &conn, const tinyrpc::RpcHeader &header, const char *args, size_t args_size,
+                       const BatchResponsePtr &batch = nullptr);
+    /**
+     * @brief 处理一个批量请求帧，把其中的每个子调用分别交给handleRequest
+     * @return false 子帧格式错误，连接上的字节流已经不可信
+     */
+    bool handleBatch(const muduo::net::TcpConnectionPtr &conn, const tinyrpc::RpcHeader &header, const char *frames, size_t frames_size);
+    // 把流式调用中间的帧交给进行中的调用
+    void handleStreamFrame(const muduo::net::TcpConnectionPtr &conn, const tinyrpc::RpcHeader &header, const char *body, size_t body_size);
+    /// @brief 服务方法及其调度方式
+    struct MethodInfo
+    {
+        const google::protobuf::MethodDescriptor *descriptor;
+        // 为true时直接在IO线程中执行，适合不会阻塞的轻量方法，省去线程切换的开销
+        bool run_in_io_thread;
+        MethodMetrics *metrics; // 该方法在服务端的指标
+        tinyrpc::Compression compression; // 响应的压缩算法，客户端不支持时不压缩
+        std::unique_ptr<ConcurrencyLimiter> limiter; // 方法级别的并发限制，为空时不限制
+        bool streaming; // 服务端流式或者客户端流式方法
+    };
     /// @brief 该服务对象需要提交到注册中心的注册表项
     /// @note 由于含有std::unique_ptr，所以该类不能拷贝
     struct ServiceInfo
@@ -65,11 +140,120 @@ private:
         // 服务对象
         std::unique_ptr<google::protobuf::Service> service;
         // 服务方法
-        std::unordered_map<std::string, const google::protobuf::MethodDescriptor *> method_map;
+        std::unordered_map<std::string, MethodInfo> method_map;
+    };
+    /// @brief 按method_id查到的方法和它所属的服务
+    struct MethodEntry
+    {
+        std::shared_ptr<const ServiceInfo> service;
+        const MethodInfo *method; // 指向service->method_map中的表项
+    };
+    /**
+     * @brief 请求分发表，发布之后不再修改
+     * 注册和移除服务时复制出一张新表再整体替换，处理请求时从IO线程缓存的快照中查找（见Snapshot），不需要加锁，
+     * 也不需要增减分发表的引用计数。进行中的调用通过CallContext::service_info持有服务，服务被移除时也不会被析构
+     */
+    struct DispatchTable
+    {
+        std::unordered_map<std::string, std::shared_ptr<const ServiceInfo>> services; // 服务名到服务
+        std::unordered_map<uint32_t, MethodEntry> methods; // method_id到方法
     };
-    std::unordered_map<std::string, ServiceInfo> m_service_map; // 保存在该Provider上注册的所有服务对象和其服务方法
+
+    /// @brief 一次RPC调用在服务端的上下文，在sendRpcResponse中发送响应后释放
+    struct CallContext
+    {
+        // Arena的第一块内存，和上下文一起分配，大多数请求和响应不需要再向系统申请内存
+        static constexpr size_t kArenaInitialBlockSize = 4096;
+
+        CallContext();
+        // 归还占用的并发名额
+        ~CallContext();
+
+        muduo::net::TcpConnectionPtr conn;
+        uint64_t call_id = 0; // 请求中带来的调用编号，需要在响应中原样带回
+        std::shared_ptr<const ServiceInfo> service_info; // 调用期间服务被移除，服务对象也不会被析构
+        google::protobuf::Service *service = nullptr;
+        const google::protobuf::MethodDescriptor *method = nullptr;
+        RpcController controller; // 服务方法可以通过它上报失败
+        alignas(std::max_align_t) char arena_block[kArenaInitialBlockSize]; // 需要比arena后析构
+        // request和response都分配在arena上，随上下文一起释放，不能单独delete
+        google::protobuf::Arena arena;
+        google::protobuf::Message *request = nullptr;
+        google::protobuf::Message *response = nullptr;
+        BatchResponsePtr batch; // 批量请求中的子调用所属的批次
+        std::shared_ptr<ServerStream> stream; // 流式调用的消息流，同时登记在m_streams中
+        tinyrpc::Compression compression = tinyrpc::COMPRESS_NONE; // 响应的压缩算法
+        MethodMetrics *metrics = nullptr;
+        ConcurrencyLimiter *server_limiter = nullptr; // 占用了名额的限制器，上下文释放时归还
+        ConcurrencyLimiter *method_limiter = nullptr;
+        ConcurrencyLimiter *stream_limiter = nullptr; // 流式调用占用的流式线程名额
+        std::atomic<size_t> *inflight = nullptr; // Provider上进行中的调用数，上下文释放时减一
+        // 反馈给限制器的结束方式，服务方法执行完之前都是kSkipped
+        ConcurrencyLimiter::Outcome outcome = ConcurrencyLimiter::Outcome::kSkipped;
+        bool trace = false; // 是否打印这次调用的详细日志
+        std::chrono::steady_clock::time_point receive_time; // 开始处理请求的时间
+        std::chrono::steady_clock::time_point dispatch_time; // 开始执行服务方法的时间
+    };
+
+    // 流式调用结束，从m_streams中移除它的消息流
+    void unregisterStream(CallContext *ctx);
+    // Drain的第3步，不再接受新连接并通知所有客户端，在m_event_loop中执行
+    void stopAccepting();
+    // 进行中的调用都结束或者超过截止时间时让Run返回，否则稍后再检查，在m_event_loop中执行
+    void checkDrained();
+    // 通知客户端不要再在这个连接上发起新的调用
+    void sendGoAway(const muduo::net::TcpConnectionPtr &conn);
+    // 事件循环退出后，在销毁IO线程之前结束所有的调用，见Stop
+    void stopCalls();
+    // 并发已满，以RPC_OVERLOADED拒绝请求
+    void rejectRequest(const muduo::net::TcpConnectionPtr &conn, const BatchResponsePtr &batch, uint64_t call_id, const MethodInfo *method_info);
+    /**
+     * @brief 调用服务方法，在业务线程池或者IO线程中执行
+     */
+    void invokeMethod(CallContext *ctx);
+    /**
+     * @brief RPCClosure的回调操作，用于序列化rpc的响应和网络发送
+     * 可能在业务线程中执行，序列化之后把发送转交给连接所属的IO线程
+     */
+    void sendRpcResponse(CallContext *ctx);
+    // 在连接所属的IO线程中发送一帧数据，IO线程已经被销毁时什么也不做
+    void sendFrame(const muduo::net::TcpConnectionPtr &conn, std::string frame);
+    // 发送一个调用的响应帧，批量请求中的子调用等到整批都结束后一起发送
+    void sendResponse(const muduo::net::TcpConnectionPtr &conn, const BatchResponsePtr &batch, std::string frame);
+    /**
+     * @brief 发送不带响应体的错误响应
+     */
+    void sendErrorResponse(const muduo::net::TcpConnectionPtr &conn, const BatchResponsePtr &batch, uint64_t call_id, tinyrpc::RpcStatus status,
+                           const std::string &error_text);
+
+    std::mutex m_registry_mutex; // 串行化服务的注册和移除，处理请求时不需要获取
+    Snapshot<DispatchTable> m_dispatch_table; // 保存在该Provider上注册的所有服务对象和其服务方法
     muduo::net::EventLoop m_event_loop;
-    RWLock m_rwlock;
+    // 执行服务方法的业务线程池，避免慢的服务方法阻塞IO线程上的所有连接。线程数为0时所有方法都在IO线程中执行
+    muduo::ThreadPool m_worker_pool;
+    int m_worker_threads;
+    // 执行流式方法的线程池，流式方法会长时间阻塞在收发消息上，和普通方法分开，避免占满业务线程池
+    muduo::ThreadPool m_stream_pool;
+    int m_stream_threads;
+    std::unique_ptr<ConcurrencyLimiter> m_stream_limiter; // 同时进行的流不超过流式线程数，线程数为0时为空，流式方法不可用
+    std::unique_ptr<ConcurrencyLimiter> m_limiter; // 整个Provider的并发限制，为空时不限制
+    size_t m_max_connections; // 为0时不限制
+    std::atomic<size_t> m_connections = 0;
+    // 所有建立了的连接，Drain时逐个通知客户端
+    std::mutex m_conns_mutex;
+    std::unordered_set<muduo::net::TcpConnectionPtr> m_conns;
+    std::atomic<size_t> m_inflight = 0; // 进行中的调用数，Drain时等待它归零
+    std::atomic<bool> m_draining = false;
+    std::atomic<bool> m_goaway = false; // 已经通知过客户端，之后建立的连接也立即通知
+    std::chrono::steady_clock::time_point m_drain_deadline; // 只在m_event_loop中访问
+    std::atomic<bool> m_stopping = false; // 不再开始执行新的调用
+    std::atomic<bool> m_loops_closed = false; // IO线程即将被销毁，不能再向连接发送数据
+    std::atomic<size_t> m_senders = 0; // 正在sendFrame中的线程数，销毁IO线程前等待它归零
+    std::unique_ptr<UnixServer> m_unix_server; // 配置了rpcserver_uds_path时监听的Unix域套接字，只在Run期间存在
+    // 每个连接上进行中的流式调用，按call_id索引，客户端发来的流式帧按它找到调用。连接断开时其上的流都被关闭
+    std::mutex m_streams_mutex;
+    std::unordered_map<const muduo::net::TcpConnection *, std::unordered_map<uint64_t, std::shared_ptr<ServerStream>>> m_streams;
+    std::unique_ptr<ServiceRegistry> m_registry; // 由配置项rpc_registry选择的注册中心，本实例的注册随它一起释放
 };
 
 }
\ No newline at end of file
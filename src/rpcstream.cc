@@ -0,0 +1,334 @@
+#include "rpcstream.h"
+#include "rpcchannel.h"
+#include "rpccodec.h"
+#include "rpccompress.h"
+#include "rpcconfig.h"
+#include "rpcconnection.h"
+#include "rpccontroller.h"
+#include <algorithm>
+#include <glog/logging.h>
+
+using namespace meha;
+
+namespace
+{
+
+// 每处理完半个窗口的消息归还一次额度，不必每条消息都发送一个额度帧
+uint32_t CreditThreshold(uint32_t window)
+{
+    return (window + 1) / 2;
+}
+
+}
+
+struct ClientStream::State
+{
+    std::mutex mutex; // 保护下面的成员
+    std::condition_variable cond;
+    const google::protobuf::Message *prototype = nullptr; // 服务端发送的消息的类型
+    std::unique_ptr<google::protobuf::Message> response; // 服务端最后的响应
+    std::deque<std::unique_ptr<google::protobuf::Message>> messages; // 收到了还没有被Read读取的消息
+    uint32_t window = 0;
+    uint32_t consumed = 0; // 已经读取、还没有归还额度的消息数
+    uint32_t send_credit = 0; // 还可以发送的消息数
+    bool finished = false; // 调用已经结束，之后不会再收到消息
+
+    // 发送开始请求之后不再修改
+    RpcConnection::Ptr conn;
+    RpcConnection::CallPtr call;
+    uint64_t call_id = 0;
+
+    // 收到服务端在这个调用上发送的流式帧，在客户端IO线程中执行
+    void OnFrame(const tinyrpc::RpcResponseHeader &header, const char *body, size_t body_size)
+    {
+        if (header.stream_op() == tinyrpc::STREAM_MESSAGE) {
+            std::unique_ptr<google::protobuf::Message> message(prototype->New());
+            if (!codec::ParseBody(header, body, body_size, message.get())) {
+                // 丢弃这条消息，但它仍然占用了额度，下次归还额度时一起归还
+                LOG(ERROR) << "parse stream message error";
+                std::lock_guard<std::mutex> lock(mutex);
+                ++consumed;
+                return;
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            messages.push_back(std::move(message));
+        } else if (header.stream_op() == tinyrpc::STREAM_CREDIT) {
+            std::lock_guard<std::mutex> lock(mutex);
+            send_credit += header.credit();
+        } else {
+            return;
+        }
+        cond.notify_all();
+    }
+};
+
+ClientStream::ClientStream(RpcChannel *channel, const google::protobuf::MethodDescriptor *method, google::protobuf::RpcController *controller,
+                           const google::protobuf::Message &request)
+    : m_controller(controller)
+    , m_compression(Compressor::ForMethod(method))
+    , m_state(std::make_shared<State>())
+{
+    State &state = *m_state;
+    state.window = static_cast<uint32_t>(std::max<int64_t>(1, RpcConfig::Instance().LookupInt("rpc_stream_window", 16)));
+    state.send_credit = state.window;
+    state.prototype = google::protobuf::MessageFactory::generated_factory()->GetPrototype(method->output_type());
+    state.response.reset(state.prototype->New());
+
+    // 调用持有这些回调，回调中只能持有State的weak_ptr，否则State和调用会互相引用
+    std::weak_ptr<State> weak_state = m_state;
+    auto prepared = channel->Prepare(method, controller, &request, state.response.get(), [weak_state] {
+        if (auto state = weak_state.lock()) {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            state->finished = true;
+            state->cond.notify_all();
+        }
+    });
+    if (!prepared) {
+        // 调用在发送之前就失败了，上面的回调已经执行过
+        return;
+    }
+    prepared->request.header.set_credit(state.window);
+    prepared->request.call->on_stream = [weak_state](const tinyrpc::RpcResponseHeader &header, const char *body, size_t body_size) {
+        if (auto state = weak_state.lock()) {
+            state->OnFrame(header, body, body_size);
+        }
+    };
+    state.conn = prepared->conn;
+    state.call = prepared->request.call;
+    state.call_id = state.conn->Send(state.call, prepared->request.header, request, prepared->request.timeout);
+}
+
+ClientStream::~ClientStream()
+{
+    Cancel();
+    // 等待调用真正结束，之后调用不会再访问controller
+    std::unique_lock<std::mutex> lock(m_state->mutex);
+    m_state->cond.wait(lock, [this] { return m_state->finished; });
+}
+
+bool ClientStream::Read(google::protobuf::Message *message)
+{
+    std::unique_ptr<google::protobuf::Message> next;
+    uint32_t credit = 0;
+    {
+        std::unique_lock<std::mutex> lock(m_state->mutex);
+        // 服务端最后的响应在所有消息之后到达，调用结束时还没有被读取的消息仍然可以读出来
+        m_state->cond.wait(lock, [this] { return !m_state->messages.empty() || m_state->finished; });
+        if (m_state->messages.empty()) {
+            return false;
+        }
+        next = std::move(m_state->messages.front());
+        m_state->messages.pop_front();
+        if (++m_state->consumed >= CreditThreshold(m_state->window) && !m_state->finished) {
+            credit = m_state->consumed;
+            m_state->consumed = 0;
+        }
+    }
+    if (credit > 0) {
+        SendFrame(tinyrpc::STREAM_CREDIT, credit, nullptr);
+    }
+    message->GetReflection()->Swap(message, next.get());
+    return true;
+}
+
+bool ClientStream::Write(const google::protobuf::Message &message)
+{
+    {
+        std::unique_lock<std::mutex> lock(m_state->mutex);
+        m_state->cond.wait(lock, [this] { return m_state->send_credit > 0 || m_state->finished; });
+        if (m_state->finished) {
+            return false;
+        }
+        --m_state->send_credit;
+    }
+    SendFrame(tinyrpc::STREAM_MESSAGE, 0, &message);
+    return true;
+}
+
+void ClientStream::WritesDone()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_state->mutex);
+        if (m_state->finished) {
+            return;
+        }
+    }
+    SendFrame(tinyrpc::STREAM_HALF_CLOSE, 0, nullptr);
+}
+
+bool ClientStream::Finish(google::protobuf::Message *response)
+{
+    {
+        std::unique_lock<std::mutex> lock(m_state->mutex);
+        m_state->cond.wait(lock, [this] { return m_state->finished; });
+    }
+    if (m_controller->Failed()) {
+        return false;
+    }
+    if (response) {
+        response->GetReflection()->Swap(response, m_state->response.get());
+    }
+    return true;
+}
+
+void ClientStream::Cancel()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_state->mutex);
+        if (m_state->finished) {
+            return;
+        }
+    }
+    SendFrame(tinyrpc::STREAM_CANCEL, 0, nullptr);
+    // 和同步调用的取消一样：放弃成功时由这里结束调用，否则调用正在结束，等它自己结束
+    if (m_state->conn->Abandon(m_state->call_id)) {
+        m_controller->SetFailed("stream canceled");
+        m_state->call->on_complete();
+    }
+}
+
+void ClientStream::SendFrame(tinyrpc::StreamOp op, uint32_t credit, const google::protobuf::Message *message)
+{
+    tinyrpc::RpcHeader header;
+    header.set_call_id(m_state->call_id);
+    header.set_stream_op(op);
+    header.set_credit(credit);
+    if (message) {
+        header.set_args_size(message->ByteSizeLong()); // 同时缓存了message的序列化长度
+        header.set_compression(m_compression);
+    }
+    m_state->conn->SendStreamFrame(header, message);
+}
+
+ServerStream *ServerStream::From(google::protobuf::RpcController *controller)
+{
+    auto *meha_controller = dynamic_cast<RpcController *>(controller);
+    return meha_controller ? meha_controller->Stream() : nullptr;
+}
+
+ServerStream::ServerStream(uint64_t call_id, const google::protobuf::Message *request_prototype, uint32_t window, tinyrpc::Compression compression,
+                           std::optional<std::chrono::steady_clock::time_point> deadline, SendFunc send)
+    : m_call_id(call_id)
+    , m_request_prototype(request_prototype)
+    , m_window(window)
+    , m_compression(compression)
+    , m_deadline(deadline)
+    , m_send(std::move(send))
+    , m_send_credit(window)
+    , m_recv_credit(window)
+{
+}
+
+bool ServerStream::Write(const google::protobuf::Message &message)
+{
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (!WaitLocked(lock, [this] { return m_send_credit > 0 || m_closed; }) || m_closed) {
+            return false;
+        }
+        --m_send_credit;
+    }
+    tinyrpc::RpcResponseHeader header;
+    header.set_call_id(m_call_id);
+    header.set_stream_op(tinyrpc::STREAM_MESSAGE);
+    header.set_body_size(message.ByteSizeLong()); // 同时缓存了message的序列化长度
+    header.set_compression(m_compression);
+    std::string frame;
+    if (!codec::AppendCompressedFrame(header, message, &frame)) {
+        LOG(ERROR) << "serialize stream message error!";
+        return false;
+    }
+    m_send(std::move(frame));
+    return true;
+}
+
+bool ServerStream::Read(google::protobuf::Message *message)
+{
+    std::unique_ptr<google::protobuf::Message> next;
+    uint32_t credit = 0;
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (!WaitLocked(lock, [this] { return !m_messages.empty() || m_half_closed || m_closed; }) || m_closed || m_messages.empty()) {
+            return false;
+        }
+        next = std::move(m_messages.front());
+        m_messages.pop_front();
+        if (++m_consumed >= CreditThreshold(m_window) && !m_half_closed) {
+            credit = m_consumed;
+            m_recv_credit += m_consumed;
+            m_consumed = 0;
+        }
+    }
+    if (credit > 0) {
+        tinyrpc::RpcResponseHeader header;
+        header.set_call_id(m_call_id);
+        header.set_stream_op(tinyrpc::STREAM_CREDIT);
+        header.set_credit(credit);
+        std::string frame;
+        if (codec::AppendFrame(header, std::string(), &frame)) {
+            m_send(std::move(frame));
+        }
+    }
+    message->GetReflection()->Swap(message, next.get());
+    return true;
+}
+
+bool ServerStream::IsCanceled() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_closed;
+}
+
+void ServerStream::OnFrame(const tinyrpc::RpcHeader &header, const char *body, size_t body_size)
+{
+    switch (header.stream_op()) {
+    case tinyrpc::STREAM_MESSAGE: {
+        std::unique_ptr<google::protobuf::Message> message(m_request_prototype->New());
+        bool parsed = codec::ParseBody(header, body, body_size, message.get());
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!parsed || m_recv_credit == 0) {
+            // 消息无法解析，或者客户端不遵守流控，调用没法再正确地进行下去
+            LOG(ERROR) << "call " << m_call_id << (parsed ? " stream message exceeds credit" : " parse stream message error");
+            m_closed = true;
+            break;
+        }
+        --m_recv_credit;
+        m_messages.push_back(std::move(message));
+        break;
+    }
+    case tinyrpc::STREAM_CREDIT: {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_send_credit += header.credit();
+        break;
+    }
+    case tinyrpc::STREAM_HALF_CLOSE: {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_half_closed = true;
+        break;
+    }
+    case tinyrpc::STREAM_CANCEL:
+        Close();
+        return;
+    default:
+        return;
+    }
+    m_cond.notify_all();
+}
+
+void ServerStream::Close()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_closed = true;
+    }
+    m_cond.notify_all();
+}
+
+bool ServerStream::WaitLocked(std::unique_lock<std::mutex> &lock, const std::function<bool()> &ready)
+{
+    if (!m_deadline) {
+        m_cond.wait(lock, ready);
+        return true;
+    }
+    return m_cond.wait_until(lock, *m_deadline, ready);
+}
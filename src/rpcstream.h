@@ -0,0 +1,135 @@
+#pragma once
+
+#include "tinyrpcheader.pb.h"
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/message.h>
+#include <google/protobuf/service.h>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+
+namespace meha
+{
+
+class RpcChannel;
+
+/**
+ * @brief 流式调用的客户端
+ * @details 流式方法在proto中用(tinyrpc.server_streaming)或(tinyrpc.client_streaming)标记（见tinyrpcoptions.proto），
+ * protobuf生成的Stub不支持流式调用，需要通过这个类调用。构造时发送开始调用的请求，之后：
+ * 服务端流：循环Read直到返回false，再通过Finish取得调用的结果；
+ * 客户端流：多次Write之后调用WritesDone，再通过Finish等待服务端最后的响应。
+ * 流控基于额度：接收方先授予对方一个窗口的额度，每处理完半个窗口的消息再归还额度，发送方没有额度时阻塞，
+ * 所以两端缓存的消息都不会超过一个窗口。窗口大小由配置项rpc_stream_window决定（默认16条消息）。
+ * 整个流式调用受controller上的截止时间（或者rpcclient_timeout_ms）限制，持续时间长的流需要设置足够的截止时间。
+ * 这些方法都可能阻塞，不能在客户端IO线程（例如异步调用的done）中调用。
+ */
+class ClientStream
+{
+public:
+    ClientStream(RpcChannel *channel, const google::protobuf::MethodDescriptor *method, google::protobuf::RpcController *controller,
+                 const google::protobuf::Message &request);
+    // 调用还没有结束时先取消调用，再等待调用结束
+    ~ClientStream();
+
+    /**
+     * @brief 阻塞读取服务端发送的下一条消息
+     * @param message 类型需要和方法的响应类型相同
+     * @return false 流已经结束（服务端发送完毕、调用失败或者被取消），之后通过Finish取得调用的结果
+     */
+    bool Read(google::protobuf::Message *message);
+    /**
+     * @brief 等待服务端授予额度后发送一条消息
+     * @param message 类型需要和方法的请求类型相同
+     * @return false 调用已经结束，消息没有发送
+     */
+    bool Write(const google::protobuf::Message &message);
+    // 客户端已经发送完流中的所有消息，服务端的Read随后返回false
+    void WritesDone();
+    /**
+     * @brief 等待调用结束
+     * @param response 不为nullptr时，调用成功后把服务端最后的响应交换到这里
+     * @return false 调用失败，失败原因在controller上
+     */
+    bool Finish(google::protobuf::Message *response = nullptr);
+    // 放弃调用，服务端之后发送的消息都会被丢弃，调用以失败结束
+    void Cancel();
+
+private:
+    struct State; // 和客户端IO线程共享的状态，定义在rpcstream.cc中
+
+    // 在调用上发送一个流式帧
+    void SendFrame(tinyrpc::StreamOp op, uint32_t credit, const google::protobuf::Message *message);
+
+    google::protobuf::RpcController *m_controller;
+    tinyrpc::Compression m_compression; // 客户端发送的消息使用的压缩算法
+    std::shared_ptr<State> m_state;
+};
+
+/**
+ * @brief 流式调用的服务端
+ * @details 服务端执行流式方法时，通过ServerStream::From(controller)取得这次调用的消息流：
+ * 服务端流式方法用Write逐条发送消息，发送完之后照常执行done->Run()结束调用，done发送的响应是调用最后的响应；
+ * 客户端流式方法用Read逐条读取客户端发送的消息，方法的request参数是开始调用时的请求。
+ * Write在客户端没有授予额度时阻塞，Read在没有消息时阻塞，所以流式方法总是在单独的流式线程池中执行，
+ * 不受rpcserver_dispatch的影响。同时进行的流不超过rpcserver_stream_threads，超过时以RPC_OVERLOADED拒绝，
+ * rpcserver_stream_threads为0时流式方法不可用。
+ * 消息流由RpcProvider创建，在调用结束（done->Run()）之后失效。
+ */
+class ServerStream
+{
+public:
+    // controller所属调用的消息流，不是流式方法时返回nullptr
+    static ServerStream *From(google::protobuf::RpcController *controller);
+
+    // 等待客户端授予额度后发送一条消息，客户端取消了调用、连接断开或者超过截止时间时返回false，此时方法应该尽快结束
+    bool Write(const google::protobuf::Message &message);
+    // 阻塞读取客户端发送的下一条消息，客户端已经发送完毕、取消了调用、连接断开或者超过截止时间时返回false
+    bool Read(google::protobuf::Message *message);
+    // 客户端已经取消了调用，或者连接已经断开
+    bool IsCanceled() const;
+
+private:
+    friend class RpcProvider;
+    friend class StreamSelfCheck; // 自检程序直接构造消息流，检查额度的计算，见check/rpcselfcheck.cc
+    using SendFunc = std::function<void(std::string)>;
+
+    /**
+     * @param request_prototype 客户端发送的消息的类型
+     * @param window 开始调用的请求中带来的初始额度，双方使用相同的窗口
+     * @param send 在连接所属的IO线程中发送一帧
+     */
+    ServerStream(uint64_t call_id, const google::protobuf::Message *request_prototype, uint32_t window, tinyrpc::Compression compression,
+                 std::optional<std::chrono::steady_clock::time_point> deadline, SendFunc send);
+
+    // 收到客户端在这个调用上发送的流式帧，在IO线程中执行
+    void OnFrame(const tinyrpc::RpcHeader &header, const char *body, size_t body_size);
+    // 连接断开或者调用已经结束，唤醒阻塞中的Write和Read
+    void Close();
+    // 等待ready成立，超过截止时间时返回false
+    bool WaitLocked(std::unique_lock<std::mutex> &lock, const std::function<bool()> &ready);
+
+    uint64_t m_call_id;
+    const google::protobuf::Message *m_request_prototype;
+    uint32_t m_window;
+    tinyrpc::Compression m_compression;
+    std::optional<std::chrono::steady_clock::time_point> m_deadline;
+    SendFunc m_send;
+
+    mutable std::mutex m_mutex; // 保护下面的成员
+    std::condition_variable m_cond;
+    uint32_t m_send_credit; // 还可以发送的消息数
+    uint32_t m_recv_credit; // 已经授予客户端、还没有用掉的额度，客户端超出额度发送的消息是协议错误
+    uint32_t m_consumed = 0; // 已经读取、还没有归还额度的消息数
+    std::deque<std::unique_ptr<google::protobuf::Message>> m_messages; // 收到了还没有被Read读取的消息
+    bool m_half_closed = false;
+    bool m_closed = false;
+};
+
+}
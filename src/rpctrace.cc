@@ -0,0 +1,10 @@
+#include "rpctrace.h"
+#include "rpcconfig.h"
+
+using namespace meha;
+
+void RpcTrace::Configure()
+{
+    int64_t rate = RpcConfig::Instance().LookupInt("rpc_trace_sample", 0);
+    SetSampleRate(rate > 0 ? static_cast<uint32_t>(rate) : 0);
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <glog/logging.h>
+
+namespace meha
+{
+
+/**
+ * @brief 调用级别的详细日志的开关
+ * @details 每次调用都打印的日志（收到请求、发出响应、选中的服务实例等）对于小消息来说比RPC本身还要昂贵，
+ * 所以这类日志都通过RPC_TRACE打印：
+ * 编译时定义TINYRPC_DISABLE_TRACE（CMake选项TINYRPC_ENABLE_TRACE=OFF）时完全编译掉；
+ * 否则由配置项rpc_trace_sample控制：0（默认）不打印，只需要一次relaxed的原子读；1每次都打印；N每N次打印一次。
+ */
+class RpcTrace
+{
+public:
+    // 从RpcConfig中读取rpc_trace_sample，RpcProvider和RpcChannel创建时调用
+    static void Configure();
+    static void SetSampleRate(uint32_t rate) { s_sample_rate.store(rate, std::memory_order_relaxed); }
+
+    // 这一次是否需要打印。一次调用只判断一次，调用上的各条日志要么都打印要么都不打印
+    static bool ShouldTrace()
+    {
+        uint32_t rate = s_sample_rate.load(std::memory_order_relaxed);
+        if (rate <= 1) {
+            return rate == 1;
+        }
+        thread_local uint32_t count = 0;
+        return ++count % rate == 0;
+    }
+
+private:
+    static inline std::atomic<uint32_t> s_sample_rate = 0;
+};
+
+}
+
+#ifdef TINYRPC_DISABLE_TRACE
+#define RPC_TRACE_IF(cond) LOG_IF(INFO, false)
+#else
+#define RPC_TRACE_IF(cond) LOG_IF(INFO, cond)
+#endif
+
+// 按采样率打印一条调用级别的日志
+#define RPC_TRACE RPC_TRACE_IF(::meha::RpcTrace::ShouldTrace())
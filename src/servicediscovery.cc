@@ -0,0 +1,90 @@
+#include "servicediscovery.h"
+#include <glog/logging.h>
+
+using namespace meha;
+
+ServiceDiscovery &ServiceDiscovery::Instance()
+{
+    static ServiceDiscovery discovery;
+    return discovery;
+}
+
+ServiceDiscovery::ServiceDiscovery()
+    : m_registry(ServiceRegistry::Create())
+    , m_cache(std::make_shared<const Cache>())
+{
+    m_registry->SetChangeCallback(std::bind(&ServiceDiscovery::OnChange, this, std::placeholders::_1));
+}
+
+EndpointList ServiceDiscovery::Resolve(const std::string &service_name)
+{
+    // 绝大多数情况下直接命中缓存
+    {
+        const Cache &cache = m_cache.Local();
+        auto it = cache.find(service_name);
+        if (it != cache.end()) {
+            return it->second;
+        }
+    }
+
+    // 缓存未命中，串行化对注册中心的查询，避免同一个服务被多个线程重复查询
+    std::lock_guard<std::mutex> lock(m_lookup_mutex);
+    uint64_t generation;
+    {
+        // 在同一把锁内读取缓存和generation，之后的失效一定会让generation变化
+        std::lock_guard<std::mutex> update_lock(m_update_mutex);
+        auto cache = m_cache.Load();
+        auto it = cache->find(service_name);
+        if (it != cache->end()) {
+            return it->second;
+        }
+        generation = m_generation;
+    }
+
+    auto found = m_registry->Lookup(service_name);
+    if (!found) {
+        return nullptr;
+    }
+    if (found->empty()) {
+        LOG(ERROR) << service_name + " has no instance!";
+        return nullptr;
+    }
+    auto endpoints = std::make_shared<const std::vector<Endpoint>>(std::move(*found));
+    std::lock_guard<std::mutex> update_lock(m_update_mutex);
+    if (generation == m_generation) {
+        auto cache = std::make_shared<Cache>(*m_cache.Load());
+        (*cache)[service_name] = endpoints;
+        m_cache.Store(std::move(cache));
+    }
+    return endpoints;
+}
+
+void ServiceDiscovery::OnChange(const std::string &service_name)
+{
+    if (service_name.empty()) {
+        LOG(WARNING) << "registry reset, drop discovery cache";
+        InvalidateAll();
+    } else {
+        LOG(INFO) << "service " << service_name << " changed, invalidate cache";
+        Invalidate(service_name);
+    }
+}
+
+void ServiceDiscovery::Invalidate(const std::string &service_name)
+{
+    std::lock_guard<std::mutex> lock(m_update_mutex);
+    ++m_generation;
+    auto current = m_cache.Load();
+    if (current->count(service_name)) {
+        auto cache = std::make_shared<Cache>(*current);
+        cache->erase(service_name);
+        m_cache.Store(std::move(cache));
+    }
+}
+
+void ServiceDiscovery::InvalidateAll()
+{
+    std::lock_guard<std::mutex> lock(m_update_mutex);
+    ++m_generation;
+    m_cache.Store(std::make_shared<const Cache>());
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "endpoint.h"
+#include "serviceregistry.h"
+#include "snapshot.h"
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace meha
+{
+
+// 一个服务的所有实例地址，发布之后不再修改，可以在多个线程之间共享
+using EndpointList = std::shared_ptr<const std::vector<Endpoint>>;
+
+/**
+ * @brief 进程级的服务发现缓存
+ * @details 实例列表从配置项rpc_registry选择的ServiceRegistry中查询，查询过的服务实例列表缓存在内存中，
+ * RPC调用时直接命中缓存，不再需要每次调用都访问注册中心。缓存的正确性由注册中心的变化通知保证：
+ * 服务的实例上线或下线时让该服务的表项失效，失效的表项在下次查询时重新从注册中心读取。
+ */
+class ServiceDiscovery
+{
+public:
+    static ServiceDiscovery &Instance();
+
+    /**
+     * @brief 查询服务的所有实例地址，线程安全
+     * @param service_name 服务名
+     * @return EndpointList 服务不存在、没有实例或者注册中心查询失败时返回nullptr
+     */
+    EndpointList Resolve(const std::string &service_name);
+
+private:
+    ServiceDiscovery();
+    ServiceDiscovery(const ServiceDiscovery &) = delete;
+    ServiceDiscovery &operator=(const ServiceDiscovery &) = delete;
+
+    // 注册中心的变化通知，可能在注册中心的后台线程中执行
+    void OnChange(const std::string &service_name);
+    // 使缓存失效
+    void Invalidate(const std::string &service_name);
+    void InvalidateAll();
+
+    using Cache = std::unordered_map<std::string, EndpointList>; // 服务名 -> 实例地址
+
+    std::mutex m_lookup_mutex; // 串行化缓存未命中时的查询
+    std::unique_ptr<ServiceRegistry> m_registry;
+
+    // 命中缓存时从调用线程缓存的快照中查找，不需要加锁。修改缓存时复制出一份新的再整体替换
+    Snapshot<Cache> m_cache;
+    std::mutex m_update_mutex; // 串行化缓存的修改，保护m_generation
+    // 每次缓存失效时加一。查询注册中心期间缓存被失效过的话，查询结果可能已经过时，不能放入缓存
+    uint64_t m_generation = 0;
+};
+
+}
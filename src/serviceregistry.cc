@@ -0,0 +1,242 @@
+#include "serviceregistry.h"
+#include "rpcconfig.h"
+#include "zkregistry.h"
+#include <atomic>
+#include <fstream>
+#include <glog/logging.h>
+#include <mutex>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+
+using namespace meha;
+
+namespace
+{
+
+std::string Trim(const std::string &str)
+{
+    auto begin = str.find_first_not_of(" \t\r\n");
+    if (begin == std::string::npos) {
+        return "";
+    }
+    auto end = str.find_last_not_of(" \t\r\n");
+    return str.substr(begin, end - begin + 1);
+}
+
+// 解析"ip:port,ip:port"格式的实例列表，忽略不合法的地址
+std::vector<Endpoint> ParseEndpoints(const std::string &service_name, const std::string &value)
+{
+    std::vector<Endpoint> endpoints;
+    size_t begin = 0;
+    while (begin <= value.size()) {
+        size_t end = value.find(',', begin);
+        if (end == std::string::npos) {
+            end = value.size();
+        }
+        std::string item = Trim(value.substr(begin, end - begin));
+        if (!item.empty()) {
+            if (auto endpoint = Endpoint::Parse(item)) {
+                endpoints.push_back(*endpoint);
+            } else {
+                LOG(ERROR) << service_name << " address " << item << " is invalid!";
+            }
+        }
+        begin = end + 1;
+    }
+    return endpoints;
+}
+
+/**
+ * @brief 实例地址写在配置项rpc_registry_static.<服务名>中的注册中心
+ */
+class StaticRegistry : public ServiceRegistry
+{
+public:
+    bool Register(const std::string &service_name, const Endpoint &endpoint, std::function<void()> on_removed) override
+    {
+        LOG(INFO) << service_name << " at " << endpoint.ToString() << " uses static registry, skip register";
+        return true;
+    }
+
+    std::optional<std::vector<Endpoint>> Lookup(const std::string &service_name) override
+    {
+        auto value = RpcConfig::Instance().Lookup("rpc_registry_static." + service_name);
+        if (!value) {
+            LOG(ERROR) << "rpc_registry_static." << service_name << " is not configured!";
+            return std::nullopt;
+        }
+        return ParseEndpoints(service_name, *value);
+    }
+
+    // 实例地址不会变化
+    void SetChangeCallback(ChangeCallback cb) override {}
+};
+
+/**
+ * @brief 实例地址写在文件中的注册中心，文件修改后自动重新加载
+ * 文件每行为"服务名=ip:port,ip:port"，以#开头的行为注释
+ */
+class FileRegistry : public ServiceRegistry
+{
+public:
+    explicit FileRegistry(const std::string &path)
+        : m_path(path)
+    {
+        Reload();
+        // 监视文件所在的目录而不是文件本身，编辑器和配置下发工具通常是写临时文件再rename过来的
+        auto slash = m_path.rfind('/');
+        m_dir = slash == std::string::npos ? "." : (slash == 0 ? "/" : m_path.substr(0, slash));
+        m_name = slash == std::string::npos ? m_path : m_path.substr(slash + 1);
+        m_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (m_inotify_fd < 0 || inotify_add_watch(m_inotify_fd, m_dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE) < 0) {
+            LOG(ERROR) << "watch registry file " << m_path << " error: " << google::StrError(errno);
+            return;
+        }
+        m_thread = std::thread(&FileRegistry::WatchLoop, this);
+    }
+
+    ~FileRegistry() override
+    {
+        m_stop = true;
+        if (m_thread.joinable()) {
+            m_thread.join();
+        }
+        if (m_inotify_fd >= 0) {
+            ::close(m_inotify_fd);
+        }
+    }
+
+    bool Register(const std::string &service_name, const Endpoint &endpoint, std::function<void()> on_removed) override
+    {
+        LOG(INFO) << service_name << " at " << endpoint.ToString() << " uses file registry, skip register";
+        return true;
+    }
+
+    std::optional<std::vector<Endpoint>> Lookup(const std::string &service_name) override
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_services.find(service_name);
+        if (it == m_services.end()) {
+            LOG(ERROR) << service_name << " is not in registry file " << m_path;
+            return std::nullopt;
+        }
+        return it->second;
+    }
+
+    void SetChangeCallback(ChangeCallback cb) override
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_on_change = std::move(cb);
+    }
+
+private:
+    // 重新读取文件，通知发生了变化的服务
+    void Reload()
+    {
+        std::ifstream file(m_path);
+        if (!file) {
+            LOG(ERROR) << "open registry file " << m_path << " error!";
+            return;
+        }
+        std::unordered_map<std::string, std::vector<Endpoint>> services;
+        std::string line;
+        while (std::getline(file, line)) {
+            line = Trim(line);
+            if (line.empty() || line[0] == '#') {
+                continue;
+            }
+            auto index = line.find('=');
+            if (index == std::string::npos) {
+                continue;
+            }
+            std::string service_name = Trim(line.substr(0, index));
+            services[service_name] = ParseEndpoints(service_name, line.substr(index + 1));
+        }
+
+        std::vector<std::string> changed;
+        ChangeCallback on_change;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            for (auto &[name, endpoints] : services) {
+                auto it = m_services.find(name);
+                if (it == m_services.end() || it->second != endpoints) {
+                    changed.push_back(name);
+                }
+            }
+            for (auto &[name, endpoints] : m_services) {
+                if (!services.contains(name)) {
+                    changed.push_back(name);
+                }
+            }
+            m_services.swap(services);
+            on_change = m_on_change;
+        }
+        LOG(INFO) << "registry file " << m_path << " loaded, " << changed.size() << " services changed";
+        if (on_change) {
+            for (auto &name : changed) {
+                on_change(name);
+            }
+        }
+    }
+
+    void WatchLoop()
+    {
+        alignas(struct inotify_event) char buf[4096];
+        while (!m_stop) {
+            struct pollfd pfd = {m_inotify_fd, POLLIN, 0};
+            // 定时醒来检查是否需要退出
+            if (::poll(&pfd, 1, 500) <= 0) {
+                continue;
+            }
+            bool touched = false;
+            ssize_t n;
+            while ((n = ::read(m_inotify_fd, buf, sizeof(buf))) > 0) {
+                for (char *p = buf; p < buf + n;) {
+                    auto *event = reinterpret_cast<struct inotify_event *>(p);
+                    if (event->len > 0 && m_name == event->name) {
+                        touched = true;
+                    }
+                    p += sizeof(struct inotify_event) + event->len;
+                }
+            }
+            if (touched) {
+                Reload();
+            }
+        }
+    }
+
+    std::string m_path;
+    std::string m_dir;
+    std::string m_name;
+    std::mutex m_mutex; // 保护m_services和m_on_change
+    std::unordered_map<std::string, std::vector<Endpoint>> m_services;
+    ChangeCallback m_on_change;
+    int m_inotify_fd = -1;
+    std::atomic<bool> m_stop = false;
+    std::thread m_thread;
+};
+
+}
+
+std::unique_ptr<ServiceRegistry> ServiceRegistry::Create()
+{
+    std::string type = RpcConfig::Instance().Lookup("rpc_registry").value_or("zookeeper");
+    if (type == "static" || type == "none") {
+        return std::make_unique<StaticRegistry>();
+    }
+    if (type == "file") {
+        auto path = RpcConfig::Instance().Lookup("rpc_registry_file");
+        if (!path) {
+            LOG(ERROR) << "rpc_registry_file is not configured, use static registry";
+            return std::make_unique<StaticRegistry>();
+        }
+        return std::make_unique<FileRegistry>(*path);
+    }
+    if (type != "zookeeper") {
+        LOG(WARNING) << "unknown registry " << type << ", use zookeeper";
+    }
+    return std::make_unique<ZkRegistry>();
+}
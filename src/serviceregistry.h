@@ -0,0 +1,53 @@
+#pragma once
+
+#include "endpoint.h"
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace meha
+{
+
+/**
+ * @brief 服务注册中心的抽象
+ * @details RpcProvider通过它发布服务实例，ServiceDiscovery通过它查询服务实例。由配置项rpc_registry选择实现：
+ * zookeeper（默认）：实例注册为zk上的临时顺序节点，通过watch通知实例变化；
+ * static：实例地址写在配置项rpc_registry_static.<服务名>=ip:port,ip:port中，不会变化；
+ * file：实例地址写在rpc_registry_file指定的文件中，每行一个服务，格式同static，文件修改后通过inotify自动重新加载，
+ * 适合由sidecar维护实例列表的部署方式。
+ * static和file只负责查询，服务端的Register是空操作。
+ */
+class ServiceRegistry
+{
+public:
+    // 服务的实例列表发生了变化，service_name为空时表示所有服务都可能变化了
+    using ChangeCallback = std::function<void(const std::string &service_name)>;
+
+    virtual ~ServiceRegistry() = default;
+
+    /**
+     * @brief 发布一个服务实例，服务端调用
+     * @param on_removed 实例被从注册中心摘除（例如被运维手动删除）时的回调
+     * @return false 发布失败
+     */
+    virtual bool Register(const std::string &service_name, const Endpoint &endpoint, std::function<void()> on_removed = nullptr) = 0;
+    /**
+     * @brief 摘除本进程发布的服务实例，服务端停止之前调用，让客户端不再发现这个实例
+     * 主动摘除不会触发Register时的on_removed。默认是空操作，适用于只负责查询的注册中心
+     */
+    virtual void Unregister(const std::string &service_name) {}
+    /**
+     * @brief 查询服务的所有实例，客户端调用，可能会访问网络
+     * @return std::nullopt 服务不存在或者查询失败
+     */
+    virtual std::optional<std::vector<Endpoint>> Lookup(const std::string &service_name) = 0;
+    // 设置实例列表变化的通知，需要在Lookup之前设置
+    virtual void SetChangeCallback(ChangeCallback cb) = 0;
+
+    // 按配置项rpc_registry创建注册中心
+    static std::unique_ptr<ServiceRegistry> Create();
+};
+
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+namespace meha
+{
+
+/**
+ * @brief 读多写少的共享数据的快照
+ * @details 写入方复制出一份新数据，修改好之后通过Store整体替换，发布之后的数据不再修改；读取方取得的快照在使用期间一直有效，
+ * 即使之后被替换，已经取得的快照也要等最后一个使用者放下之后才释放。
+ * Load每次都从原子的shared_ptr中取得快照，会增减引用计数。热路径上使用Local：每个线程缓存一份快照，
+ * 只在版本号变化时才重新Load，平时只读一次很少被写的版本号，多个线程之间没有写共享的缓存行。
+ * 代价是线程缓存的旧快照要等该线程下次调用Local（或者线程退出）时才释放。
+ * Store不是并发安全的，多个写入方需要自行串行化（复制-修改-替换本身也需要）。
+ */
+template <typename T>
+class Snapshot
+{
+public:
+    explicit Snapshot(std::shared_ptr<const T> value)
+    {
+        Store(std::move(value));
+    }
+    Snapshot(const Snapshot &) = delete;
+    Snapshot &operator=(const Snapshot &) = delete;
+
+    // 取得当前的快照
+    std::shared_ptr<const T> Load() const
+    {
+        return m_value.load();
+    }
+
+    // 替换为新的快照，之后的Load和Local都会取得新的快照
+    void Store(std::shared_ptr<const T> value)
+    {
+        m_value.store(std::move(value));
+        // 先发布数据再发布版本号，看到新版本号的线程一定能Load到新数据
+        m_version.store(NextVersion(), std::memory_order_release);
+    }
+
+    /**
+     * @brief 取得当前线程缓存的快照
+     * @return const T& 在当前线程下次对同类型的Snapshot调用Local之前有效，需要跨越这个范围时拷贝出需要的shared_ptr
+     */
+    const T &Local() const
+    {
+        // 每个线程每种类型一项缓存。版本号在同类型的所有Snapshot之间唯一，交替读取多个Snapshot也不会取错，只是会重新Load
+        thread_local Cached cached;
+        uint64_t version = m_version.load(std::memory_order_acquire);
+        if (cached.version != version) {
+            cached.value = m_value.load();
+            cached.version = version;
+        }
+        return *cached.value;
+    }
+
+private:
+    struct Cached
+    {
+        uint64_t version = 0; // 0不会被分配，第一次调用Local时总是Load
+        std::shared_ptr<const T> value;
+    };
+
+    static uint64_t NextVersion()
+    {
+        static std::atomic<uint64_t> next_version{0};
+        return next_version.fetch_add(1, std::memory_order_relaxed) + 1;
+    }
+
+    std::atomic<std::shared_ptr<const T>> m_value;
+    std::atomic<uint64_t> m_version{0};
+};
+
+}
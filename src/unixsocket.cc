@@ -0,0 +1,181 @@
+#include "unixsocket.h"
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstring>
+#include <glog/logging.h>
+#include <ifaddrs.h>
+#include <muduo/net/InetAddress.h>
+#include <muduo/net/TcpConnection.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <unordered_set>
+
+using namespace meha;
+
+namespace
+{
+
+bool MakeAddress(const std::string &path, sockaddr_un *addr)
+{
+    if (path.empty() || path.size() >= sizeof(addr->sun_path)) {
+        LOG(ERROR) << "invalid unix socket path: " << path;
+        return false;
+    }
+    std::memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    std::memcpy(addr->sun_path, path.c_str(), path.size());
+    return true;
+}
+
+}
+
+UnixServer::UnixServer(muduo::net::EventLoop *loop, const std::string &path, std::shared_ptr<muduo::net::EventLoopThreadPool> pool)
+    : m_loop(loop)
+    , m_path(path)
+    , m_pool(std::move(pool))
+    , m_listen_fd(-1)
+    , m_inode(0)
+    , m_next_conn_id(0)
+{
+}
+
+UnixServer::~UnixServer()
+{
+    StopAccepting();
+    // 和TcpServer析构时一样，在各自的IO线程中销毁剩下的连接
+    for (auto &item : m_connections) {
+        muduo::net::TcpConnectionPtr conn = item.second;
+        conn->getLoop()->runInLoop([conn] { conn->connectDestroyed(); });
+    }
+}
+
+bool UnixServer::Start()
+{
+    sockaddr_un addr;
+    if (!MakeAddress(m_path, &addr)) {
+        return false;
+    }
+    m_listen_fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (m_listen_fd < 0) {
+        LOG(ERROR) << "create unix socket error: " << std::strerror(errno);
+        return false;
+    }
+    ::unlink(m_path.c_str());
+    if (::bind(m_listen_fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0 || ::listen(m_listen_fd, SOMAXCONN) < 0) {
+        LOG(ERROR) << "listen on unix socket " << m_path << " error: " << std::strerror(errno);
+        ::close(m_listen_fd);
+        m_listen_fd = -1;
+        return false;
+    }
+    struct stat st;
+    if (::stat(m_path.c_str(), &st) == 0) {
+        m_inode = st.st_ino;
+    }
+    m_channel = std::make_unique<muduo::net::Channel>(m_loop, m_listen_fd);
+    m_channel->setReadCallback([this](muduo::Timestamp) { OnAccept(); });
+    m_loop->runInLoop([this] { m_channel->enableReading(); });
+    return true;
+}
+
+void UnixServer::StopAccepting()
+{
+    if (m_channel) {
+        m_channel->disableAll();
+        m_channel->remove();
+        m_channel.reset();
+    }
+    if (m_listen_fd < 0) {
+        return;
+    }
+    ::close(m_listen_fd);
+    m_listen_fd = -1;
+    struct stat st;
+    if (::stat(m_path.c_str(), &st) == 0 && st.st_ino == m_inode) {
+        ::unlink(m_path.c_str());
+    }
+}
+
+void UnixServer::OnAccept()
+{
+    while (true) {
+        int fd = ::accept4(m_listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                LOG(ERROR) << "accept on unix socket " << m_path << " error: " << std::strerror(errno);
+            }
+            return;
+        }
+        // Unix域套接字没有ip和端口，连接的本端和对端地址都留空
+        std::string name = m_path + "#" + std::to_string(++m_next_conn_id);
+        muduo::net::EventLoop *io_loop = m_pool->getNextLoop();
+        auto conn = std::make_shared<muduo::net::TcpConnection>(io_loop, name, fd, muduo::net::InetAddress(), muduo::net::InetAddress());
+        m_connections[name] = conn;
+        conn->setConnectionCallback(m_connection_callback);
+        conn->setMessageCallback(m_message_callback);
+        conn->setCloseCallback([this](const muduo::net::TcpConnectionPtr &conn) {
+            m_loop->runInLoop([this, conn] { RemoveConnection(conn); });
+        });
+        io_loop->runInLoop([conn] { conn->connectEstablished(); });
+    }
+}
+
+void UnixServer::RemoveConnection(const muduo::net::TcpConnectionPtr &conn)
+{
+    m_connections.erase(conn->name());
+    conn->getLoop()->queueInLoop([conn] { conn->connectDestroyed(); });
+}
+
+muduo::net::TcpConnectionPtr meha::ConnectUnix(muduo::net::EventLoop *loop, const std::string &path, const std::string &name)
+{
+    sockaddr_un addr;
+    if (!MakeAddress(path, &addr)) {
+        return nullptr;
+    }
+    int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        LOG(ERROR) << "create unix socket error: " << std::strerror(errno);
+        return nullptr;
+    }
+    // 对端在监听时Unix域套接字的connect立即完成；监听队列满时返回EAGAIN，和其他错误一样按连接失败处理
+    if (::connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0) {
+        LOG(WARNING) << "connect unix socket " << path << " error: " << std::strerror(errno);
+        ::close(fd);
+        return nullptr;
+    }
+    return std::make_shared<muduo::net::TcpConnection>(loop, name, fd, muduo::net::InetAddress(), muduo::net::InetAddress());
+}
+
+bool meha::IsLocalAddress(const std::string &ip)
+{
+    static const std::unordered_set<std::string> local_addresses = [] {
+        std::unordered_set<std::string> addresses{"localhost", "::1"};
+        ifaddrs *ifs = nullptr;
+        if (::getifaddrs(&ifs) < 0) {
+            LOG(ERROR) << "getifaddrs error: " << std::strerror(errno);
+            return addresses;
+        }
+        for (ifaddrs *it = ifs; it; it = it->ifa_next) {
+            if (!it->ifa_addr) {
+                continue;
+            }
+            char buf[INET6_ADDRSTRLEN] = {};
+            if (it->ifa_addr->sa_family == AF_INET) {
+                ::inet_ntop(AF_INET, &reinterpret_cast<sockaddr_in *>(it->ifa_addr)->sin_addr, buf, sizeof(buf));
+            } else if (it->ifa_addr->sa_family == AF_INET6) {
+                ::inet_ntop(AF_INET6, &reinterpret_cast<sockaddr_in6 *>(it->ifa_addr)->sin6_addr, buf, sizeof(buf));
+            } else {
+                continue;
+            }
+            addresses.insert(buf);
+        }
+        ::freeifaddrs(ifs);
+        return addresses;
+    }();
+    // 整个127.0.0.0/8都是回环地址
+    return ip.starts_with("127.") || local_addresses.count(ip) > 0;
+}
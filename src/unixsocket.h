@@ -0,0 +1,71 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <muduo/net/Callbacks.h>
+#include <muduo/net/Channel.h>
+#include <muduo/net/EventLoop.h>
+#include <muduo/net/EventLoopThreadPool.h>
+#include <string>
+#include <sys/types.h>
+#include <unordered_map>
+
+namespace meha
+{
+
+/**
+ * @brief 监听Unix域套接字的服务端，和同一个进程中的TcpServer共用IO线程
+ * @details muduo的TcpServer只支持InetAddress，这里自己完成监听和accept，
+ * 之后把连接包装成muduo::net::TcpConnection，交给TcpServer的IO线程池，所以连接上的读写、回调和TCP连接完全一样。
+ * 同一台机器上的客户端通过它连接可以绕过回环网卡上的TCP协议栈。
+ */
+class UnixServer
+{
+public:
+    /**
+     * @param loop 接受连接的EventLoop，也就是TcpServer的主EventLoop
+     * @param pool 连接分配到的IO线程池，需要已经启动
+     */
+    UnixServer(muduo::net::EventLoop *loop, const std::string &path, std::shared_ptr<muduo::net::EventLoopThreadPool> pool);
+    ~UnixServer();
+
+    void setConnectionCallback(const muduo::net::ConnectionCallback &cb) { m_connection_callback = cb; }
+    void setMessageCallback(const muduo::net::MessageCallback &cb) { m_message_callback = cb; }
+
+    // 开始监听，路径上已有的套接字文件（例如上次没有正常退出留下的，或者正在退出的旧进程的）会被替换
+    bool Start();
+    /**
+     * @brief 关闭监听套接字，不再接受新连接，已经建立的连接不受影响，在loop中调用
+     * 只有路径上还是自己创建的套接字文件时才删除它，新进程已经在同一路径上监听时不会删掉新进程的文件
+     */
+    void StopAccepting();
+    const std::string &path() const { return m_path; }
+
+private:
+    // 在loop中接受所有已经到达的连接
+    void OnAccept();
+    void RemoveConnection(const muduo::net::TcpConnectionPtr &conn);
+
+    muduo::net::EventLoop *m_loop;
+    std::string m_path;
+    std::shared_ptr<muduo::net::EventLoopThreadPool> m_pool;
+    int m_listen_fd;
+    ino_t m_inode; // 创建出的套接字文件的inode，用于判断路径上的文件是否已经被新进程替换
+    std::unique_ptr<muduo::net::Channel> m_channel;
+    muduo::net::ConnectionCallback m_connection_callback;
+    muduo::net::MessageCallback m_message_callback;
+    uint64_t m_next_conn_id;
+    std::unordered_map<std::string, muduo::net::TcpConnectionPtr> m_connections; // 只在m_loop中访问
+};
+
+/**
+ * @brief 连接path上的Unix域套接字
+ * 连接是立即完成的，返回的连接还需要设置好回调之后在loop中执行connectEstablished
+ * @return nullptr 连接失败，例如服务端没有在监听
+ */
+muduo::net::TcpConnectionPtr ConnectUnix(muduo::net::EventLoop *loop, const std::string &path, const std::string &name);
+
+// ip是否是本机的地址（回环地址或者本机某个网卡上的地址），本机网卡地址只在第一次调用时获取
+bool IsLocalAddress(const std::string &ip);
+
+}
@@ -0,0 +1,157 @@
+#include "zkregistry.h"
+#include <glog/logging.h>
+
+using namespace meha;
+
+// 所有服务节点的根节点
+static const std::string kRootPath = "/meha";
+
+bool ZkRegistry::Register(const std::string &service_name, const Endpoint &endpoint, std::function<void()> on_removed)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    ZkClient *zkclient = EnsureSession();
+    if (!zkclient) {
+        return false;
+    }
+    auto on_deleted = std::bind(&ZkRegistry::OnDeleted, this, std::placeholders::_1);
+    // service_name为永久节点(因为可能很多个该服务的实例），每个服务实例在它下面创建一个临时顺序节点，
+    // 同一个服务部署多个实例时各自的节点互不冲突，客户端从服务节点的子节点中选择一个实例
+    std::string service_path = kRootPath + "/" + service_name;
+    if (!zkclient->CreateNode(kRootPath, "", ZkClient::CreateMode::Persistent, on_deleted)
+        || !zkclient->CreateNode(service_path, "", ZkClient::CreateMode::Persistent, on_deleted)) {
+        return false;
+    }
+    // 实例节点为"/meha/service_name/instance-0000000001"，数据是该实例的ip:port（以及Unix域套接字路径，见Endpoint::Encode）
+    auto instance_path = zkclient->CreateNode(service_path + "/instance-", endpoint.Encode(), ZkClient::CreateMode::EphemeralSequential, on_deleted);
+    if (!instance_path) {
+        return false;
+    }
+    LOG(INFO) << service_name << " registered as " << *instance_path;
+    std::lock_guard<std::mutex> instances_lock(m_instances_mutex);
+    m_instances[*instance_path] = std::move(on_removed);
+    return true;
+}
+
+void ZkRegistry::Unregister(const std::string &service_name)
+{
+    // 先从m_instances中移除，节点被删除的通知到达时不再执行on_removed
+    std::string prefix = kRootPath + "/" + service_name + "/";
+    std::vector<std::string> instance_paths;
+    {
+        std::lock_guard<std::mutex> instances_lock(m_instances_mutex);
+        for (auto it = m_instances.begin(); it != m_instances.end();) {
+            if (it->first.starts_with(prefix)) {
+                instance_paths.push_back(it->first);
+                it = m_instances.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+    if (instance_paths.empty()) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    ZkClient *zkclient = EnsureSession();
+    if (!zkclient) {
+        // 连不上zk时等会话超时，临时节点也会被删除
+        LOG(ERROR) << "unregister " << service_name << " error, instance will be removed when session expires";
+        return;
+    }
+    for (auto &path : instance_paths) {
+        if (zkclient->DeleteNode(path)) {
+            LOG(INFO) << service_name << " unregistered, " << path << " deleted";
+        } else {
+            LOG(WARNING) << "delete " << path << " error";
+        }
+    }
+}
+
+std::optional<std::vector<Endpoint>> ZkRegistry::Lookup(const std::string &service_name)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    ZkClient *zkclient = EnsureSession();
+    if (!zkclient) {
+        return std::nullopt;
+    }
+    std::string service_path = kRootPath + "/" + service_name;
+    // 先设置服务节点的子节点watch，再读取各个实例节点，这样两次读取之间发生的变化也不会漏掉
+    auto children = zkclient->GetChildren(service_path, true);
+    if (!children) {
+        LOG(ERROR) << service_path + " is not exist!";
+        return std::nullopt;
+    }
+    std::vector<Endpoint> endpoints;
+    for (const auto &child : *children) {
+        // 实例节点是临时节点，数据在实例的生命周期内不会变化，不需要数据watch
+        auto host_data = zkclient->GetNodeData(service_path + "/" + child);
+        if (!host_data) {
+            // 读取子节点列表之后实例刚好下线了
+            continue;
+        }
+        auto endpoint = Endpoint::Parse(*host_data);
+        if (!endpoint) {
+            LOG(ERROR) << service_path + "/" + child + " address is invalid!";
+            continue;
+        }
+        endpoints.push_back(*endpoint);
+    }
+    return endpoints;
+}
+
+ZkClient *ZkRegistry::EnsureSession()
+{
+    if (m_zkclient && !m_session_expired) {
+        return m_zkclient.get();
+    }
+    // 过期的会话不能在watcher线程里关闭，只能在这里替换
+    m_zkclient = std::make_unique<ZkClient>();
+    m_session_expired = false;
+    m_zkclient->SetWatchCallback(std::bind(&ZkRegistry::OnWatch, this, std::placeholders::_1, std::placeholders::_2));
+    m_zkclient->SetSessionCallback(std::bind(&ZkRegistry::OnSession, this, std::placeholders::_1));
+    if (!m_zkclient->Start()) { // start返回true就代表成功连接上zk服务器了
+        m_zkclient.reset();
+        return nullptr;
+    }
+    return m_zkclient.get();
+}
+
+void ZkRegistry::OnWatch(int type, const std::string &path)
+{
+    if ((type == ZOO_CHILD_EVENT || type == ZOO_DELETED_EVENT) && path.starts_with(kRootPath + "/")) {
+        LOG(INFO) << "service " << path << " changed";
+        if (m_on_change) {
+            m_on_change(path.substr(kRootPath.size() + 1));
+        }
+    }
+}
+
+void ZkRegistry::OnSession(int state)
+{
+    if (state == ZOO_EXPIRED_SESSION_STATE) {
+        // 会话过期后所有的watch都失效了，本进程注册的临时节点也被删除了
+        LOG(WARNING) << "zookeeper session expired";
+        m_session_expired = true;
+        if (m_on_change) {
+            m_on_change("");
+        }
+    }
+}
+
+void ZkRegistry::OnDeleted(const std::string &path)
+{
+    std::function<void()> on_removed;
+    {
+        std::lock_guard<std::mutex> lock(m_instances_mutex);
+        auto it = m_instances.find(path);
+        if (it == m_instances.end()) {
+            return;
+        }
+        on_removed = std::move(it->second);
+        m_instances.erase(it);
+    }
+    LOG(WARNING) << "instance " << path << " removed from zookeeper";
+    if (on_removed) {
+        on_removed();
+    }
+}
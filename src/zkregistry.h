@@ -0,0 +1,46 @@
+#pragma once
+
+#include "serviceregistry.h"
+#include "zookeeperutil.h"
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+
+namespace meha
+{
+
+/**
+ * @brief 基于zookeeper的注册中心
+ * @details 服务节点为永久节点"/meha/<服务名>"，每个服务实例在它下面创建一个临时顺序节点"instance-xxxxxxxxxx"，
+ * 数据是实例的"ip:port"。实例进程退出时会话断开，节点自动删除。
+ * 查询时在服务节点上设置子节点watch，实例上线或下线时通知ChangeCallback。
+ * 会话过期后通知所有服务变化，并在下次操作时重建会话。
+ */
+class ZkRegistry : public ServiceRegistry
+{
+public:
+    ZkRegistry() = default;
+
+    bool Register(const std::string &service_name, const Endpoint &endpoint, std::function<void()> on_removed) override;
+    void Unregister(const std::string &service_name) override;
+    std::optional<std::vector<Endpoint>> Lookup(const std::string &service_name) override;
+    void SetChangeCallback(ChangeCallback cb) override { m_on_change = std::move(cb); }
+
+private:
+    // 确保zk会话可用，会话过期后重新建立，连不上zk时返回nullptr。调用时需要持有m_mutex
+    ZkClient *EnsureSession();
+    // 以下回调在zookeeper的watcher线程中执行
+    void OnWatch(int type, const std::string &path);
+    void OnSession(int state);
+    void OnDeleted(const std::string &path);
+
+    std::mutex m_mutex; // 串行化对zk的操作
+    std::unique_ptr<ZkClient> m_zkclient;
+    std::atomic<bool> m_session_expired = false; // 在watcher线程中设置，下次操作时重建会话
+    ChangeCallback m_on_change;
+
+    std::mutex m_instances_mutex; // 保护m_instances
+    std::unordered_map<std::string, std::function<void()>> m_instances; // 本进程注册的实例节点路径 -> on_removed
+};
+
+}
@@ -1,33 +1,52 @@
 #include "zookeeperutil.h"
+#include "common.h"
 #include "rpcconfig.h"
 #include <glog/logging.h>
-#include <semaphore>
 #include <zookeeper/zookeeper.h>
 
 using namespace meha;
 
 void ZkClient::Watcher::Global(zhandle_t *zh, int type, int status, const char *path, void *watcherCtx)
 {
+    // 全局watcher的上下文就是zookeeper_init时传入的ZkClient对象
+    auto *client = (ZkClient *)zoo_get_context(zh);
+    if (!client) {
+        return;
+    }
     if (type == ZOO_SESSION_EVENT) { // 回调消息类型和会话相关的消息类型
         if (status == ZOO_CONNECTED_STATE) { // zkclient和zkserver连接成功
-            auto *psem = (std::binary_semaphore *)zoo_get_context(zh);
-            if (psem) {
-                psem->release();
-            }
+            std::lock_guard<std::mutex> lock(client->m_mutex);
+            client->m_connected = true;
+            client->m_cond.notify_all();
+        }
+        if (client->m_callback.on_session) {
+            client->m_callback.on_session(status);
         }
-    } else if (ZOO_DELETED_EVENT) {
+    } else if (type == ZOO_DELETED_EVENT) {
         LOG(WARNING) << "Node deleted: " << path;
-        auto *callback = (Callback *)zoo_get_context(zh);
-        if (callback) {
-            if (callback->on_deleted) {
-                callback->on_deleted(::basename(path));
-            }
+        if (client->m_callback.on_deleted) {
+            client->m_callback.on_deleted(path);
         }
     }
 }
 
+void ZkClient::Watcher::Node(zhandle_t *zh, int type, int status, const char *path, void *watcherCtx)
+{
+    UNUSED(zh);
+    UNUSED(status);
+    // 会话事件由全局watcher统一处理
+    if (type == ZOO_SESSION_EVENT) {
+        return;
+    }
+    auto *client = (ZkClient *)watcherCtx;
+    if (client && client->m_callback.on_watch) {
+        client->m_callback.on_watch(type, path ? path : "");
+    }
+}
+
 ZkClient::ZkClient()
     : m_zhandle(nullptr)
+    , m_connected(false)
 {
 }
 
@@ -38,69 +57,98 @@ ZkClient::~ZkClient()
     }
 }
 
-void ZkClient::Start(uint64_t recv_timeout_ms)
+bool ZkClient::Start(uint64_t recv_timeout_ms)
 {
     std::string ip = RpcConfig::Instance().Lookup("zookeeper_ip").value_or("127.0.0.1"); // 获取zookeeper服务端的ip
     std::string port = RpcConfig::Instance().Lookup("zookeeper_port").value_or("2181"); // 获取zoo keeper服务端的port
 
     std::string host_str = ip + ":" + port;
 
-    auto *psem = new std::binary_semaphore(0);
-
     // 使用zookeeper_init初始化一个zk对象，异步建立rpcserver和zkclient之间的连接
-    m_zhandle = zookeeper_init(host_str.c_str(), Watcher::Global, recv_timeout_ms, nullptr, psem, 0);
+    m_zhandle = zookeeper_init(host_str.c_str(), Watcher::Global, recv_timeout_ms, nullptr, this, 0);
     if (nullptr == m_zhandle) { // 这个返回值不代表连接成功或者不成功
         LOG(ERROR) << "zookeeper_init error: " << google::StrError(errno);
-        exit(EXIT_FAILURE);
+        return false;
     }
 
-    psem->acquire();
-    delete psem;
-    zoo_set_context(m_zhandle, &m_callback);
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (!m_cond.wait_for(lock, std::chrono::milliseconds(recv_timeout_ms), [this] { return m_connected; })) {
+        // zookeeper_init会在后台一直重连，连不上时要关闭句柄让它停下来
+        lock.unlock();
+        LOG(ERROR) << "connect to zookeeper " << host_str << " timeout";
+        zookeeper_close(m_zhandle);
+        m_zhandle = nullptr;
+        return false;
+    }
     LOG(INFO) << "zookeeper_init success";
+    return true;
 }
 
-void ZkClient::CreateNode(const std::string &path, const std::string &data, CreateMode mode, std::function<void(const std::string&)> on_deleted)
+std::optional<std::string> ZkClient::CreateNode(const std::string &path, const std::string &data, CreateMode mode, std::function<void(const std::string&)> on_deleted)
 {
     m_callback.on_deleted = on_deleted;
     // 创建znode节点，可以选择永久性节点还是临时节点。
     char path_buffer[128];
     int bufferlen = sizeof(path_buffer);
-    int flag = zoo_exists(m_zhandle, path.c_str(), 1, nullptr);
+    // 顺序节点每次都会创建出新的节点，不需要检查是否已经存在
+    bool sequential = mode == PersistentSequential || mode == EphemeralSequential;
+    int flag = sequential ? ZNONODE : zoo_exists(m_zhandle, path.c_str(), 1, nullptr);
     if (flag == ZNONODE) { // 表示节点不存在
         // 创建指定的path的znode节点
         flag = zoo_create(m_zhandle, path.c_str(), data.c_str(), data.size(), &ZOO_OPEN_ACL_UNSAFE, mode, path_buffer, bufferlen);
         if (flag == ZOK) {
-            LOG(INFO) << "znode create success... path:" << path;
-            return;
+            LOG(INFO) << "znode create success... path:" << path_buffer;
+            if (sequential) {
+                // 在实际创建出的节点上设置watch，节点被删除时通知on_deleted
+                zoo_exists(m_zhandle, path_buffer, 1, nullptr);
+            }
+            return path_buffer;
         } else {
-            LOG(ERROR) << "znode create failed... path:" << path;
-            exit(EXIT_FAILURE);
+            LOG(ERROR) << "znode create failed... path:" << path << " error: " << zerror(flag);
+            return std::nullopt;
         }
     }
+    if (flag != ZOK) {
+        LOG(ERROR) << "zoo_exists error: " << zerror(flag) << " path:" << path;
+        return std::nullopt;
+    }
     LOG(INFO) << "znode already exists... path:" << path;
+    return path;
 }
 
-void ZkClient::DeleteNode(const std::string &path)
+bool ZkClient::DeleteNode(const std::string &path)
 {
     int flag = zoo_delete(m_zhandle, path.c_str(), -1);
     if (flag != ZOK) {
-        LOG(ERROR) << "zoo_delete error";
-        exit(EXIT_FAILURE);
-    } else {
-        LOG(INFO) << "zoo_delete success... path:" << path;
+        LOG(ERROR) << "zoo_delete error: " << zerror(flag) << " path:" << path;
+        return false;
     }
+    LOG(INFO) << "zoo_delete success... path:" << path;
+    return true;
 }
 
-std::optional<std::string> ZkClient::GetNodeData(const std::string &path)
+std::optional<std::string> ZkClient::GetNodeData(const std::string &path, bool watch)
 {
-    char buf[64];
+    char buf[256];
     int bufferlen = sizeof(buf);
-    int flag = zoo_get(m_zhandle, path.c_str(), 0, buf, &bufferlen, nullptr);
+    int flag = zoo_wget(m_zhandle, path.c_str(), watch ? Watcher::Node : nullptr, watch ? this : nullptr, buf, &bufferlen, nullptr);
+    if (flag != ZOK) {
+        LOG(ERROR) << "zoo_get error: " << zerror(flag) << " path:" << path;
+        return std::nullopt;
+    }
+    // 节点数据不是以'\0'结尾的，bufferlen为-1表示节点没有数据
+    return std::string(buf, bufferlen > 0 ? bufferlen : 0);
+}
+
+std::optional<std::vector<std::string>> ZkClient::GetChildren(const std::string &path, bool watch)
+{
+    struct String_vector children = {};
+    int flag = zoo_wget_children(m_zhandle, path.c_str(), watch ? Watcher::Node : nullptr, watch ? this : nullptr, &children);
     if (flag != ZOK) {
-        LOG(ERROR) << "zoo_get error";
+        LOG(ERROR) << "zoo_get_children error: " << zerror(flag) << " path:" << path;
         return std::nullopt;
-    } else {
-        return buf;
     }
+    std::vector<std::string> result(children.data, children.data + children.count);
+    deallocate_String_vector(&children);
+    return result;
 }
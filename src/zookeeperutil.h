@@ -1,8 +1,12 @@
 #pragma once
 
+#include <chrono>
+#include <condition_variable>
 #include <functional>
+#include <mutex>
 #include <optional>
 #include <string>
+#include <vector>
 #include <zookeeper/zookeeper.h>
 
 namespace meha
@@ -21,17 +25,20 @@ class ZkClient
     struct Watcher
     {
         static void Global(zhandle_t *zh, int type, int status, const char *path, void *watcherCtx);
-    };
-    struct Callback
-    {
-        std::function<void(const std::string&)> on_deleted;
+        // GetNodeData/GetChildren设置的一次性watch的回调
+        static void Node(zhandle_t *zh, int type, int status, const char *path, void *watcherCtx);
     };
 public:
+    // 节点watch触发时的回调，参数为事件类型(ZOO_CHANGED_EVENT等)和节点路径
+    using WatchCallback = std::function<void(int type, const std::string &path)>;
+    // 会话状态变化时的回调，参数为会话状态(ZOO_CONNECTED_STATE、ZOO_EXPIRED_SESSION_STATE等)
+    using SessionCallback = std::function<void(int state)>;
+
     enum CreateMode {
         Persistent = 0, // ZOO_PERSISTENT,
         Ephemeral = 1, // ZOO_EPHEMERAL,
-        EphemeralSequential = 2, // ZOO_PERSISTENT_SEQUENTIAL
-        PersistentSequential = 3, // ZOO_EPHEMERAL_SEQUENTIAL,
+        PersistentSequential = 2, // ZOO_PERSISTENT_SEQUENTIAL
+        EphemeralSequential = 3, // ZOO_EPHEMERAL_SEQUENTIAL,
         Container = 4, // ZOO_CONTAINER
         PersistentWithTTL = 5, // ZOO_PERSISTENT_WITH_TTL
         PersistentSequentialWithTTL = 6, // ZOO_PERSISTENT_SEQUENTIAL_WITH_TTL
@@ -39,20 +46,47 @@ public:
 
     explicit ZkClient();
     ~ZkClient();
-    // zkclient启动连接zkserver
-    void Start(uint64_t recv_timeout_ms = 10000);
-    // 在zkserver中根据指定的path创建一个节点
-    void CreateNode(const std::string &path, const std::string &data, CreateMode mode = Persistent
-                    , std::function<void(const std::string&)> on_deleted = nullptr);
+    // zkclient启动连接zkserver，在recv_timeout_ms之内没有连上时返回false
+    bool Start(uint64_t recv_timeout_ms = 10000);
+    /**
+     * @brief 在zkserver中根据指定的path创建一个节点
+     * 顺序节点的实际路径是path后面加上zk分配的序号
+     * @param on_deleted 节点被删除时在watcher线程中执行，参数为被删除节点的完整路径
+     * @return std::optional<std::string> 创建出的节点的实际路径，节点已经存在时返回path，失败时返回std::nullopt
+     */
+    std::optional<std::string> CreateNode(const std::string &path, const std::string &data, CreateMode mode = Persistent
+                           , std::function<void(const std::string&)> on_deleted = nullptr);
     // 在zkserver中删除指定的path节点
-    void DeleteNode(const std::string &path);
-    // 根据参数指定的znode节点路径获取znode节点值
-    std::optional<std::string> GetNodeData(const std::string &path);
+    bool DeleteNode(const std::string &path);
+    /**
+     * @brief 根据参数指定的znode节点路径获取znode节点值
+     * @param watch 为true时在该节点上设置数据watch，节点数据变化或被删除时通过WatchCallback通知一次
+     */
+    std::optional<std::string> GetNodeData(const std::string &path, bool watch = false);
+    /**
+     * @brief 获取指定znode节点的所有子节点名
+     * @param watch 为true时在该节点上设置子节点watch，子节点增删时通过WatchCallback通知一次
+     */
+    std::optional<std::vector<std::string>> GetChildren(const std::string &path, bool watch = false);
+
+    // 下面两个回调需要在Start之前设置，它们在zookeeper的watcher线程中执行
+    void SetWatchCallback(WatchCallback cb) { m_callback.on_watch = std::move(cb); }
+    void SetSessionCallback(SessionCallback cb) { m_callback.on_session = std::move(cb); }
 
 private:
+    struct Callback
+    {
+        std::function<void(const std::string&)> on_deleted;
+        WatchCallback on_watch;
+        SessionCallback on_session;
+    };
 
     // Zk的客户端句柄
     zhandle_t *m_zhandle;
     Callback m_callback;
+    // Start中等待会话建立
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    bool m_connected;
 };
 }
\ No newline at end of file